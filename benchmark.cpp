@@ -0,0 +1,516 @@
+// benchmark of fixed scenes and configurations
+// reports wall time of each phase, throughput and per-thread counters as JSON
+// usage: benchmark [--scene=FILE] [--output=FILE] [--config=NAME]
+// NOTE: counters are compiled out of other targets
+#ifndef PM_ENABLE_STATS
+#define PM_ENABLE_STATS
+#endif
+#include <omp.h>
+
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "camera.h"
+#include "image.h"
+#include "integrator.h"
+#include "options.h"
+#include "photon_map.h"
+#include "renderer.h"
+#include "sampler.h"
+#include "scene.h"
+#include "sppm.h"
+#include "stats.h"
+#include "wavefront.h"
+
+// settings shared by all configurations
+// NOTE: same as `main 128 128 4 100000 50 2 50 1 5`, sppm takes 8 passes of the
+// same number of photons
+constexpr int width = 128;
+constexpr int height = 128;
+constexpr int nSamples = 4;
+constexpr int nPhotons = 100000;
+constexpr int nEstimationGlobal = 50;
+constexpr float nPhotonsCausticsMultiplier = 2;
+constexpr int nEstimationCaustics = 50;
+constexpr int finalGatheringDepth = 1;
+constexpr int maxDepth = 5;
+constexpr int nPassesSPPM = 8;
+constexpr float radiusSPPM = 0.05f;
+
+struct BenchmarkConfig
+{
+    const char *name;
+    const char *integrator; // recursive, wavefront or sppm
+    PhotonMapLayout layout;
+    PhotonFormat format;
+    int irradianceStride;
+    SamplerType samplerType;
+};
+
+const BenchmarkConfig configs[] = {
+    {"recursive", "recursive", PhotonMapLayout::KD_TREE, PhotonFormat::FULL, 0,
+     SamplerType::UNIFORM},
+    {"left-balanced", "recursive", PhotonMapLayout::LEFT_BALANCED,
+     PhotonFormat::FULL, 0, SamplerType::UNIFORM},
+    {"bucketed-compact", "recursive", PhotonMapLayout::BUCKETED,
+     PhotonFormat::COMPACT, 0, SamplerType::UNIFORM},
+    {"irradiance-cache", "recursive", PhotonMapLayout::KD_TREE,
+     PhotonFormat::FULL, 4, SamplerType::UNIFORM},
+    {"sobol", "recursive", PhotonMapLayout::KD_TREE, PhotonFormat::FULL, 0,
+     SamplerType::SOBOL},
+    {"wavefront", "wavefront", PhotonMapLayout::KD_TREE, PhotonFormat::FULL, 0,
+     SamplerType::UNIFORM},
+    {"sppm", "sppm", PhotonMapLayout::KD_TREE, PhotonFormat::FULL, 0,
+     SamplerType::UNIFORM},
+    {"out-of-core", "recursive", PhotonMapLayout::OUT_OF_CORE,
+     PhotonFormat::FULL, 0, SamplerType::UNIFORM},
+};
+
+// chunks of out-of-core photon maps, small enough that the resident budget
+// forces paging at the benchmark photon count
+constexpr int outOfCoreChunkSize = 4096;
+constexpr size_t outOfCoreResidentBytes = 16 * outOfCoreChunkSize * sizeof(Photon);
+
+const char *layoutName(const PhotonMapLayout &layout)
+{
+    switch (layout)
+    {
+    case PhotonMapLayout::LEFT_BALANCED:
+        return "left-balanced";
+    case PhotonMapLayout::BUCKETED:
+        return "bucketed";
+    case PhotonMapLayout::OUT_OF_CORE:
+        return "out-of-core";
+    default:
+        return "kd-tree";
+    }
+}
+
+const char *samplerName(const SamplerType &type)
+{
+    switch (type)
+    {
+    case SamplerType::SOBOL:
+        return "sobol";
+    case SamplerType::HALTON:
+        return "halton";
+    default:
+        return "uniform";
+    }
+}
+
+std::unique_ptr<Sampler> createSampler(const SamplerType &type)
+{
+    switch (type)
+    {
+    case SamplerType::SOBOL:
+        return std::make_unique<SobolSampler>();
+    case SamplerType::HALTON:
+        return std::make_unique<HaltonSampler>();
+    default:
+        return std::make_unique<UniformSampler>();
+    }
+}
+
+// minimal JSON writer, members are written in call order
+class JsonWriter
+{
+private:
+    std::ostream &out;
+    // whether the current object/array has no member yet
+    std::vector<bool> empty;
+
+    void writeString(const std::string &s)
+    {
+        out << '"';
+        for (const char c : s)
+        {
+            if (c == '"' || c == '\\')
+            {
+                out << '\\' << c;
+            }
+            else if (static_cast<unsigned char>(c) < 0x20)
+            {
+                out << ' ';
+            }
+            else
+            {
+                out << c;
+            }
+        }
+        out << '"';
+    }
+
+    // separator, indent and key of the next member
+    void beginMember(const char *key)
+    {
+        if (!empty.empty())
+        {
+            if (!empty.back())
+            {
+                out << ',';
+            }
+            empty.back() = false;
+            out << '\n' << std::string(2 * empty.size(), ' ');
+        }
+        if (key != nullptr)
+        {
+            writeString(key);
+            out << ": ";
+        }
+    }
+
+    void end(char bracket)
+    {
+        const bool was_empty = empty.back();
+        empty.pop_back();
+        if (!was_empty)
+        {
+            out << '\n' << std::string(2 * empty.size(), ' ');
+        }
+        out << bracket;
+    }
+
+public:
+    JsonWriter(std::ostream &out) : out(out) { out.precision(9); }
+
+    // key is nullptr inside arrays and for the root
+    void beginObject(const char *key = nullptr)
+    {
+        beginMember(key);
+        out << '{';
+        empty.push_back(true);
+    }
+    void endObject() { end('}'); }
+
+    void beginArray(const char *key = nullptr)
+    {
+        beginMember(key);
+        out << '[';
+        empty.push_back(true);
+    }
+    void endArray() { end(']'); }
+
+    void write(const char *key, const std::string &value)
+    {
+        beginMember(key);
+        writeString(value);
+    }
+    void write(const char *key, const char *value)
+    {
+        write(key, std::string(value));
+    }
+    void write(const char *key, double value)
+    {
+        beginMember(key);
+        // NOTE: JSON has no inf or nan
+        if (std::isfinite(value))
+        {
+            out << value;
+        }
+        else
+        {
+            out << "null";
+        }
+    }
+    void write(const char *key, uint64_t value)
+    {
+        beginMember(key);
+        out << value;
+    }
+    void write(const char *key, int value)
+    {
+        beginMember(key);
+        out << value;
+    }
+};
+
+void writeCounters(JsonWriter &json, const char *key,
+                   const ThreadCounters &counters)
+{
+    json.beginObject(key);
+    json.write("rays", counters.rays);
+    json.write("shadow_rays", counters.shadowRays);
+    json.write("photons", counters.photons);
+    json.write("knn_queries", counters.knnQueries);
+    json.write("radius_queries", counters.radiusQueries);
+    json.write("irradiance_lookups", counters.irradianceLookups);
+    json.write("camera_samples", counters.cameraSamples);
+    json.write("chunk_loads", counters.chunkLoads);
+    json.endObject();
+}
+
+// counters of all threads since last reset
+struct StatsSnapshot
+{
+    ThreadCounters total;
+    std::vector<ThreadCounters> threads;
+};
+
+// take counters of all threads and reset them
+StatsSnapshot takeStats()
+{
+    StatsSnapshot snapshot;
+    snapshot.total = Stats::get().getTotal();
+    snapshot.threads = Stats::get().getPerThread();
+    Stats::get().reset();
+    return snapshot;
+}
+
+void writeStats(JsonWriter &json, const char *key, const StatsSnapshot &stats)
+{
+    json.beginObject(key);
+    writeCounters(json, "total", stats.total);
+    json.beginArray("threads");
+    for (const auto &counters : stats.threads)
+    {
+        writeCounters(json, nullptr, counters);
+    }
+    json.endArray();
+    json.endObject();
+}
+
+// events per second, 0 when nothing was measured
+double getThroughput(uint64_t count, double seconds)
+{
+    return seconds > 0 ? count / seconds : 0;
+}
+
+void runBenchmark(const BenchmarkConfig &config, const std::string &scene_file,
+                  JsonWriter &json)
+{
+    std::cout << "Benchmark " << config.name << "..." << std::endl;
+    using Clock = std::chrono::steady_clock;
+
+    json.beginObject();
+    json.write("name", config.name);
+
+    json.beginObject("settings");
+    json.write("width", width);
+    json.write("height", height);
+    json.write("integrator", config.integrator);
+    const bool sppm = std::string(config.integrator) == "sppm";
+    if (sppm)
+    {
+        json.write("passes", nPassesSPPM);
+        json.write("photons_per_pass", nPhotons);
+        json.write("radius", radiusSPPM);
+    }
+    else
+    {
+        json.write("samples", nSamples);
+        json.write("photons", nPhotons);
+        json.write("estimation_global", nEstimationGlobal);
+        json.write("caustics_multiplier", nPhotonsCausticsMultiplier);
+        json.write("estimation_caustics", nEstimationCaustics);
+        json.write("final_gathering_depth", finalGatheringDepth);
+        json.write("photon_map_layout", layoutName(config.layout));
+        json.write("photon_format",
+                   config.format == PhotonFormat::COMPACT ? "compact" : "full");
+        json.write("irradiance_stride", config.irradianceStride);
+        json.write("sampler", samplerName(config.samplerType));
+    }
+    json.write("max_depth", maxDepth);
+    json.endObject();
+
+    PhaseTimes phase_times;
+    PhaseTimer timer(phase_times);
+    Stats::get().reset();
+
+    // NOTE: scene cache is off so that load measures obj parsing
+    timer.begin("load");
+    Scene scene;
+    scene.loadModel(scene_file, false);
+    timer.begin("scene build");
+    scene.build();
+    timer.end();
+
+    Camera camera(Vec3f(0, 1, 6), Vec3f(0, 0, -1), 0.25 * PI);
+    Image image(width, height);
+
+    double photon_seconds = 0;
+    double render_seconds = 0;
+    uint64_t global_photons = 0;
+    uint64_t caustics_photons = 0;
+    StatsSnapshot build_stats;
+    StatsSnapshot render_stats;
+    if (sppm)
+    {
+        ProgressivePhotonMapping integrator(nPhotons, radiusSPPM, maxDepth);
+        const auto start = Clock::now();
+        integrator.render(scene, camera, nPassesSPPM, image);
+        render_seconds =
+            std::chrono::duration<double>(Clock::now() - start).count();
+        for (const auto &[name, seconds] : integrator.getPhaseTimes().getPhases())
+        {
+            phase_times.add(name, seconds);
+        }
+        phase_times.add("render", render_seconds);
+        photon_seconds = integrator.getPhaseTimes().get("photon pass");
+        render_stats = takeStats();
+    }
+    else
+    {
+        std::unique_ptr<PhotonMapping> integrator;
+        if (std::string(config.integrator) == "wavefront")
+        {
+            integrator = std::make_unique<WavefrontPhotonMapping>(
+                nPhotons, nEstimationGlobal, nPhotonsCausticsMultiplier,
+                nEstimationCaustics, finalGatheringDepth, maxDepth);
+        }
+        else
+        {
+            integrator = std::make_unique<PhotonMapping>(
+                nPhotons, nEstimationGlobal, nPhotonsCausticsMultiplier,
+                nEstimationCaustics, finalGatheringDepth, maxDepth);
+        }
+        integrator->setPhotonMapLayout(config.layout);
+        integrator->setPhotonFormat(config.format);
+        integrator->setIrradianceStride(config.irradianceStride);
+        integrator->setCamera(camera, static_cast<float>(width) / height);
+        if (config.layout == PhotonMapLayout::OUT_OF_CORE)
+        {
+            integrator->setPhotonMapOutOfCore(
+                std::filesystem::temp_directory_path() / "pm-benchmark",
+                outOfCoreResidentBytes, outOfCoreChunkSize);
+        }
+
+        const std::unique_ptr<Sampler> sampler = createSampler(config.samplerType);
+        integrator->build(scene, *sampler);
+        for (const auto &[name, seconds] : integrator->getPhaseTimes().getPhases())
+        {
+            phase_times.add(name, seconds);
+        }
+        photon_seconds = integrator->getPhaseTimes().get("global photon tracing") +
+                         integrator->getPhaseTimes().get("caustics photon tracing");
+        global_photons = integrator->getGlobalPhotonMap().getNPhotons();
+        caustics_photons = integrator->getCausticsPhotonMap().getNPhotons();
+        build_stats = takeStats();
+
+        Renderer renderer;
+        renderer.setSampler(*sampler);
+        renderer.render(*integrator, scene, camera, nSamples, image);
+        render_seconds = renderer.getRenderTime();
+        phase_times.add("render", render_seconds);
+        render_stats = takeStats();
+    }
+
+    json.beginArray("phases");
+    for (const auto &[name, seconds] : phase_times.getPhases())
+    {
+        json.beginObject();
+        json.write("name", name);
+        json.write("seconds", seconds);
+        json.endObject();
+    }
+    json.endArray();
+
+    if (!sppm)
+    {
+        json.beginObject("photon_maps");
+        json.write("global_photons", global_photons);
+        json.write("caustics_photons", caustics_photons);
+        json.endObject();
+    }
+
+    // NOTE: photons of sppm are traced while rendering
+    const ThreadCounters &photon_counters =
+        sppm ? render_stats.total : build_stats.total;
+    const ThreadCounters &render_counters = render_stats.total;
+    json.beginObject("throughput");
+    json.write("photons_per_second",
+               getThroughput(photon_counters.photons, photon_seconds));
+    if (!sppm)
+    {
+        json.write("photon_tracing_mrays_per_second",
+                   getThroughput(photon_counters.rays + photon_counters.shadowRays,
+                                 photon_seconds) /
+                       1e6);
+    }
+    json.write("render_mrays_per_second",
+               getThroughput(render_counters.rays + render_counters.shadowRays,
+                             render_seconds) /
+                   1e6);
+    json.write("knn_queries_per_second",
+               getThroughput(render_counters.knnQueries, render_seconds));
+    json.write("camera_samples_per_second",
+               getThroughput(render_counters.cameraSamples, render_seconds));
+    json.endObject();
+
+    json.beginObject("counters");
+    if (!sppm)
+    {
+        writeStats(json, "build", build_stats);
+    }
+    writeStats(json, "render", render_stats);
+    json.endObject();
+
+    json.endObject();
+}
+
+int main(int argc, char **argv)
+{
+    std::string scene_file = "cornellbox-water2.obj";
+    std::string output = "benchmark.json";
+    std::string config_name;
+    for (int i = 1; i < argc; ++i)
+    {
+        const std::string arg = argv[i];
+        std::string value;
+        if (parseOption(arg, "scene", value))
+        {
+            scene_file = value;
+        }
+        else if (parseOption(arg, "output", value))
+        {
+            output = value;
+        }
+        else if (parseOption(arg, "config", value))
+        {
+            config_name = value;
+        }
+        else
+        {
+            std::cout << "Warning: Unknown argument " << arg << std::endl;
+        }
+    }
+
+    // NOTE: progress of each phase goes to stdout, so the report is written to
+    // a file
+    std::ofstream file(output);
+    if (!file)
+    {
+        std::cout << "Error: Failed to open " << output << std::endl;
+        return 1;
+    }
+
+    JsonWriter json(file);
+    json.beginObject();
+    json.write("scene", scene_file);
+    json.write("threads", omp_get_max_threads());
+    json.beginArray("configs");
+    bool found = config_name.empty();
+    for (const auto &config : configs)
+    {
+        if (!config_name.empty() && config_name != config.name)
+            continue;
+        found = true;
+        runBenchmark(config, scene_file, json);
+    }
+    json.endArray();
+    json.endObject();
+    file << std::endl;
+
+    if (!found)
+    {
+        std::cout << "Warning: Unknown config " << config_name << std::endl;
+    }
+    std::cout << "Wrote " << output << std::endl;
+}
@@ -0,0 +1,429 @@
+// benchmark of kd-tree variants over growing photon distributions
+// measures build time, memory and latency percentiles of k-nearest and radius
+// queries, one CSV row per distribution, size, format, variant and query
+// usage: kdtree_scaling [max_points] [n_queries] [captured.pmphotons]
+// NOTE: sizes are powers of ten from 1e5 to max_points. captured photons are
+// read from a photon map cache of main(--photon-map-cache=DIR)
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <string>
+#include <vector>
+
+#include "mapped_file.h"
+#include "photon_map.h"
+#include "sampler.h"
+
+// numbers of nearest photons of k-nearest queries
+constexpr int ks[] = {1, 10, 50, 200};
+
+// radius queries use the median distance of this many nearest photons
+constexpr int kRadius = 50;
+
+// SORT build is serial and O(n log^2 n), so it is skipped for larger trees
+constexpr int maxSortBuildPoints = 1000000;
+
+// random point on the walls of unit box, like photons of a closed room
+Vec3f samplePointOnBox(Sampler &sampler, const Vec2f &uv)
+{
+    const int face = std::min(static_cast<int>(6 * sampler.getNext1D()), 5);
+    const int axis = face / 2;
+    Vec3f p;
+    p[axis] = face % 2;
+    p[(axis + 1) % 3] = uv[0];
+    p[(axis + 2) % 3] = uv[1];
+    return p;
+}
+
+// standard normal sample(Box-Muller)
+Vec2f sampleNormal(Sampler &sampler)
+{
+    const Vec2f u = sampler.getNext2D();
+    const float r = std::sqrt(-2.0f * std::log(std::max(1.0f - u[0], 1e-7f)));
+    return Vec2f(r * std::cos(2.0f * PI * u[1]), r * std::sin(2.0f * PI * u[1]));
+}
+
+// positions of photons persisted by photon map cache
+// NOTE: only the photon section is read, so any format and layout works
+bool loadCapturedPositions(const std::string &filepath,
+                           std::vector<Vec3f> &positions)
+{
+    MappedFile file;
+    if (!file.open(filepath) || file.size() < sizeof(PhotonMapFileHeader))
+        return false;
+
+    PhotonMapFileHeader header;
+    std::memcpy(&header, file.data(), sizeof(PhotonMapFileHeader));
+    const uint64_t offset = header.sectionOffsets[0];
+    const uint64_t count = header.sectionCounts[0];
+    const uint64_t element_size = header.sectionElementSizes[0];
+    if (std::memcmp(header.magic, photonMapMagic, sizeof(header.magic)) != 0 ||
+        offset > file.size() || count * element_size > file.size() - offset)
+        return false;
+
+    positions.resize(count);
+    const std::byte *data = file.data() + offset;
+    for (uint64_t i = 0; i < count; ++i)
+    {
+        if (element_size == sizeof(Photon))
+        {
+            Photon photon;
+            std::memcpy(&photon, data + i * element_size, sizeof(Photon));
+            positions[i] = photon.position;
+        }
+        else if (element_size == sizeof(CompactPhoton))
+        {
+            CompactPhoton photon;
+            std::memcpy(&photon, data + i * element_size, sizeof(CompactPhoton));
+            positions[i] = photon.position;
+        }
+        else
+        {
+            return false;
+        }
+    }
+    return count > 0;
+}
+
+// distribution of synthetic or captured photon positions
+class Distribution
+{
+private:
+    std::string name;
+    std::vector<Vec3f> captured;
+
+    // centers of clusters on box walls, like caustics under a glass
+    static constexpr int nClusters = 8;
+    static constexpr float clusterSigma = 0.02f;
+
+    // extent of jitter added to resampled captured positions
+    float jitter = 0;
+
+public:
+    Distribution(const std::string &name) : name(name) {}
+
+    Distribution(const std::string &name, std::vector<Vec3f> &&positions)
+        : name(name), captured(std::move(positions))
+    {
+        // NOTE: resampling repeats captured photons, jitter them by a fraction
+        // of the mean spacing to avoid coincident points
+        Vec3f bmin(std::numeric_limits<float>::max());
+        Vec3f bmax(std::numeric_limits<float>::lowest());
+        for (const auto &p : captured)
+        {
+            for (int d = 0; d < 3; ++d)
+            {
+                bmin[d] = std::min(bmin[d], p[d]);
+                bmax[d] = std::max(bmax[d], p[d]);
+            }
+        }
+        const Vec3f extent = bmax - bmin;
+        jitter = 0.1f * std::max(extent[0], std::max(extent[1], extent[2])) /
+                 std::sqrt(static_cast<float>(captured.size()));
+    }
+
+    const std::string &getName() const { return name; }
+
+    Vec3f sample(Sampler &sampler) const
+    {
+        if (!captured.empty())
+        {
+            const uint64_t idx = std::min<uint64_t>(
+                sampler.getNext1D() * captured.size(), captured.size() - 1);
+            Vec3f p = captured[idx];
+            for (int d = 0; d < 3; ++d)
+            {
+                p[d] += jitter * (2.0f * sampler.getNext1D() - 1.0f);
+            }
+            return p;
+        }
+        else if (name == "uniform")
+        {
+            return Vec3f(sampler.getNext1D(), sampler.getNext1D(),
+                         sampler.getNext1D());
+        }
+        else if (name == "clustered")
+        {
+            // half of photons around a few centers, the rest is spread evenly
+            if (sampler.getNext1D() < 0.5f)
+            {
+                const int cluster =
+                    std::min(static_cast<int>(nClusters * sampler.getNext1D()),
+                             nClusters - 1);
+                const Vec2f center(hashUint(2 * cluster) / 4294967296.0f,
+                                   hashUint(2 * cluster + 1) / 4294967296.0f);
+                const Vec2f offset = sampleNormal(sampler);
+                const Vec2f uv(
+                    std::clamp(center[0] + clusterSigma * offset[0], 0.0f, 1.0f),
+                    std::clamp(center[1] + clusterSigma * offset[1], 0.0f, 1.0f));
+                return samplePointOnBox(sampler, uv);
+            }
+            return samplePointOnBox(sampler, sampler.getNext2D());
+        }
+        else
+        {
+            return samplePointOnBox(sampler, sampler.getNext2D());
+        }
+    }
+};
+
+// bytes of tree structure on top of the point array
+template <typename PointT>
+size_t getTreeBytes(const KdTree<PointT> &tree)
+{
+    return tree.getNNodes() * sizeof(typename KdTree<PointT>::Node);
+}
+
+template <typename PointT>
+size_t getTreeBytes(const LeftBalancedKdTree<PointT> &tree)
+{
+    return tree.getNAxisBytes();
+}
+
+template <typename PointT>
+size_t getTreeBytes(const ChunkedKdTree<PointT> &tree)
+{
+    return tree.getNNodes() * sizeof(typename ChunkedKdTree<PointT>::Node) +
+           tree.getNAxisBytes();
+}
+
+template <typename PointT, int BucketSize>
+size_t getTreeBytes(const BucketKdTree<PointT, BucketSize> &tree)
+{
+    return tree.getNNodes() *
+               sizeof(typename BucketKdTree<PointT, BucketSize>::Node) +
+           tree.getNBuckets() *
+               sizeof(typename BucketKdTree<PointT, BucketSize>::Bucket);
+}
+
+// percentile of sorted latencies
+double getPercentile(const std::vector<double> &sorted, double p)
+{
+    const size_t idx =
+        std::min(static_cast<size_t>(p * sorted.size()), sorted.size() - 1);
+    return sorted[idx];
+}
+
+// columns shared by all rows of a tree
+struct TreeRow
+{
+    std::string distribution;
+    int nPoints;
+    const char *format;
+    std::string variant;
+    double buildTime;
+    size_t bytes;
+};
+
+void printHeader()
+{
+    std::cout << "distribution,points,format,variant,build_s,memory_mb,"
+                 "bytes_per_point,query,k,p50_us,p90_us,p99_us,max_us,"
+                 "mean_found,checksum"
+              << std::endl;
+}
+
+// sort latencies and print a row
+void printRow(const TreeRow &row, const char *query, int k,
+              std::vector<double> &latencies, double mean_found,
+              double checksum)
+{
+    std::sort(latencies.begin(), latencies.end());
+    std::cout << row.distribution << ',' << row.nPoints << ',' << row.format
+              << ',' << row.variant << ',' << row.buildTime << ','
+              << row.bytes / (1024.0 * 1024.0) << ','
+              << static_cast<double>(row.bytes) / row.nPoints << ',' << query
+              << ',' << k << ',' << 1e6 * getPercentile(latencies, 0.5) << ','
+              << 1e6 * getPercentile(latencies, 0.9) << ','
+              << 1e6 * getPercentile(latencies, 0.99) << ','
+              << 1e6 * latencies.back() << ',' << mean_found << ',' << checksum
+              << std::endl;
+}
+
+// time every query on its own on a single thread
+// NOTE: checksums are sums of squared distances, equal for all variants
+template <typename Tree>
+void benchmarkQueries(TreeRow row, const Tree &tree,
+                      const std::vector<Vec3f> &queries)
+{
+    using Clock = std::chrono::steady_clock;
+    std::vector<double> latencies(queries.size());
+    KNNHeap heap;
+
+    float radius2 = 0;
+    for (const int k : ks)
+    {
+        double found = 0;
+        double checksum = 0;
+        std::vector<float> max_dist2(queries.size(), 0);
+        for (size_t i = 0; i < queries.size(); ++i)
+        {
+            const auto start = Clock::now();
+            tree.searchKNearest(queries[i], k, heap);
+            latencies[i] = std::chrono::duration<double>(Clock::now() - start).count();
+
+            found += heap.size();
+            if (!heap.empty())
+            {
+                max_dist2[i] = heap.maxDist2();
+                checksum += max_dist2[i];
+            }
+        }
+        if (k == kRadius)
+        {
+            std::nth_element(max_dist2.begin(),
+                             max_dist2.begin() + max_dist2.size() / 2,
+                             max_dist2.end());
+            radius2 = max_dist2[max_dist2.size() / 2];
+        }
+        printRow(row, "knn", k, latencies, found / queries.size(), checksum);
+    }
+
+    double found = 0;
+    double checksum = 0;
+    for (size_t i = 0; i < queries.size(); ++i)
+    {
+        int n_found = 0;
+        double sum_dist2 = 0;
+        const auto start = Clock::now();
+        tree.searchRadius(queries[i], radius2,
+                          [&](int, float dist2)
+                          {
+                              ++n_found;
+                              sum_dist2 += dist2;
+                          });
+        latencies[i] = std::chrono::duration<double>(Clock::now() - start).count();
+        found += n_found;
+        checksum += sum_dist2;
+    }
+    printRow(row, "radius", kRadius, latencies, found / queries.size(), checksum);
+}
+
+// build and query every variant over points of the given format
+template <typename PointT>
+void benchmarkVariants(const std::string &distribution, const char *format,
+                       const std::vector<PointT> &points,
+                       const std::vector<Vec3f> &queries)
+{
+    const int n_points = points.size();
+    const size_t point_bytes = n_points * sizeof(PointT);
+    TreeRow row{distribution, n_points, format, "", 0, 0};
+
+    for (const auto method :
+         {KdTreeBuildMethod::PARALLEL_MEDIAN, KdTreeBuildMethod::SORT})
+    {
+        if (method == KdTreeBuildMethod::SORT && n_points > maxSortBuildPoints)
+            continue;
+
+        KdTree<PointT> tree;
+        tree.setPoints(points.data(), n_points);
+        tree.buildTree(method);
+        row.variant =
+            method == KdTreeBuildMethod::SORT ? "kd-tree-sort" : "kd-tree";
+        row.buildTime = tree.getBuildTime();
+        row.bytes = point_bytes + getTreeBytes(tree);
+        benchmarkQueries(row, tree, queries);
+    }
+
+    {
+        // NOTE: points are reordered in place
+        std::vector<PointT> tree_points = points;
+        LeftBalancedKdTree<PointT> tree;
+        tree.setPoints(tree_points.data(), n_points);
+        tree.buildTree();
+        row.variant = "left-balanced";
+        row.buildTime = tree.getBuildTime();
+        row.bytes = point_bytes + getTreeBytes(tree);
+        benchmarkQueries(row, tree, queries);
+    }
+
+    {
+        // NOTE: chunks stay in memory, so this measures the cost of searching
+        // several chunks without paging
+        std::vector<PointT> tree_points = points;
+        ChunkedKdTree<PointT> tree;
+        tree.setPoints(tree_points.data(), n_points);
+        tree.buildTree();
+        row.variant = "chunked-" + std::to_string(tree.getChunkSize());
+        row.buildTime = tree.getBuildTime();
+        row.bytes = point_bytes + getTreeBytes(tree);
+        benchmarkQueries(row, tree, queries);
+    }
+
+    const auto benchmarkBucketed = [&]<int BucketSize>()
+    {
+        BucketKdTree<PointT, BucketSize> tree;
+        tree.setPoints(points.data(), n_points);
+        tree.buildTree();
+        row.variant = "bucketed-" + std::to_string(BucketSize);
+        row.buildTime = tree.getBuildTime();
+        row.bytes = point_bytes + getTreeBytes(tree);
+        benchmarkQueries(row, tree, queries);
+    };
+    benchmarkBucketed.template operator()<8>();
+    benchmarkBucketed.template operator()<16>();
+    benchmarkBucketed.template operator()<32>();
+}
+
+int main(int argc, char **argv)
+{
+    const int max_points = argc > 1 ? std::atoi(argv[1]) : 10000000;
+    const int n_queries = argc > 2 ? std::atoi(argv[2]) : 10000;
+
+    std::vector<Distribution> distributions = {
+        Distribution("uniform"), Distribution("surface"),
+        Distribution("clustered")};
+    if (argc > 3)
+    {
+        std::vector<Vec3f> positions;
+        if (loadCapturedPositions(argv[3], positions))
+        {
+            distributions.emplace_back("captured", std::move(positions));
+        }
+        else
+        {
+            std::cout << "Error: Failed to read photons from " << argv[3]
+                      << std::endl;
+            return 1;
+        }
+    }
+
+    printHeader();
+    for (const auto &distribution : distributions)
+    {
+        // NOTE: queries come from the same distribution, like final gathering
+        // hits near photons
+        UniformSampler sampler;
+        sampler.setSeed(2);
+        std::vector<Vec3f> queries(n_queries);
+        for (auto &q : queries)
+        {
+            q = distribution.sample(sampler);
+        }
+
+        for (int64_t n_points = 100000; n_points <= max_points; n_points *= 10)
+        {
+            sampler.setSeed(1);
+            std::vector<Photon> photons(n_points);
+            for (auto &photon : photons)
+            {
+                photon.position = distribution.sample(sampler);
+                photon.throughput = Vec3f(1);
+                photon.wi = Vec3f(0, 1, 0);
+            }
+            benchmarkVariants(distribution.getName(), "full", photons, queries);
+
+            const std::vector<CompactPhoton> compact_photons(photons.begin(),
+                                                             photons.end());
+            photons = std::vector<Photon>();
+            benchmarkVariants(distribution.getName(), "compact", compact_photons,
+                              queries);
+        }
+    }
+
+    return 0;
+}
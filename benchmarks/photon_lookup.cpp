@@ -0,0 +1,104 @@
+// benchmark of photon map lookups in arrival order vs. morton-sorted batches
+// usage: photon_lookup [n_photons] [n_queries] [k]
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+
+#include "photon_map.h"
+#include "sampler.h"
+
+// random point on the walls of unit box, like photons of a closed room
+Vec3f samplePointOnBox(Sampler &sampler)
+{
+    const int face = std::min(static_cast<int>(6 * sampler.getNext1D()), 5);
+    const Vec2f uv = sampler.getNext2D();
+    const int axis = face / 2;
+    Vec3f p;
+    p[axis] = face % 2;
+    p[(axis + 1) % 3] = uv[0];
+    p[(axis + 2) % 3] = uv[1];
+    return p;
+}
+
+const char *layoutName(const PhotonMapLayout &layout)
+{
+    switch (layout)
+    {
+    case PhotonMapLayout::LEFT_BALANCED:
+        return "left-balanced";
+    case PhotonMapLayout::BUCKETED:
+        return "bucketed";
+    default:
+        return "kd-tree";
+    }
+}
+
+int main(int argc, char **argv)
+{
+    const int n_photons = argc > 1 ? std::atoi(argv[1]) : 1000000;
+    const int n_queries = argc > 2 ? std::atoi(argv[2]) : 1000000;
+    const int k = argc > 3 ? std::atoi(argv[3]) : 100;
+
+    UniformSampler sampler;
+    sampler.setSeed(1);
+
+    std::vector<Photon> photons(n_photons);
+    for (auto &photon : photons)
+    {
+        photon.position = samplePointOnBox(sampler);
+        photon.throughput = Vec3f(1);
+        photon.wi = Vec3f(0, 1, 0);
+    }
+
+    // NOTE: final gathering hits arrive in random order over the scene
+    std::vector<Vec3f> queries(n_queries);
+    for (auto &q : queries)
+    {
+        q = samplePointOnBox(sampler);
+    }
+
+    for (const auto layout : {PhotonMapLayout::KD_TREE,
+                              PhotonMapLayout::LEFT_BALANCED,
+                              PhotonMapLayout::BUCKETED})
+    {
+        PhotonMap photon_map;
+        photon_map.setLayout(layout);
+        photon_map.setPhotons(photons);
+        photon_map.build();
+
+        // lookups in arrival order
+        double checksum_direct = 0;
+        KNNHeap heap;
+        auto start = std::chrono::steady_clock::now();
+        for (const auto &q : queries)
+        {
+            photon_map.queryKNearestPhotons(q, k, heap);
+            checksum_direct += heap.maxDist2();
+        }
+        const double time_direct = std::chrono::duration<double>(
+                                       std::chrono::steady_clock::now() - start)
+                                       .count();
+
+        // morton-sorted batch, sorting is included in the timing
+        double checksum_batch = 0;
+        start = std::chrono::steady_clock::now();
+        photon_map.queryKNearestPhotonsBatch(
+            queries.data(), n_queries, k,
+            [&](int query_idx, const KNNHeap &heap)
+            { checksum_batch += heap.maxDist2(); });
+        const double time_batch = std::chrono::duration<double>(
+                                      std::chrono::steady_clock::now() - start)
+                                      .count();
+
+        std::cout << layoutName(layout) << ": direct " << time_direct << "s ("
+                  << n_queries / time_direct << " queries/s), batch "
+                  << time_batch << "s (" << n_queries / time_batch
+                  << " queries/s), speedup " << time_direct / time_batch
+                  << " (checksum " << checksum_direct << " / " << checksum_batch
+                  << ")" << std::endl;
+    }
+
+    return 0;
+}
@@ -45,6 +45,22 @@ public:
         pdf = 1.0f;
         return true;
     }
+
+    // position all camera rays pass through
+    Vec3f getPinholePosition() const { return position + focal_length * forward; }
+
+    // compute sensor coordinate of the given point, inverse of sampleRay
+    // NOTE: returns false when the point is behind the camera
+    bool projectPoint(const Vec3f &p, Vec2f &uv) const
+    {
+        const Vec3f d = p - getPinholePosition();
+        const float d_forward = dot(d, forward);
+        if (d_forward <= 0)
+            return false;
+        uv = Vec2f(-focal_length * dot(d, right) / d_forward,
+                   -focal_length * dot(d, up) / d_forward);
+        return true;
+    }
 };
 
 #endif
\ No newline at end of file
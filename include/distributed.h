@@ -0,0 +1,183 @@
+#ifndef _DISTRIBUTED_H
+#define _DISTRIBUTED_H
+
+#ifdef PM_ENABLE_MPI
+#include <mpi.h>
+#endif
+
+#include <algorithm>
+#include <climits>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// processes rendering a frame together, one per node(MPI ranks)
+// NOTE: built without PM_ENABLE_MPI, there is a single rank and every
+// collective operation is a no-op
+class Communicator
+{
+private:
+    int rank = 0;
+    int size = 1;
+
+#ifdef PM_ENABLE_MPI
+    bool initialized = false; // whether MPI was initialized by this object
+
+    // contiguous MPI type of T, to be freed by caller
+    template <typename T>
+    static MPI_Datatype createType()
+    {
+        MPI_Datatype type;
+        MPI_Type_contiguous(sizeof(T), MPI_BYTE, &type);
+        MPI_Type_commit(&type);
+        return type;
+    }
+#endif
+
+public:
+    // NOTE: parameters are unused without PM_ENABLE_MPI
+    Communicator([[maybe_unused]] int &argc, [[maybe_unused]] char **&argv)
+    {
+#ifdef PM_ENABLE_MPI
+        int is_initialized;
+        MPI_Initialized(&is_initialized);
+        if (!is_initialized)
+        {
+            // NOTE: only the main thread calls MPI, OpenMP threads never do
+            int provided;
+            MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
+            initialized = true;
+        }
+        MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+        MPI_Comm_size(MPI_COMM_WORLD, &size);
+#endif
+    }
+
+    ~Communicator()
+    {
+#ifdef PM_ENABLE_MPI
+        if (initialized)
+        {
+            MPI_Finalize();
+        }
+#endif
+    }
+
+    Communicator(const Communicator &) = delete;
+    Communicator &operator=(const Communicator &) = delete;
+
+    int getRank() const { return rank; }
+    int getSize() const { return size; }
+
+    // rank which writes results
+    bool isRoot() const { return rank == 0; }
+
+    // range [begin, end) of n items owned by this rank
+    // NOTE: ranges are contiguous and in rank order, so concatenating results
+    // of all ranks keeps the order of items
+    std::pair<int, int> getRange(int n) const
+    {
+        return {static_cast<int>(static_cast<int64_t>(n) * rank / size),
+                static_cast<int>(static_cast<int64_t>(n) * (rank + 1) / size)};
+    }
+
+    // true if value is true on every rank
+    bool allTrue(bool value) const
+    {
+#ifdef PM_ENABLE_MPI
+        int local = value ? 1 : 0;
+        int all = local;
+        MPI_Allreduce(&local, &all, 1, MPI_INT, MPI_MIN, MPI_COMM_WORLD);
+        return all != 0;
+#else
+        return value;
+#endif
+    }
+
+    // replace values of each rank by values of all ranks in rank order
+    // NOTE: total number of values must fit in int
+    template <typename T>
+    void allgather([[maybe_unused]] std::vector<T> &values) const
+    {
+        static_assert(std::is_trivially_copyable_v<T>,
+                      "values are sent as bytes");
+#ifdef PM_ENABLE_MPI
+        if (size == 1)
+            return;
+
+        int count = values.size();
+        std::vector<int> counts(size);
+        MPI_Allgather(&count, 1, MPI_INT, counts.data(), 1, MPI_INT,
+                      MPI_COMM_WORLD);
+
+        std::vector<int> offsets(size, 0);
+        for (int r = 1; r < size; ++r)
+        {
+            offsets[r] = offsets[r - 1] + counts[r - 1];
+        }
+
+        std::vector<T> all(offsets.back() + counts.back());
+        MPI_Datatype type = createType<T>();
+        MPI_Allgatherv(values.data(), count, type, all.data(), counts.data(),
+                       offsets.data(), type, MPI_COMM_WORLD);
+        MPI_Type_free(&type);
+        values = std::move(all);
+#endif
+    }
+
+    // gather buffers of all ranks into the first buffer in rank order, other
+    // buffers are emptied
+    // NOTE: buffers of a rank are concatenated in the given order first
+    template <typename T>
+    void allgather(std::vector<std::vector<T>> &buffers) const
+    {
+        if (size == 1 || buffers.empty())
+            return;
+
+        std::vector<T> values;
+        size_t n = 0;
+        for (const auto &buffer : buffers)
+        {
+            n += buffer.size();
+        }
+        values.reserve(n);
+        for (auto &buffer : buffers)
+        {
+            values.insert(values.end(), buffer.begin(), buffer.end());
+            buffer.clear();
+        }
+
+        allgather(values);
+        buffers.front() = std::move(values);
+    }
+
+    // sum values of all ranks into values of root
+    void reduceSum([[maybe_unused]] float *values,
+                   [[maybe_unused]] size_t n) const
+    {
+#ifdef PM_ENABLE_MPI
+        if (size == 1)
+            return;
+
+        // NOTE: counts of MPI are int
+        for (size_t offset = 0; offset < n; offset += INT_MAX)
+        {
+            const int count = std::min<size_t>(n - offset, INT_MAX);
+            if (isRoot())
+            {
+                MPI_Reduce(MPI_IN_PLACE, values + offset, count, MPI_FLOAT,
+                           MPI_SUM, 0, MPI_COMM_WORLD);
+            }
+            else
+            {
+                MPI_Reduce(values + offset, nullptr, count, MPI_FLOAT, MPI_SUM, 0,
+                           MPI_COMM_WORLD);
+            }
+        }
+#endif
+    }
+};
+
+#endif
@@ -2,6 +2,8 @@
 #define _GEOMETRY_H
 
 #include <cmath>
+#include <cstddef>
+#include <cstdint>
 #include <iostream>
 #include <limits>
 
@@ -13,6 +15,52 @@ constexpr float RAY_EPS = 1e-5f;
 inline float rad2deg(float rad) { return 180.0f * rad / PI; }
 inline float deg2rad(float deg) { return deg / 180.0f * PI; }
 
+// insert a zero bit between each of the lower 16 bits
+inline uint32_t spreadBits2(uint32_t x)
+{
+    x &= 0x0000ffff;
+    x = (x | (x << 8)) & 0x00ff00ff;
+    x = (x | (x << 4)) & 0x0f0f0f0f;
+    x = (x | (x << 2)) & 0x33333333;
+    x = (x | (x << 1)) & 0x55555555;
+    return x;
+}
+
+// compute 2D morton code(Z-order) of the given coordinates
+inline uint32_t mortonEncode2D(uint32_t x, uint32_t y)
+{
+    return (spreadBits2(y) << 1) | spreadBits2(x);
+}
+
+// insert two zero bits between each of the lower 10 bits
+inline uint32_t spreadBits3(uint32_t x)
+{
+    x &= 0x000003ff;
+    x = (x | (x << 16)) & 0x030000ff;
+    x = (x | (x << 8)) & 0x0300f00f;
+    x = (x | (x << 4)) & 0x030c30c3;
+    x = (x | (x << 2)) & 0x09249249;
+    return x;
+}
+
+// compute 3D morton code of the given coordinates, 10 bits each
+inline uint32_t mortonEncode3D(uint32_t x, uint32_t y, uint32_t z)
+{
+    return (spreadBits3(z) << 2) | (spreadBits3(y) << 1) | spreadBits3(x);
+}
+
+// 64 bit FNV-1a hash of the given bytes, chained through h
+inline uint64_t hashBytes(const void *data, size_t size,
+                          uint64_t h = 0xcbf29ce484222325ull)
+{
+    const unsigned char *bytes = static_cast<const unsigned char *>(data);
+    for (size_t i = 0; i < size; ++i)
+    {
+        h = (h ^ bytes[i]) * 0x100000001b3ull;
+    }
+    return h;
+}
+
 template <typename T>
 struct Vec2
 {
@@ -251,6 +299,12 @@ inline float length(const Vec3f &v) { return std::sqrt(dot(v, v)); }
 inline float length2(const Vec3f &v) { return dot(v, v); }
 inline Vec3f normalize(const Vec3f &v) { return v / length(v); }
 
+// luminance of linear sRGB color
+inline float luminance(const Vec3f &rgb)
+{
+    return 0.2126f * rgb[0] + 0.7152f * rgb[1] + 0.0722f * rgb[2];
+}
+
 inline void orthonormalBasis(const Vec3f &n, Vec3f &t, Vec3f &b)
 {
     if (std::abs(n[1]) < 0.9f)
@@ -325,4 +379,14 @@ struct IntersectInfo
     const Primitive *hitPrimitive;
 };
 
+// geometric part of IntersectInfo
+// NOTE: cheap to fill, surface info is computed from it only when needed
+struct HitRecord
+{
+    float t;            // distance to the hit point
+    uint32_t primID;    // index of hit face
+    Vec2f barycentric;
+    const Primitive *hitPrimitive;
+};
+
 #endif
\ No newline at end of file
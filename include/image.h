@@ -1,13 +1,383 @@
 #ifndef _IMAGE_H
 #define _IMAGE_H
+#include <cstdint>
+#include <cstring>
 #include <fstream>
 #include <iostream>
+#include <mutex>
 #include <string>
 #include <algorithm>
 #include <vector>
 
 #include "geometry.h"
 
+// rectangular region of image
+// NOTE: rows [i0, i1), columns [j0, j1)
+struct Tile
+{
+    int i0, i1;
+    int j0, j1;
+};
+
+enum class ImageFormat
+{
+    PPM, // binary 8 bit RGB (P6)
+    PFM, // 32 bit float RGB
+    EXR, // OpenEXR, uncompressed 16 bit half float scanlines
+};
+
+// choose image format from extension of the filename, PPM by default
+inline ImageFormat getImageFormat(const std::string &filename)
+{
+    const size_t dot = filename.find_last_of('.');
+    const std::string ext = dot == std::string::npos ? "" : filename.substr(dot + 1);
+    if (ext == "pfm")
+        return ImageFormat::PFM;
+    if (ext == "exr")
+        return ImageFormat::EXR;
+    if (ext != "ppm")
+    {
+        std::cout << "Warning: Unknown image format " << ext << ", writing PPM"
+                  << std::endl;
+    }
+    return ImageFormat::PPM;
+}
+
+// convert float to IEEE 754 half, round to nearest even
+inline uint16_t floatToHalf(float f)
+{
+    uint32_t x;
+    std::memcpy(&x, &f, sizeof(float));
+    const uint32_t sign = (x >> 16) & 0x8000;
+    const int exponent = (x >> 23) & 0xff;
+    uint32_t mantissa = x & 0x7fffff;
+
+    // inf, nan
+    if (exponent == 0xff)
+        return sign | 0x7c00 | (mantissa != 0 ? 0x200 : 0);
+
+    const int e = exponent - 127 + 15;
+    // overflow
+    if (e >= 31)
+        return sign | 0x7c00;
+
+    // subnormal half
+    if (e <= 0)
+    {
+        if (e < -10)
+            return sign;
+        mantissa |= 0x800000;
+        const int shift = 14 - e;
+        uint32_t h = mantissa >> shift;
+        const uint32_t rest = mantissa & ((1u << shift) - 1);
+        const uint32_t halfway = 1u << (shift - 1);
+        if (rest > halfway || (rest == halfway && (h & 1)))
+            ++h;
+        return sign | h;
+    }
+
+    // NOTE: rounding may carry into the exponent, which gives inf on overflow
+    uint32_t h = (static_cast<uint32_t>(e) << 10) | (mantissa >> 13);
+    const uint32_t rest = mantissa & 0x1fff;
+    if (rest > 0x1000 || (rest == 0x1000 && (h & 1)))
+        ++h;
+    return sign | h;
+}
+
+// per pixel transform applied while writing
+// NOTE: radiance is divided by the number of samples, gamma is only applied to 8
+// bit output since PFM/EXR store linear radiance
+struct ToneMapping
+{
+    float divisor = 1.0f;
+    float gamma = 1.0f;
+
+    Vec3f apply(const Vec3f &rgb, bool applyGamma) const
+    {
+        Vec3f c = rgb / divisor;
+        if (applyGamma && gamma != 1.0f)
+        {
+            for (int k = 0; k < 3; ++k)
+            {
+                c[k] = std::pow(c[k], 1.0f / gamma);
+            }
+        }
+        return c;
+    }
+};
+
+// writes image tile by tile into a file of the final size
+// tiles can be written in any order and from many threads: every row of a tile
+// is converted to the file format and written at its offset in the file, so no
+// full frame buffer is needed
+// NOTE: PFM and EXR data are written in host byte order, which must be little
+// endian
+class ImageWriter
+{
+private:
+    std::fstream file;
+    std::mutex mutex;
+    ImageFormat format = ImageFormat::PPM;
+    unsigned int width = 0;
+    unsigned int height = 0;
+    ToneMapping toneMapping;
+    std::streamoff dataOffset = 0; // offset of first pixel row
+
+    template <typename T>
+    static void append(std::vector<char> &bytes, const T &value)
+    {
+        const char *p = reinterpret_cast<const char *>(&value);
+        bytes.insert(bytes.end(), p, p + sizeof(T));
+    }
+
+    static void appendString(std::vector<char> &bytes, const std::string &str)
+    {
+        bytes.insert(bytes.end(), str.begin(), str.end());
+        bytes.push_back('\0');
+    }
+
+    // attribute of EXR header
+    static void appendAttribute(std::vector<char> &bytes, const std::string &name,
+                                const std::string &type,
+                                const std::vector<char> &value)
+    {
+        appendString(bytes, name);
+        appendString(bytes, type);
+        append(bytes, static_cast<int32_t>(value.size()));
+        bytes.insert(bytes.end(), value.begin(), value.end());
+    }
+
+    // bytes of EXR scanline block, including y and data size
+    std::streamoff getEXRLineSize() const
+    {
+        return 2 * sizeof(int32_t) + 3 * sizeof(uint16_t) * width;
+    }
+
+    // OpenEXR header of single part scanline image without compression, and
+    // offset table of scanlines
+    // https://openexr.com/en/latest/OpenEXRFileLayout.html
+    std::vector<char> makeEXRHeader() const
+    {
+        std::vector<char> bytes;
+        append(bytes, static_cast<int32_t>(20000630)); // magic number
+        append(bytes, static_cast<int32_t>(2));        // version, no flags
+
+        // NOTE: channels must be sorted by name
+        std::vector<char> channels;
+        for (const char *name : {"B", "G", "R"})
+        {
+            appendString(channels, name);
+            append(channels, static_cast<int32_t>(1)); // HALF
+            append(channels, static_cast<uint8_t>(0)); // pLinear
+            channels.insert(channels.end(), 3, '\0'); // reserved
+            append(channels, static_cast<int32_t>(1)); // x sampling
+            append(channels, static_cast<int32_t>(1)); // y sampling
+        }
+        channels.push_back('\0');
+        appendAttribute(bytes, "channels", "chlist", channels);
+
+        appendAttribute(bytes, "compression", "compression", {0});
+
+        std::vector<char> window;
+        append(window, static_cast<int32_t>(0));
+        append(window, static_cast<int32_t>(0));
+        append(window, static_cast<int32_t>(width - 1));
+        append(window, static_cast<int32_t>(height - 1));
+        appendAttribute(bytes, "dataWindow", "box2i", window);
+        appendAttribute(bytes, "displayWindow", "box2i", window);
+
+        appendAttribute(bytes, "lineOrder", "lineOrder", {0}); // INCREASING_Y
+
+        std::vector<char> one;
+        append(one, 1.0f);
+        appendAttribute(bytes, "pixelAspectRatio", "float", one);
+        std::vector<char> center;
+        append(center, 0.0f);
+        append(center, 0.0f);
+        appendAttribute(bytes, "screenWindowCenter", "v2f", center);
+        appendAttribute(bytes, "screenWindowWidth", "float", one);
+        bytes.push_back('\0'); // end of header
+
+        // offset table, one scanline per block
+        const uint64_t table_end = bytes.size() + sizeof(uint64_t) * height;
+        for (unsigned int i = 0; i < height; ++i)
+        {
+            append(bytes, static_cast<uint64_t>(table_end + i * getEXRLineSize()));
+        }
+        return bytes;
+    }
+
+    // convert row segment of a tile to bytes of the file format
+    void convertRow(const Vec3f *radiance, int n, std::vector<char> &bytes) const
+    {
+        bytes.clear();
+        if (format == ImageFormat::PPM)
+        {
+            for (int j = 0; j < n; ++j)
+            {
+                const Vec3f rgb = toneMapping.apply(radiance[j], true);
+                for (int k = 0; k < 3; ++k)
+                {
+                    bytes.push_back(static_cast<char>(static_cast<unsigned char>(
+                        std::clamp(255.0f * rgb[k], 0.0f, 255.0f))));
+                }
+            }
+        }
+        else if (format == ImageFormat::PFM)
+        {
+            for (int j = 0; j < n; ++j)
+            {
+                const Vec3f rgb = toneMapping.apply(radiance[j], false);
+                for (int k = 0; k < 3; ++k)
+                {
+                    append(bytes, rgb[k]);
+                }
+            }
+        }
+        else
+        {
+            // planar B, G, R
+            bytes.resize(3 * sizeof(uint16_t) * n);
+            uint16_t *halfs = reinterpret_cast<uint16_t *>(bytes.data());
+            for (int j = 0; j < n; ++j)
+            {
+                const Vec3f rgb = toneMapping.apply(radiance[j], false);
+                halfs[j] = floatToHalf(rgb[2]);
+                halfs[n + j] = floatToHalf(rgb[1]);
+                halfs[2 * n + j] = floatToHalf(rgb[0]);
+            }
+        }
+    }
+
+public:
+    ImageWriter() {}
+    ~ImageWriter() { close(); }
+
+    ImageWriter(const ImageWriter &) = delete;
+    ImageWriter &operator=(const ImageWriter &) = delete;
+
+    // create file of the final size, pixels not written stay black
+    bool open(const std::string &filename, unsigned int width,
+              unsigned int height, ImageFormat format,
+              const ToneMapping &toneMapping)
+    {
+        close();
+        this->width = width;
+        this->height = height;
+        this->format = format;
+        this->toneMapping = toneMapping;
+
+        file.open(filename, std::ios::in | std::ios::out | std::ios::binary |
+                                std::ios::trunc);
+        if (!file)
+        {
+            std::cout << "Error: Failed to open " << filename << std::endl;
+            return false;
+        }
+
+        std::vector<char> header;
+        std::streamoff data_size;
+        if (format == ImageFormat::PPM)
+        {
+            const std::string str = "P6\n" + std::to_string(width) + " " +
+                                    std::to_string(height) + "\n255\n";
+            header.assign(str.begin(), str.end());
+            data_size = 3 * static_cast<std::streamoff>(width) * height;
+        }
+        else if (format == ImageFormat::PFM)
+        {
+            // NOTE: negative scale means little endian
+            const std::string str = "PF\n" + std::to_string(width) + " " +
+                                    std::to_string(height) + "\n-1.0\n";
+            header.assign(str.begin(), str.end());
+            data_size = 3 * sizeof(float) * static_cast<std::streamoff>(width) * height;
+        }
+        else
+        {
+            header = makeEXRHeader();
+            data_size = getEXRLineSize() * height;
+        }
+        dataOffset = header.size();
+        file.write(header.data(), header.size());
+
+        if (format == ImageFormat::EXR)
+        {
+            // scanline headers, pixels are filled later
+            std::vector<char> line(getEXRLineSize(), '\0');
+            for (unsigned int i = 0; i < height; ++i)
+            {
+                const int32_t y = i;
+                const int32_t size = line.size() - 2 * sizeof(int32_t);
+                std::memcpy(line.data(), &y, sizeof(int32_t));
+                std::memcpy(line.data() + sizeof(int32_t), &size, sizeof(int32_t));
+                file.write(line.data(), line.size());
+            }
+        }
+        else if (data_size > 0)
+        {
+            // extend file to its final size
+            file.seekp(dataOffset + data_size - 1);
+            file.put('\0');
+        }
+
+        return static_cast<bool>(file);
+    }
+
+    bool isOpen() const { return file.is_open(); }
+
+    // write tile of radiance, stored row by row with tile width
+    void writeTile(const Tile &tile, const Vec3f *radiance)
+    {
+        const int tile_width = tile.j1 - tile.j0;
+
+        // convert rows before taking the lock
+        std::vector<std::vector<char>> rows(tile.i1 - tile.i0);
+        for (int i = tile.i0; i < tile.i1; ++i)
+        {
+            convertRow(radiance + (i - tile.i0) * tile_width, tile_width,
+                       rows[i - tile.i0]);
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        for (int i = tile.i0; i < tile.i1; ++i)
+        {
+            const std::vector<char> &bytes = rows[i - tile.i0];
+            if (format == ImageFormat::PPM)
+            {
+                file.seekp(dataOffset + 3 * (static_cast<std::streamoff>(width) * i + tile.j0));
+                file.write(bytes.data(), bytes.size());
+            }
+            else if (format == ImageFormat::PFM)
+            {
+                // NOTE: PFM stores rows from bottom to top
+                const std::streamoff row = height - 1 - i;
+                file.seekp(dataOffset + 3 * sizeof(float) *
+                                            (static_cast<std::streamoff>(width) * row + tile.j0));
+                file.write(bytes.data(), bytes.size());
+            }
+            else
+            {
+                const std::streamoff line =
+                    dataOffset + getEXRLineSize() * i + 2 * sizeof(int32_t);
+                const std::streamoff channel_size = sizeof(uint16_t) * tile_width;
+                for (int c = 0; c < 3; ++c)
+                {
+                    file.seekp(line + sizeof(uint16_t) * (static_cast<std::streamoff>(width) * c + tile.j0));
+                    file.write(bytes.data() + c * channel_size, channel_size);
+                }
+            }
+        }
+    }
+
+    void close()
+    {
+        if (file.is_open())
+        {
+            file.close();
+        }
+    }
+};
+
 class Image
 {
 private:
@@ -28,6 +398,12 @@ public:
         pixels.resize(3 * width * height);
     }
 
+    unsigned int getWidth() const { return width; }
+    unsigned int getHeight() const { return height; }
+
+    // RGB floats of all pixels, row by row
+    float *getData() { return pixels.data(); }
+
     Vec3f getPixel(unsigned int i, unsigned int j) const
     {
         const unsigned int idx = getIndex(i, j);
@@ -79,28 +455,31 @@ public:
         }
     }
 
-    void writePPM(const std::string &filename)
+    // write image, tone mapping is applied on the fly
+    void write(const std::string &filename, ImageFormat format,
+               const ToneMapping &toneMapping = ToneMapping()) const
     {
-        std::ofstream file(filename);
-
-        file << "P3" << std::endl;
-        file << width << " " << height << std::endl;
-        file << "255" << std::endl;
+        ImageWriter writer;
+        if (!writer.open(filename, width, height, format, toneMapping))
+            return;
 
+        std::vector<Vec3f> row(width);
         for (unsigned int i = 0; i < height; ++i)
         {
             for (unsigned int j = 0; j < width; ++j)
             {
-                const Vec3f rgb = getPixel(i, j);
-                const unsigned int R = std::clamp(static_cast<unsigned int>(255.0f * rgb[0]), 0u, 255u);
-                const unsigned int G = std::clamp(static_cast<unsigned int>(255.0f * rgb[1]), 0u, 255u);
-                const unsigned int B = std::clamp(static_cast<unsigned int>(255.0f * rgb[2]), 0u, 255u);
-                file << R << " " << G << " " << B << std::endl;
+                row[j] = getPixel(i, j);
             }
+            writer.writeTile(Tile{static_cast<int>(i), static_cast<int>(i) + 1, 0,
+                                  static_cast<int>(width)},
+                             row.data());
         }
+    }
 
-        file.close();
+    void writePPM(const std::string &filename) const
+    {
+        write(filename, ImageFormat::PPM);
     }
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -2,16 +2,27 @@
 #define _INTEGRATOR_H
 #include <omp.h>
 
+#include <cstdio>
+#include <filesystem>
+#include <limits>
 #include <optional>
 #include <iostream>
+#include <string>
+#include <vector>
 
+#include "camera.h"
+#include "distributed.h"
 #include "geometry.h"
 #include "photon_map.h"
+#include "projection_map.h"
 #include "scene.h"
+#include "stats.h"
 
 class Integrator
 {
 public:
+    virtual ~Integrator() = default;
+
     // do preliminary jobs before calling integrate
     virtual void build(const Scene &scene, Sampler &sampler) = 0;
 
@@ -19,6 +30,110 @@ public:
     virtual Vec3f integrate(const Ray &ray, const Scene &scene,
                             Sampler &sampler) const = 0;
 
+    // compute radiance coming from each of the given rays
+    // NOTE: rays are integrated one by one, batched integrators override this
+    virtual void integrateN(const Ray *rays, int nRays, const Scene &scene,
+                            Sampler &sampler, Vec3f *radiance) const
+    {
+        for (int i = 0; i < nRays; ++i)
+        {
+            radiance[i] = integrate(rays[i], scene, sampler);
+        }
+    }
+
+    // true if the integrator should be fed with large batches of rays
+    virtual bool isWavefront() const { return false; }
+
+    // sample light for explicit light sampling(NEE), return unoccluded
+    // contribution and the shadow ray to test it with
+    static Vec3f sampleDirectIllumination(const Scene &scene, const Vec3f &wo,
+                                          const IntersectInfo &info,
+                                          Sampler &sampler, Ray &ray_shadow)
+    {
+        // sample light
+        float pdf_choose_light;
+        const AreaLight *light = scene.sampleLight(sampler, pdf_choose_light);
+
+        // sample point on light
+        float pdf_pos_light;
+        const SurfaceInfo light_surf = light->samplePoint(sampler, pdf_pos_light);
+
+        // convert positional pdf to directional pdf
+        const Vec3f wi = normalize(light_surf.position - info.surfaceInfo.position);
+        const float r = length(light_surf.position - info.surfaceInfo.position);
+        const float pdf_dir =
+            pdf_pos_light * r * r / std::abs(dot(-wi, light_surf.shadingNormal));
+
+        // create shadow ray
+        ray_shadow = Ray(info.surfaceInfo.position, wi);
+        ray_shadow.tmax = r - RAY_EPS;
+
+        const Vec3f Le = light->Le(light_surf, -wi);
+        const Vec3f f = info.hitPrimitive->evaluateBxDF(
+            wo, wi, info.surfaceInfo, TransportDirection::FROM_CAMERA);
+        const float cos = std::abs(dot(wi, info.surfaceInfo.shadingNormal));
+        return f * cos * Le / (pdf_choose_light * pdf_dir);
+    }
+
+    // compute direct illumination with explicit light sampling(NEE)
+    static Vec3f computeDirectIllumination(const Scene &scene, const Vec3f &wo,
+                                           const IntersectInfo &info,
+                                           Sampler &sampler)
+    {
+        Ray ray_shadow;
+        const Vec3f Ld =
+            sampleDirectIllumination(scene, wo, info, sampler, ray_shadow);
+
+        // trace ray to the light
+        if (!scene.occluded(ray_shadow))
+        {
+            return Ld;
+        }
+
+        return Vec3f(0);
+    }
+
+    // sample initial ray from light and compute initial throughput
+    // NOTE: emission directions are steered by projection maps of each light
+    // if given
+    static Ray sampleRayFromLight(
+        const Scene &scene, Sampler &sampler, Vec3f &throughput,
+        const std::vector<ProjectionMap> *projectionMaps = nullptr)
+    {
+        // sample light
+        float light_choose_pdf;
+        uint32_t light_idx;
+        const AreaLight *light =
+            scene.sampleLight(sampler, light_choose_pdf, light_idx);
+
+        // sample point on light
+        float light_pos_pdf;
+        const SurfaceInfo light_surf = light->samplePoint(sampler, light_pos_pdf);
+
+        // sample direction on light
+        float light_dir_pdf;
+        Vec3f dir;
+        if (projectionMaps != nullptr && !projectionMaps->empty())
+        {
+            float map_pdf;
+            const Vec2f u = (*projectionMaps)[light_idx].sample(sampler, map_pdf);
+            dir = light->sampleDirection(light_surf, u, light_dir_pdf);
+            light_dir_pdf *= map_pdf;
+        }
+        else
+        {
+            dir = light->sampleDirection(light_surf, sampler, light_dir_pdf);
+        }
+
+        // spawn ray
+        Ray ray(light_surf.position, dir);
+        throughput = light->Le(light_surf, dir) /
+                     (light_choose_pdf * light_pos_pdf * light_dir_pdf) *
+                     std::abs(dot(dir, light_surf.shadingNormal));
+
+        return ray;
+    }
+
     // compute cosine term
     // NOTE: need to account for the asymmetry of BSDF when photon tracing
     // https://pbr-book.org/3ed-2018/Light_Transport_III_Bidirectional_Methods/The_Path-Space_Measurement_Equation#x3-Non-symmetryDuetoShadingNormals
@@ -55,10 +170,131 @@ public:
     }
 };
 
+// radiance estimation method of photon map
+enum class PhotonEstimation
+{
+    K_NEAREST,   // gather k-nearest photons, radius given by the farthest one
+    FIXED_RADIUS // gather photons within the fixed radius
+};
+
+// distribution of photon emission directions
+enum class PhotonEmission
+{
+    UNIFORM,   // sample directions by the lights
+    IMPORTANCE // steer directions by projection maps(caustics photon map) and
+               // visual importance(global photon map)
+};
+
+// photon map lookups collected to be answered at once
+struct PhotonLookupBatch
+{
+    std::vector<Vec3f> positions;
+    std::vector<Vec3f> wos;
+    std::vector<const IntersectInfo *> infos;
+    std::vector<Vec3f> radiance; // result of each lookup
+
+    int size() const { return positions.size(); }
+
+    void clear()
+    {
+        positions.clear();
+        wos.clear();
+        infos.clear();
+        radiance.clear();
+    }
+
+    // NOTE: info must stay alive until the batch is answered
+    void push(const Vec3f &wo, const IntersectInfo &info)
+    {
+        positions.push_back(info.surfaceInfo.position);
+        wos.push_back(wo);
+        infos.push_back(&info);
+    }
+};
+
+// vertex of a traced photon path
+struct PhotonPathVertex
+{
+    // hit point, or direction of the ray leaving the scene
+    Vec3f position;
+    // hit face, or one of below
+    int primID;
+
+    static constexpr int origin = -2; // point sampled on light
+    static constexpr int escape = -1; // ray went to the sky
+};
+
+// photons, irradiance points and vertices of each traced photon path
+// NOTE: path i owns [offsets[i], offsets[i + 1]) of each array, paths are in
+// order of photon index
+struct PhotonPathLog
+{
+    std::vector<Photon> photons;
+    std::vector<IrradiancePhoton> points;
+    std::vector<PhotonPathVertex> vertices;
+    std::vector<size_t> photonOffsets{0};
+    std::vector<size_t> pointOffsets{0};
+    std::vector<size_t> vertexOffsets{0};
+
+    int getNPaths() const { return photonOffsets.size() - 1; }
+
+    void clear()
+    {
+        photons.clear();
+        points.clear();
+        vertices.clear();
+        photonOffsets.assign(1, 0);
+        pointOffsets.assign(1, 0);
+        vertexOffsets.assign(1, 0);
+    }
+
+    // close the path traced into the arrays since the last path
+    void endPath()
+    {
+        photonOffsets.push_back(photons.size());
+        pointOffsets.push_back(points.size());
+        vertexOffsets.push_back(vertices.size());
+    }
+
+    // append path i of the given log
+    void appendPath(const PhotonPathLog &log, int i)
+    {
+        photons.insert(photons.end(), log.photons.begin() + log.photonOffsets[i],
+                       log.photons.begin() + log.photonOffsets[i + 1]);
+        points.insert(points.end(), log.points.begin() + log.pointOffsets[i],
+                      log.points.begin() + log.pointOffsets[i + 1]);
+        vertices.insert(vertices.end(), log.vertices.begin() + log.vertexOffsets[i],
+                        log.vertices.begin() + log.vertexOffsets[i + 1]);
+        endPath();
+    }
+
+    // append all paths of the given log
+    void append(const PhotonPathLog &log)
+    {
+        const size_t photons_offset = photons.size();
+        const size_t points_offset = points.size();
+        const size_t vertices_offset = vertices.size();
+        photons.insert(photons.end(), log.photons.begin(), log.photons.end());
+        points.insert(points.end(), log.points.begin(), log.points.end());
+        vertices.insert(vertices.end(), log.vertices.begin(), log.vertices.end());
+        for (int i = 1; i <= log.getNPaths(); ++i)
+        {
+            photonOffsets.push_back(photons_offset + log.photonOffsets[i]);
+            pointOffsets.push_back(points_offset + log.pointOffsets[i]);
+            vertexOffsets.push_back(vertices_offset + log.vertexOffsets[i]);
+        }
+    }
+};
+
 // implementation of photon mapping
 class PhotonMapping : public Integrator
 {
-private:
+protected:
+    // sample streams of photon tracing, photon i is sample i of its stream
+    // NOTE: far from the streams of pixels
+    static constexpr uint64_t globalPhotonStream = 1ull << 62;
+    static constexpr uint64_t causticsPhotonStream = (1ull << 62) + 1;
+
     // number of photons used for making global photon map
     const int nPhotonsGlobal;
 
@@ -68,107 +304,923 @@ private:
     // number of photons for making caustics photon map
     const int nPhotonsCaustics;
 
-    // number of photons used for radiance estimation by caustics photon map
-    const int nEstimationCaustics;
+    // number of photons used for radiance estimation by caustics photon map
+    const int nEstimationCaustics;
+
+    // maximum depth to estimate radiance by final gathering
+    const int finalGatheringDepth;
+
+    // maximum depth of photon tracing, eye tracing
+    const int maxDepth;
+
+    // radiance estimation method, radius of global photon map
+    PhotonEstimation globalEstimation = PhotonEstimation::K_NEAREST;
+    float globalRadius = 0;
+
+    // radiance estimation method, radius of caustics photon map
+    PhotonEstimation causticsEstimation = PhotonEstimation::K_NEAREST;
+    float causticsRadius = 0;
+
+    // store precomputed irradiance at every n-th global photon, 0 to disable
+    int irradianceStride = 0;
+
+    PhotonMap globalPhotonMap;
+    PhotonMap causticsPhotonMap;
+    IrradianceCache irradianceCache;
+
+    // importance driven photon emission
+    // NOTE: visual importance is computed only when camera is given
+    PhotonEmission emission = PhotonEmission::UNIFORM;
+    const Camera *camera = nullptr;
+    float cameraAspect = 1; // width / height of sensor
+    std::vector<ProjectionMap> globalProjectionMaps;
+    std::vector<ProjectionMap> causticsProjectionMaps;
+
+    // number of probe rays per projection map cell
+    static constexpr int nProbesPerCell = 4;
+
+    // weight of cells never seen by the camera relative to fully seen ones
+    // NOTE: keeps the global photon map covering the whole scene, e.g. for
+    // final gathering rays
+    static constexpr float importanceFloor = 0.1f;
+
+    // directory photon maps are persisted in, empty to disable
+    std::filesystem::path photonMapCacheDir;
+
+    // wall time of each phase of the last build
+    PhaseTimes phaseTimes;
+
+    // ranks sharing photon tracing, nullptr to trace every photon here
+    const Communicator *communicator = nullptr;
+
+    // directory photons of out-of-core layout are paged in from, empty to keep
+    // them in memory
+    std::filesystem::path outOfCoreDir;
+    size_t outOfCoreResidentBytes = 0;
+    int outOfCoreChunkSize = 1 << 16;
+
+    // photons of a thread buffer spilled to out-of-core photon maps at once
+    static constexpr int spillBufferSize = 1 << 14;
+
+    // keep paths of traced photons, so that update re-traces only the paths
+    // touching moved geometry
+    bool pathLogging = false;
+    PhotonPathLog globalPathLog;
+    PhotonPathLog causticsPathLog;
+
+    // range [begin, end) of n photons traced by this rank
+    std::pair<int, int> getPhotonRange(int n) const
+    {
+        return communicator != nullptr ? communicator->getRange(n)
+                                       : std::pair<int, int>(0, n);
+    }
+
+    // whether maps are built by other ranks too
+    bool isDistributed() const
+    {
+        return communicator != nullptr && communicator->getSize() > 1;
+    }
+
+    // key of the given photon map of the current build
+    // NOTE: maps are traced one after another with the same samplers, so every
+    // setting of photon tracing goes into the keys of all maps
+    PhotonMapKey getPhotonMapKey(const Scene &scene, const Sampler &sampler,
+                                 int nPhotons) const
+    {
+        PhotonMapKey key;
+        key.sceneHash = scene.getHash();
+        key.nPhotons = nPhotons;
+        key.seed = sampler.getSeed();
+
+        const int settings[] = {nPhotonsGlobal, nPhotonsCaustics, finalGatheringDepth,
+                                maxDepth, static_cast<int>(emission),
+                                static_cast<int>(sampler.getType())};
+        uint64_t h = hashBytes(settings, sizeof(settings));
+        if (emission == PhotonEmission::IMPORTANCE && camera != nullptr)
+        {
+            // NOTE: camera is plain float data
+            h = hashBytes(camera, sizeof(Camera), h);
+            h = hashBytes(&cameraAspect, sizeof(cameraAspect), h);
+        }
+        key.settingsHash = h;
+        return key;
+    }
+
+    // key of irradiance cache, which also depends on the global estimate
+    PhotonMapKey getIrradianceCacheKey(const PhotonMapKey &globalKey) const
+    {
+        PhotonMapKey key = globalKey;
+        const int settings[] = {irradianceStride, nEstimationGlobal,
+                                static_cast<int>(globalEstimation)};
+        key.settingsHash = hashBytes(settings, sizeof(settings), key.settingsHash);
+        key.settingsHash =
+            hashBytes(&globalRadius, sizeof(globalRadius), key.settingsHash);
+        return key;
+    }
+
+    // path of persisted photon map
+    // NOTE: format and layout are part of the name, so that maps of different
+    // settings don't overwrite each other
+    std::filesystem::path getPhotonMapCachePath(const PhotonMap &photonMap,
+                                                const PhotonMapKey &key,
+                                                const std::string &name) const
+    {
+        char hash[17];
+        std::snprintf(hash, sizeof(hash), "%016llx",
+                      static_cast<unsigned long long>(key.getHash()));
+        return photonMapCacheDir /
+               (name + "-" + hash + "-" +
+                std::to_string(static_cast<int>(photonMap.getFormat())) +
+                std::to_string(static_cast<int>(photonMap.getLayout())) +
+                ".pmphotons");
+    }
+
+    // load all photon maps of this build from cache directory
+    // returns false if any of them is missing
+    bool loadPhotonMaps(const Scene &scene, const Sampler &sampler)
+    {
+        const PhotonMapKey global_key =
+            getPhotonMapKey(scene, sampler, nPhotonsGlobal);
+        const PhotonMapKey caustics_key =
+            getPhotonMapKey(scene, sampler, nPhotonsCaustics);
+        const PhotonMapKey irradiance_key = getIrradianceCacheKey(global_key);
+
+        irradianceCache.clear();
+        if (!globalPhotonMap.load(
+                getPhotonMapCachePath(globalPhotonMap, global_key, "global"),
+                global_key))
+            return false;
+        if (irradianceStride > 0 &&
+            !irradianceCache.load(
+                getPhotonMapCachePath(globalPhotonMap, irradiance_key, "irradiance"),
+                irradiance_key))
+            return false;
+        if (finalGatheringDepth > 0 &&
+            !causticsPhotonMap.load(
+                getPhotonMapCachePath(causticsPhotonMap, caustics_key, "caustics"),
+                caustics_key))
+            return false;
+        return true;
+    }
+
+    // persist all photon maps of this build into cache directory
+    void savePhotonMaps(const Scene &scene, const Sampler &sampler) const
+    {
+        std::error_code ec;
+        std::filesystem::create_directories(photonMapCacheDir, ec);
+
+        const PhotonMapKey global_key =
+            getPhotonMapKey(scene, sampler, nPhotonsGlobal);
+        const PhotonMapKey caustics_key =
+            getPhotonMapKey(scene, sampler, nPhotonsCaustics);
+        const PhotonMapKey irradiance_key = getIrradianceCacheKey(global_key);
+
+        bool saved = globalPhotonMap.save(
+            getPhotonMapCachePath(globalPhotonMap, global_key, "global"), global_key);
+        if (irradianceStride > 0)
+        {
+            saved &= irradianceCache.save(
+                getPhotonMapCachePath(globalPhotonMap, irradiance_key, "irradiance"),
+                irradiance_key);
+        }
+        if (finalGatheringDepth > 0)
+        {
+            saved &= causticsPhotonMap.save(
+                getPhotonMapCachePath(causticsPhotonMap, caustics_key, "caustics"),
+                caustics_key);
+        }
+        if (!saved)
+        {
+            std::cout << "Warning: Failed to save photon maps to "
+                      << photonMapCacheDir.generic_string() << std::endl;
+        }
+    }
+
+    // trace photon i for global photon map
+    // whener hitting diffuse surface, add photon to the photon array
+    // recursively tracing photon with russian roulette
+    // NOTE: vertices of the path are appended to path unless it is nullptr
+    void traceGlobalPhoton(const Scene &scene, Sampler &sampler, int i,
+                           std::vector<Photon> &photons,
+                           std::vector<IrradiancePhoton> &irradiance_points,
+                           std::vector<PhotonPathVertex> *path) const
+    {
+        sampler.startPixelSample(globalPhotonStream, i);
+        PM_STATS_ADD(photons, 1);
+
+        // sample initial ray from light and set initial throughput
+        Vec3f throughput;
+        Ray ray = sampleRayFromLight(scene, sampler, throughput, &globalProjectionMaps);
+        if (path != nullptr)
+        {
+            path->push_back({ray.origin, PhotonPathVertex::origin});
+        }
+
+        for (int k = 0; k < maxDepth; ++k)
+        {
+            if (std::isnan(throughput[0]) || std::isnan(throughput[1]) ||
+                std::isnan(throughput[2]))
+            {
+                std::cout << "Error: Photon throughput is NaN!" << std::endl;
+                break;
+            }
+            else if (throughput[0] < 0 || throughput[1] < 0 || throughput[2] < 0)
+            {
+                std::cout << "Error: Photon throughput is minus!" << std::endl;
+                break;
+            }
+
+            // NOTE: shading frame is computed only for photons surviving
+            // russian roulette
+            HitRecord hit;
+            if (scene.intersect(ray, hit))
+            {
+                const Vec3f position = ray(hit.t);
+                if (path != nullptr)
+                {
+                    path->push_back({position, static_cast<int>(hit.primID)});
+                }
+
+                const BxDFType bxdf_type = hit.hitPrimitive->getBxDFType();
+                if (bxdf_type == BxDFType::DIFFUSE)
+                {
+                    // NOTE: chosen by photon index and depth, not by the size
+                    // of the thread buffer
+                    // NOTE: unsigned, i * maxDepth overflows int
+                    const uint32_t path_vertex =
+                        uint32_t(i) * uint32_t(maxDepth) + uint32_t(k);
+                    if (irradianceStride > 0 &&
+                        hashUint(path_vertex) % irradianceStride == 0)
+                    {
+                        irradiance_points.emplace_back(position,
+                                                       scene.computeShadingNormal(hit));
+                    }
+                    photons.emplace_back(throughput, position, -ray.direction);
+                }
+
+                // russian roulette
+                if (k > 0)
+                {
+                    const float russian_roulette_prob = std::min(
+                        std::max(throughput[0], std::max(throughput[1], throughput[2])),
+                        1.0f);
+                    if (sampler.getNext1D() >= russian_roulette_prob)
+                    {
+                        break;
+                    }
+                    throughput /= russian_roulette_prob;
+                }
+
+                // sample direction by BxDF
+                IntersectInfo info;
+                scene.computeIntersectInfo(ray, hit, info);
+                Vec3f dir;
+                float pdf_dir;
+                const Vec3f f = info.hitPrimitive->sampleBxDF(
+                    -ray.direction, info.surfaceInfo, TransportDirection::FROM_LIGHT,
+                    sampler, dir, pdf_dir);
+
+                // update throughput and ray
+                throughput *= f *
+                              cosTerm(-ray.direction, dir, info.surfaceInfo,
+                                      TransportDirection::FROM_LIGHT) /
+                              pdf_dir;
+                ray = Ray(info.surfaceInfo.position, dir);
+            }
+            else
+            {
+                // photon goes to the sky
+                if (path != nullptr)
+                {
+                    path->push_back({ray.direction, PhotonPathVertex::escape});
+                }
+                break;
+            }
+        }
+    }
+
+    // trace photon i for caustics photon map
+    // when hitting diffuse surface after specular, add photon to the photon
+    // array
+    // NOTE: vertices of the path are appended to path unless it is nullptr
+    void traceCausticsPhoton(const Scene &scene, Sampler &sampler, int i,
+                             std::vector<Photon> &photons,
+                             std::vector<PhotonPathVertex> *path) const
+    {
+        sampler.startPixelSample(causticsPhotonStream, i);
+        PM_STATS_ADD(photons, 1);
+
+        // sample initial ray from light and set initial throughput
+        Vec3f throughput;
+        Ray ray =
+            sampleRayFromLight(scene, sampler, throughput, &causticsProjectionMaps);
+        if (path != nullptr)
+        {
+            path->push_back({ray.origin, PhotonPathVertex::origin});
+        }
+
+        bool prev_specular = false;
+        for (int k = 0; k < maxDepth; ++k)
+        {
+            if (std::isnan(throughput[0]) || std::isnan(throughput[1]) ||
+                std::isnan(throughput[2]))
+            {
+                std::cout << "Error: Photon throughput is NaN!" << std::endl;
+                break;
+            }
+            else if (throughput[0] < 0 || throughput[1] < 0 || throughput[2] < 0)
+            {
+                std::cout << "Error: Photon throughput is minus!" << std::endl;
+                break;
+            }
+
+            HitRecord hit;
+            if (scene.intersect(ray, hit))
+            {
+                if (path != nullptr)
+                {
+                    path->push_back({ray(hit.t), static_cast<int>(hit.primID)});
+                }
+
+                const BxDFType bxdf_type = hit.hitPrimitive->getBxDFType();
+
+                // break when hitting diffuse surface without previous specular
+                if (!prev_specular && bxdf_type == BxDFType::DIFFUSE)
+                {
+                    break;
+                }
+
+                // add photon when hitting diffuse surface after specular
+                if (prev_specular && bxdf_type == BxDFType::DIFFUSE)
+                {
+                    photons.emplace_back(throughput, ray(hit.t), -ray.direction);
+                    break;
+                }
+
+                prev_specular = (bxdf_type == BxDFType::SPECULAR);
+
+                // russian roulette
+                if (k > 0)
+                {
+                    const float russian_roulette_prob = std::min(
+                        std::max(throughput[0], std::max(throughput[1], throughput[2])),
+                        1.0f);
+                    if (sampler.getNext1D() >= russian_roulette_prob)
+                    {
+                        break;
+                    }
+                    throughput /= russian_roulette_prob;
+                }
+
+                // sample direction by BxDF
+                IntersectInfo info;
+                scene.computeIntersectInfo(ray, hit, info);
+                Vec3f dir;
+                float pdf_dir;
+                const Vec3f f = info.hitPrimitive->sampleBxDF(
+                    -ray.direction, info.surfaceInfo, TransportDirection::FROM_LIGHT,
+                    sampler, dir, pdf_dir);
+
+                // update throughput and ray
+                throughput *= f *
+                              cosTerm(-ray.direction, dir, info.surfaceInfo,
+                                      TransportDirection::FROM_LIGHT) /
+                              pdf_dir;
+                ray = Ray(info.surfaceInfo.position, dir);
+            }
+            else
+            {
+                // photon goes to the sky
+                if (path != nullptr)
+                {
+                    path->push_back({ray.direction, PhotonPathVertex::escape});
+                }
+                break;
+            }
+        }
+    }
+
+    // build global photon map and precompute irradiance from the given buffers
+    // NOTE: takes buffers of each thread or single vectors(of path logs), which
+    // are passed on to setPhotons and setPoints without copying
+    template <typename PhotonsT, typename PointsT>
+    void buildGlobalPhotonMap(const PhotonsT &photonBuffers,
+                              const PointsT &pointBuffers, PhaseTimer &timer)
+    {
+        std::cout << "Building global photon map..." << std::endl;
+        timer.begin("global photon map build");
+        globalPhotonMap.setPhotons(photonBuffers);
+        globalPhotonMap.build();
+
+        // precompute irradiance
+        irradianceCache.clear();
+        if (irradianceStride > 0)
+        {
+            std::cout << "Precomputing irradiance..." << std::endl;
+            timer.begin("irradiance precompute");
+            irradianceCache.setPoints(pointBuffers);
+            const auto [points_begin, points_end] =
+                getPhotonRange(irradianceCache.getNPoints());
+
+            // NOTE: points are visited in morton order, so that consecutive
+            // lookups hit the same photons(and chunks of out-of-core maps)
+            std::vector<Vec3f> positions(points_end - points_begin);
+            for (int i = points_begin; i < points_end; ++i)
+            {
+                positions[i - points_begin] = irradianceCache.getIthPoint(i).position;
+            }
+            std::vector<int> order;
+            mortonOrder(positions.data(), positions.size(), order);
+#pragma omp parallel for
+            for (int j = 0; j < order.size(); ++j)
+            {
+                IrradiancePhoton &point =
+                    irradianceCache.getIthPoint(points_begin + order[j]);
+                point.irradiance = computeIrradianceWithPhotonMap(
+                    point.position, point.normal, point.radius2);
+            }
+            if (isDistributed())
+            {
+                std::vector<IrradiancePhoton> points(points_end - points_begin);
+                for (int i = points_begin; i < points_end; ++i)
+                {
+                    points[i - points_begin] = irradianceCache.getIthPoint(i);
+                }
+                communicator->allgather(points);
+                for (int i = 0; i < irradianceCache.getNPoints(); ++i)
+                {
+                    irradianceCache.getIthPoint(i) = points[i];
+                }
+            }
+            irradianceCache.build();
+        }
+    }
+
+    // return true if the segment origin + t * dir, t in [0, tmax] touches the
+    // box
+    static bool intersectsBounds(const Vec3f &origin, const Vec3f &dir, float tmax,
+                                 const Vec3f &bmin, const Vec3f &bmax)
+    {
+        float t0 = 0;
+        float t1 = tmax;
+        for (int d = 0; d < 3; ++d)
+        {
+            if (dir[d] == 0)
+            {
+                if (origin[d] < bmin[d] || origin[d] > bmax[d])
+                    return false;
+                continue;
+            }
+            const float inv_dir = 1.0f / dir[d];
+            float t_near = (bmin[d] - origin[d]) * inv_dir;
+            float t_far = (bmax[d] - origin[d]) * inv_dir;
+            if (t_near > t_far)
+                std::swap(t_near, t_far);
+            t0 = std::max(t0, t_near);
+            t1 = std::min(t1, t_far);
+            if (t0 > t1)
+                return false;
+        }
+        return true;
+    }
+
+    // return true if path i may change when the given faces move into bounds
+    // NOTE: a path changes only when it hit a moved face, or when a segment
+    // of it crosses where the moved faces are now
+    static bool isPathAffected(const PhotonPathLog &log, int i,
+                               const std::vector<bool> &movedFaces,
+                               const Vec3f &bmin, const Vec3f &bmax)
+    {
+        const size_t begin = log.vertexOffsets[i];
+        const size_t end = log.vertexOffsets[i + 1];
+        for (size_t v = begin; v < end; ++v)
+        {
+            const int primID = log.vertices[v].primID;
+            if (primID >= 0 && movedFaces[primID])
+                return true;
+        }
+        for (size_t v = begin + 1; v < end; ++v)
+        {
+            const Vec3f &p = log.vertices[v - 1].position;
+            const PhotonPathVertex &next = log.vertices[v];
+            const bool hit =
+                next.primID == PhotonPathVertex::escape
+                    ? intersectsBounds(p, next.position,
+                                       std::numeric_limits<float>::max(), bmin, bmax)
+                    : intersectsBounds(p, next.position - p, 1.0f, bmin, bmax);
+            if (hit)
+                return true;
+        }
+        return false;
+    }
+
+    // re-trace the paths of the log affected by the moved faces
+    // returns number of re-traced paths
+    // NOTE: each path starts its own sample, so the log equals the log of a
+    // full build
+    template <typename TraceFunc>
+    int retracePaths(const Sampler &sampler, const std::vector<bool> &movedFaces,
+                     const Vec3f &bmin, const Vec3f &bmax, PhotonPathLog &log,
+                     const TraceFunc &trace) const
+    {
+        const int n_paths = log.getNPaths();
+        std::vector<char> affected(n_paths);
+#pragma omp parallel for
+        for (int i = 0; i < n_paths; ++i)
+        {
+            affected[i] = isPathAffected(log, i, movedFaces, bmin, bmax);
+        }
+
+        const int n_threads = omp_get_max_threads();
+        std::vector<std::unique_ptr<Sampler>> samplers(n_threads);
+        for (int i = 0; i < samplers.size(); ++i)
+        {
+            samplers[i] = sampler.clone();
+        }
+        std::vector<PhotonPathLog> logs_per_thread(n_threads);
+
+        int n_retraced = 0;
+#pragma omp parallel for schedule(static) reduction(+ : n_retraced)
+        for (int i = 0; i < n_paths; ++i)
+        {
+            PhotonPathLog &thread_log = logs_per_thread[omp_get_thread_num()];
+            if (affected[i])
+            {
+                trace(*samplers[omp_get_thread_num()], i, thread_log);
+                thread_log.endPath();
+                n_retraced++;
+            }
+            else
+            {
+                thread_log.appendPath(log, i);
+            }
+        }
+
+        log.clear();
+        for (const auto &thread_log : logs_per_thread)
+        {
+            log.append(thread_log);
+        }
+        return n_retraced;
+    }
+
+    // return true if the given point is seen by the camera
+    bool isVisibleFromCamera(const Scene &scene, const Vec3f &p) const
+    {
+        Vec2f uv;
+        if (!camera->projectPoint(p, uv) || std::abs(uv[0]) > cameraAspect ||
+            std::abs(uv[1]) > 1.0f)
+        {
+            return false;
+        }
+
+        const Vec3f to_camera = camera->getPinholePosition() - p;
+        const float r = length(to_camera);
+        Ray ray_shadow(p, to_camera / r);
+        ray_shadow.tmax = r - RAY_EPS;
+        return !scene.occluded(ray_shadow);
+    }
+
+    // shoot probe rays through every cell of each light's projection map
+    // caustics: mark cells whose rays hit specular surface first
+    // global: weight cells by how often their photons land where the camera
+    // sees
+    void buildProjectionMaps(const Scene &scene)
+    {
+        std::cout << "Building projection maps..." << std::endl;
+
+        const int n_lights = scene.nLights();
+        constexpr int n_cells = ProjectionMap::nCells;
+        std::vector<float> specular(n_lights * n_cells, 0);
+        std::vector<float> visible(n_lights * n_cells, 0);
+
+#pragma omp parallel for schedule(dynamic)
+        for (int idx = 0; idx < n_lights * n_cells; ++idx)
+        {
+            const int light_idx = idx / n_cells;
+            const int cell = idx % n_cells;
+            const AreaLight &light = scene.getLight(light_idx);
+
+            UniformSampler probe_sampler;
+            probe_sampler.setSeed(idx + 1);
+
+            for (int k = 0; k < nProbesPerCell; ++k)
+            {
+                float pdf;
+                const SurfaceInfo light_surf = light.samplePoint(probe_sampler, pdf);
+                const Vec2f u =
+                    ProjectionMap::cellToSample(cell, probe_sampler.getNext2D());
+                Ray ray(light_surf.position,
+                        light.sampleDirection(light_surf, u, pdf));
+
+                // follow specular bounces up to the first diffuse surface
+                for (int depth = 0; depth < maxDepth; ++depth)
+                {
+                    HitRecord hit;
+                    if (!scene.intersect(ray, hit))
+                        break;
+
+                    const BxDFType bxdf_type = hit.hitPrimitive->getBxDFType();
+                    if (bxdf_type == BxDFType::DIFFUSE)
+                    {
+                        if (camera != nullptr &&
+                            isVisibleFromCamera(scene, ray(hit.t)))
+                        {
+                            visible[idx] += 1.0f / nProbesPerCell;
+                        }
+                        break;
+                    }
+
+                    if (depth == 0)
+                    {
+                        specular[idx] = 1.0f;
+                    }
+
+                    IntersectInfo info;
+                    scene.computeIntersectInfo(ray, hit, info);
+                    Vec3f dir;
+                    float pdf_dir;
+                    info.hitPrimitive->sampleBxDF(-ray.direction, info.surfaceInfo,
+                                                  TransportDirection::FROM_LIGHT,
+                                                  probe_sampler, dir, pdf_dir);
+                    ray = Ray(info.surfaceInfo.position, dir);
+                }
+            }
+        }
+
+        globalProjectionMaps.clear();
+        causticsProjectionMaps.clear();
+        int n_specular_cells = 0;
+        for (int i = 0; i < n_lights; ++i)
+        {
+            const std::vector<float> specular_cells(
+                specular.begin() + i * n_cells, specular.begin() + (i + 1) * n_cells);
+            const std::vector<float> caustics_weights =
+                ProjectionMap::dilate(specular_cells);
+            for (const float w : caustics_weights)
+            {
+                n_specular_cells += w > 0;
+            }
+            causticsProjectionMaps.emplace_back(caustics_weights);
+
+            // NOTE: without camera, global photons keep uniform emission
+            std::vector<float> global_weights(n_cells, 1.0f);
+            if (camera != nullptr)
+            {
+                for (int c = 0; c < n_cells; ++c)
+                {
+                    global_weights[c] = importanceFloor + visible[i * n_cells + c];
+                }
+            }
+            globalProjectionMaps.emplace_back(global_weights);
+        }
+        std::cout << "Projection map cells toward specular: " << n_specular_cells
+                  << " / " << n_lights * n_cells << std::endl;
+    }
+
+    // compute reflected radiance with the given photon map
+    Vec3f estimateRadianceWithPhotonMap(const PhotonMap &photonMap, int nPhotons,
+                                        int nEstimation,
+                                        const PhotonEstimation &estimation,
+                                        float radius, const Vec3f &wo,
+                                        const IntersectInfo &info) const
+    {
+        Vec3f Lo;
+        if (estimation == PhotonEstimation::FIXED_RADIUS)
+        {
+            // gather photons within the fixed radius
+            const float radius2 = radius * radius;
+            photonMap.queryRadius(
+                info.surfaceInfo.position, radius2,
+                [&](int photon_idx, float dist2)
+                {
+                    const Photon &photon = photonMap.getIthPhoton(photon_idx);
+                    const Vec3f f = info.hitPrimitive->evaluateBxDF(
+                        wo, photon.wi, info.surfaceInfo, TransportDirection::FROM_CAMERA);
+                    Lo += f * photon.throughput;
+                });
+            Lo /= (nPhotons * PI * radius2);
+        }
+        else
+        {
+            // get nearby photons
+            // NOTE: each render thread reuses its scratch heap for the whole frame
+            thread_local KNNHeap photon_heap;
+            photonMap.queryKNearestPhotons(info.surfaceInfo.position, nEstimation,
+                                           photon_heap);
+
+            for (const auto &[dist2, photon_idx] : photon_heap)
+            {
+                const Photon &photon = photonMap.getIthPhoton(photon_idx);
+                const Vec3f f = info.hitPrimitive->evaluateBxDF(
+                    wo, photon.wi, info.surfaceInfo, TransportDirection::FROM_CAMERA);
+                Lo += f * photon.throughput;
+            }
+            if (!photon_heap.empty())
+            {
+                Lo /= (nPhotons * PI * photon_heap.maxDist2());
+            }
+        }
+
+        return Lo;
+    }
 
-    // maximum depth to estimate radiance by final gathering
-    const int finalGatheringDepth;
+    // compute irradiance at the given point with global photon map, and the
+    // squared radius of the estimate
+    // NOTE: only photons arriving from above the surface are counted
+    Vec3f computeIrradianceWithPhotonMap(const Vec3f &p, const Vec3f &n,
+                                         float &radius2) const
+    {
+        Vec3f E;
+        if (globalEstimation == PhotonEstimation::FIXED_RADIUS)
+        {
+            radius2 = globalRadius * globalRadius;
+            globalPhotonMap.queryRadius(
+                p, radius2,
+                [&](int photon_idx, float dist2)
+                {
+                    const Photon &photon = globalPhotonMap.getIthPhoton(photon_idx);
+                    if (dot(photon.wi, n) > 0)
+                    {
+                        E += photon.throughput;
+                    }
+                });
+            E /= (nPhotonsGlobal * PI * radius2);
+        }
+        else
+        {
+            thread_local KNNHeap photon_heap;
+            globalPhotonMap.queryKNearestPhotons(p, nEstimationGlobal, photon_heap);
 
-    // maximum depth of photon tracing, eye tracing
-    const int maxDepth;
+            for (const auto &[dist2, photon_idx] : photon_heap)
+            {
+                const Photon &photon = globalPhotonMap.getIthPhoton(photon_idx);
+                if (dot(photon.wi, n) > 0)
+                {
+                    E += photon.throughput;
+                }
+            }
+            radius2 = 0;
+            if (!photon_heap.empty())
+            {
+                radius2 = photon_heap.maxDist2();
+                E /= (nPhotonsGlobal * PI * radius2);
+            }
+        }
 
-    PhotonMap globalPhotonMap;
-    PhotonMap causticsPhotonMap;
+        return E;
+    }
 
     // compute reflected radiance with global photon map
     Vec3f computeRadianceWithPhotonMap(const Vec3f &wo,
                                        const IntersectInfo &info) const
     {
-        // get nearby photons
-        float max_dist2;
-        const std::vector<int> photon_indices =
-            globalPhotonMap.queryKNearestPhotons(info.surfaceInfo.position,
-                                                 nEstimationGlobal, max_dist2);
+        return estimateRadianceWithPhotonMap(globalPhotonMap, nPhotonsGlobal,
+                                             nEstimationGlobal, globalEstimation,
+                                             globalRadius, wo, info);
+    }
 
-        Vec3f Lo;
-        for (const int photon_idx : photon_indices)
+    // compute reflected radiance at the end of final gathering ray with global
+    // photon map, using precomputed irradiance when available
+    // NOTE: Lambert is the only diffuse BxDF and doesn't depend on wi, so
+    // evaluating it toward the normal gives rho / PI
+    Vec3f computeGatheredRadianceWithPhotonMap(const Vec3f &wo,
+                                               const IntersectInfo &info) const
+    {
+        Vec3f E;
+        if (!irradianceCache.empty() &&
+            irradianceCache.lookup(info.surfaceInfo.position,
+                                   info.surfaceInfo.shadingNormal, E))
         {
-            const Photon &photon = globalPhotonMap.getIthPhoton(photon_idx);
             const Vec3f f = info.hitPrimitive->evaluateBxDF(
-                wo, photon.wi, info.surfaceInfo, TransportDirection::FROM_CAMERA);
-            Lo += f * photon.throughput;
-        }
-        if (photon_indices.size() > 0)
-        {
-            Lo /= (nPhotonsGlobal * PI * max_dist2);
+                wo, info.surfaceInfo.shadingNormal, info.surfaceInfo,
+                TransportDirection::FROM_CAMERA);
+            return f * E;
         }
-        return Lo;
+
+        return computeRadianceWithPhotonMap(wo, info);
     }
 
     // compute reflected radiance with caustics photon map
     Vec3f computeCausticsWithPhotonMap(const Vec3f &wo,
                                        const IntersectInfo &info) const
     {
-        // get nearby photons
-        float max_dist2;
-        const std::vector<int> photon_indices =
-            causticsPhotonMap.queryKNearestPhotons(info.surfaceInfo.position,
-                                                   nEstimationGlobal, max_dist2);
+        return estimateRadianceWithPhotonMap(causticsPhotonMap, nPhotonsCaustics,
+                                             nEstimationCaustics, causticsEstimation,
+                                             causticsRadius, wo, info);
+    }
 
-        Vec3f Lo;
-        for (const int photon_idx : photon_indices)
+    // answer all lookups of the batch with the given photon map
+    // NOTE: lookups are answered in morton order of their positions
+    void estimateRadianceWithPhotonMapBatch(const PhotonMap &photonMap,
+                                            int nPhotons, int nEstimation,
+                                            const PhotonEstimation &estimation,
+                                            float radius,
+                                            PhotonLookupBatch &batch) const
+    {
+        batch.radiance.assign(batch.size(), Vec3f(0));
+        if (estimation == PhotonEstimation::FIXED_RADIUS)
         {
-            const Photon &photon = causticsPhotonMap.getIthPhoton(photon_idx);
-            const Vec3f f = info.hitPrimitive->evaluateBxDF(
-                wo, photon.wi, info.surfaceInfo, TransportDirection::FROM_CAMERA);
-            Lo += f * photon.throughput;
+            const float radius2 = radius * radius;
+            photonMap.queryRadiusBatch(
+                batch.positions.data(), batch.size(), radius2,
+                [&](int query_idx, int photon_idx, float dist2)
+                {
+                    const Photon &photon = photonMap.getIthPhoton(photon_idx);
+                    const IntersectInfo &info = *batch.infos[query_idx];
+                    const Vec3f f = info.hitPrimitive->evaluateBxDF(
+                        batch.wos[query_idx], photon.wi, info.surfaceInfo,
+                        TransportDirection::FROM_CAMERA);
+                    batch.radiance[query_idx] += f * photon.throughput;
+                });
+            for (auto &Lo : batch.radiance)
+            {
+                Lo /= (nPhotons * PI * radius2);
+            }
         }
-        if (photon_indices.size() > 0)
+        else
         {
-            Lo /= (nPhotonsCaustics * PI * max_dist2);
+            photonMap.queryKNearestPhotonsBatch(
+                batch.positions.data(), batch.size(), nEstimation,
+                [&](int query_idx, const KNNHeap &photon_heap)
+                {
+                    const IntersectInfo &info = *batch.infos[query_idx];
+                    Vec3f Lo;
+                    for (const auto &[dist2, photon_idx] : photon_heap)
+                    {
+                        const Photon &photon = photonMap.getIthPhoton(photon_idx);
+                        const Vec3f f = info.hitPrimitive->evaluateBxDF(
+                            batch.wos[query_idx], photon.wi, info.surfaceInfo,
+                            TransportDirection::FROM_CAMERA);
+                        Lo += f * photon.throughput;
+                    }
+                    if (!photon_heap.empty())
+                    {
+                        Lo /= (nPhotons * PI * photon_heap.maxDist2());
+                    }
+                    batch.radiance[query_idx] = Lo;
+                });
         }
-
-        return Lo;
     }
 
-    // compute direct illumination with explicit light sampling(NEE)
-    Vec3f computeDirectIllumination(const Scene &scene, const Vec3f &wo,
-                                    const IntersectInfo &info,
-                                    Sampler &sampler) const
+    // batched computeRadianceWithPhotonMap
+    void computeRadianceWithPhotonMapBatch(PhotonLookupBatch &batch) const
     {
-        Vec3f Ld;
-
-        // sample light
-        float pdf_choose_light;
-        const std::shared_ptr<Light> light =
-            scene.sampleLight(sampler, pdf_choose_light);
-
-        // sample point on light
-        float pdf_pos_light;
-        const SurfaceInfo light_surf = light->samplePoint(sampler, pdf_pos_light);
+        estimateRadianceWithPhotonMapBatch(globalPhotonMap, nPhotonsGlobal,
+                                           nEstimationGlobal, globalEstimation,
+                                           globalRadius, batch);
+    }
 
-        // convert positional pdf to directional pdf
-        const Vec3f wi = normalize(light_surf.position - info.surfaceInfo.position);
-        const float r = length(light_surf.position - info.surfaceInfo.position);
-        const float pdf_dir =
-            pdf_pos_light * r * r / std::abs(dot(-wi, light_surf.shadingNormal));
+    // batched computeGatheredRadianceWithPhotonMap
+    void computeGatheredRadianceWithPhotonMapBatch(PhotonLookupBatch &batch) const
+    {
+        if (irradianceCache.empty())
+        {
+            computeRadianceWithPhotonMapBatch(batch);
+            return;
+        }
 
-        // create shadow ray
-        Ray ray_shadow(info.surfaceInfo.position, wi);
-        ray_shadow.tmax = r - RAY_EPS;
+        // look up precomputed irradiance in morton order, collect misses
+        thread_local std::vector<int> order;
+        thread_local std::vector<int> misses;
+        thread_local PhotonLookupBatch miss_batch;
+        mortonOrder(batch.positions.data(), batch.size(), order);
+        batch.radiance.assign(batch.size(), Vec3f(0));
+        misses.clear();
+        miss_batch.clear();
+        for (const int i : order)
+        {
+            const IntersectInfo &info = *batch.infos[i];
+            Vec3f E;
+            if (irradianceCache.lookup(info.surfaceInfo.position,
+                                       info.surfaceInfo.shadingNormal, E))
+            {
+                const Vec3f f = info.hitPrimitive->evaluateBxDF(
+                    batch.wos[i], info.surfaceInfo.shadingNormal, info.surfaceInfo,
+                    TransportDirection::FROM_CAMERA);
+                batch.radiance[i] = f * E;
+            }
+            else
+            {
+                misses.push_back(i);
+                miss_batch.push(batch.wos[i], info);
+            }
+        }
 
-        // trace ray to the light
-        IntersectInfo info_shadow;
-        if (!scene.intersect(ray_shadow, info_shadow))
+        // fall back to the full estimate
+        computeRadianceWithPhotonMapBatch(miss_batch);
+        for (int i = 0; i < misses.size(); ++i)
         {
-            const Vec3f Le = light->Le(light_surf, -wi);
-            const Vec3f f = info.hitPrimitive->evaluateBxDF(
-                wo, wi, info.surfaceInfo, TransportDirection::FROM_CAMERA);
-            const float cos = std::abs(dot(wi, info.surfaceInfo.shadingNormal));
-            Ld = f * cos * Le / (pdf_choose_light * pdf_dir);
+            batch.radiance[misses[i]] = miss_batch.radiance[i];
         }
+    }
 
-        return Ld;
+    // batched computeCausticsWithPhotonMap
+    void computeCausticsWithPhotonMapBatch(PhotonLookupBatch &batch) const
+    {
+        estimateRadianceWithPhotonMapBatch(causticsPhotonMap, nPhotonsCaustics,
+                                           nEstimationCaustics, causticsEstimation,
+                                           causticsRadius, batch);
     }
 
     Vec3f computeIndirectIlluminationRecursive(const Scene &scene,
@@ -201,7 +1253,8 @@ private:
             if (bxdf_type == BxDFType::DIFFUSE)
             {
                 Li += f * cos *
-                      computeRadianceWithPhotonMap(-ray_fg.direction, info_fg) /
+                      computeGatheredRadianceWithPhotonMap(-ray_fg.direction,
+                                                           info_fg) /
                       pdf_dir;
             }
             // when hitting specular, recursively call this function
@@ -226,33 +1279,6 @@ private:
         return computeIndirectIlluminationRecursive(scene, wo, info, sampler, 0);
     }
 
-    // sample initial ray from light and compute initial throughput
-    Ray sampleRayFromLight(const Scene &scene, Sampler &sampler,
-                           Vec3f &throughput)
-    {
-        // sample light
-        float light_choose_pdf;
-        const std::shared_ptr<Light> light =
-            scene.sampleLight(sampler, light_choose_pdf);
-
-        // sample point on light
-        float light_pos_pdf;
-        const SurfaceInfo light_surf = light->samplePoint(sampler, light_pos_pdf);
-
-        // sample direction on light
-        float light_dir_pdf;
-        const Vec3f dir =
-            light->sampleDirection(light_surf, sampler, light_dir_pdf);
-
-        // spawn ray
-        Ray ray(light_surf.position, dir);
-        throughput = light->Le(light_surf, dir) /
-                     (light_choose_pdf * light_pos_pdf * light_dir_pdf) *
-                     std::abs(dot(dir, light_surf.shadingNormal));
-
-        return ray;
-    }
-
     Vec3f integrateRecursive(const Ray &ray, const Scene &scene, Sampler &sampler,
                              int depth) const
     {
@@ -323,7 +1349,7 @@ private:
                 else
                 {
                     // sample all direction
-                    const std::vector<DirectionPair> dir_pairs =
+                    const DirectionPairs dir_pairs =
                         info.hitPrimitive->sampleAllBxDF(-ray.direction, info.surfaceInfo,
                                                          TransportDirection::FROM_CAMERA);
 
@@ -370,203 +1396,395 @@ public:
 
     const PhotonMap *getPhotonMapPtr() const { return &globalPhotonMap; }
 
+    // set memory layout of both photon maps
+    // NOTE: takes effect on next build
+    void setPhotonMapLayout(const PhotonMapLayout &layout)
+    {
+        globalPhotonMap.setLayout(layout);
+        causticsPhotonMap.setLayout(layout);
+    }
+
+    // set record format of both photon maps
+    // NOTE: takes effect on next build
+    void setPhotonFormat(const PhotonFormat &format)
+    {
+        globalPhotonMap.setFormat(format);
+        causticsPhotonMap.setFormat(format);
+    }
+
+    // precompute irradiance at every n-th photon of global photon map for final
+    // gathering, 0 to disable
+    // NOTE: takes effect on next build
+    void setIrradianceStride(int stride) { irradianceStride = stride; }
+
+    // set radiance estimation method of global photon map
+    // NOTE: radius is used only by fixed radius estimation
+    void setGlobalEstimation(const PhotonEstimation &estimation, float radius = 0)
+    {
+        globalEstimation = estimation;
+        globalRadius = radius;
+    }
+
+    // set radiance estimation method of caustics photon map
+    // NOTE: radius is used only by fixed radius estimation
+    void setCausticsEstimation(const PhotonEstimation &estimation,
+                               float radius = 0)
+    {
+        causticsEstimation = estimation;
+        causticsRadius = radius;
+    }
+
+    // set distribution of photon emission directions
+    // NOTE: takes effect on next build
+    void setPhotonEmission(const PhotonEmission &emission)
+    {
+        this->emission = emission;
+    }
+
+    // set camera to compute visual importance of photon emission with
+    // NOTE: aspect is width / height of the rendered image
+    void setCamera(const Camera &camera, float aspect)
+    {
+        this->camera = &camera;
+        cameraAspect = aspect;
+    }
+
+    // persist photon maps in the given directory, empty to disable
+    // NOTE: build maps photon maps of an earlier run with the same scene,
+    // photon counts, seed and settings instead of tracing photons
+    void setPhotonMapCache(const std::filesystem::path &dir)
+    {
+        photonMapCacheDir = dir;
+    }
+
+    // share photon tracing with other ranks
+    // NOTE: each rank traces its own range of photon indices, photons of all
+    // ranks are gathered in index order and every rank builds the same maps
+    void setCommunicator(const Communicator *communicator)
+    {
+        this->communicator = communicator;
+    }
+
+    // page photons of out-of-core layout in from files in the given directory,
+    // keeping at most maxResidentBytes of photons of each map in memory
+    // NOTE: takes effect on next build. files get unique names and are removed
+    // with the photon map, so concurrent runs can share the directory
+    void setPhotonMapOutOfCore(const std::filesystem::path &dir,
+                               size_t maxResidentBytes, int chunkSize = 1 << 16)
+    {
+        outOfCoreDir = dir;
+        outOfCoreResidentBytes = maxResidentBytes;
+        outOfCoreChunkSize = chunkSize;
+    }
+
+    // keep paths of traced photons for update, ignored when distributed
+    // NOTE: takes effect on next build
+    void setPathLogging(bool logging) { pathLogging = logging; }
+
+    const PhotonMap &getGlobalPhotonMap() const { return globalPhotonMap; }
+    const PhotonMap &getCausticsPhotonMap() const { return causticsPhotonMap; }
+
+    // wall time of each phase of the last build, in order
+    const PhaseTimes &getPhaseTimes() const { return phaseTimes; }
+
     // photon tracing and build photon map
     void build(const Scene &scene, Sampler &sampler) override
     {
-        std::vector<Photon> photons;
+        const int n_threads = omp_get_max_threads();
+        phaseTimes.clear();
+        PhaseTimer timer(phaseTimes);
+        if (!outOfCoreDir.empty())
+        {
+            globalPhotonMap.setOutOfCore(outOfCoreDir, "global",
+                                         outOfCoreResidentBytes, outOfCoreChunkSize);
+            causticsPhotonMap.setOutOfCore(outOfCoreDir, "caustics",
+                                           outOfCoreResidentBytes, outOfCoreChunkSize);
+        }
+        // NOTE: cleared before loading, so that update doesn't use the log of
+        // previous maps
+        globalPathLog.clear();
+        causticsPathLog.clear();
+        if (!photonMapCacheDir.empty())
+        {
+            timer.begin("photon map load");
+            // NOTE: ranks trace photons together, so either all of them load
+            // the maps or none
+            bool loaded = loadPhotonMaps(scene, sampler);
+            if (communicator != nullptr)
+            {
+                loaded = communicator->allTrue(loaded);
+            }
+            if (loaded)
+            {
+                std::cout << "Loaded photon maps from "
+                          << photonMapCacheDir.generic_string() << std::endl;
+                return;
+            }
+        }
+
+        globalProjectionMaps.clear();
+        causticsProjectionMaps.clear();
+        if (emission == PhotonEmission::IMPORTANCE)
+        {
+            timer.begin("projection map build");
+            buildProjectionMaps(scene);
+        }
 
         // init sampler for each thread
-        std::vector<std::unique_ptr<Sampler>> samplers(omp_get_max_threads());
+        // NOTE: every photon starts its own sample, so photon maps don't depend on
+        // the number of threads
+        std::vector<std::unique_ptr<Sampler>> samplers(n_threads);
         for (int i = 0; i < samplers.size(); ++i)
         {
             samplers[i] = sampler.clone();
-            samplers[i]->setSeed(samplers[i]->getSeed() * (i + 1));
         }
 
+        // init photon buffer for each thread
+        // NOTE: each thread deposits into its own buffer without locking. with
+        // static scheduling every thread traces a contiguous range of photons, so
+        // merging the buffers in thread order keeps the photon order deterministic
+        std::vector<std::vector<Photon>> photons_per_thread(samplers.size());
+
+        // init buffer of points to precompute irradiance for each thread
+        std::vector<std::vector<IrradiancePhoton>> irradiance_points_per_thread(
+            samplers.size());
+
+        // init path log for each thread
+        // NOTE: logged photons and points are deposited into the logs instead
+        const bool logging = pathLogging && !isDistributed();
+        std::vector<PhotonPathLog> logs_per_thread(logging ? samplers.size() : 0);
+
+        // spill photons of out-of-core photon maps whenever a thread buffer
+        // fills, so that neither tracing nor build holds all photons
+        // NOTE: buffers keep the first path traced into them, threads trace
+        // contiguous ranges of paths with static scheduling
+        const bool spilling = !logging && !isDistributed();
+        Vec3f scene_min, scene_max;
+        scene.getBounds(scene_min, scene_max);
+        std::vector<int> first_paths(samplers.size(), 0);
+        const auto spill = [&](PhotonMap &photonMap, bool spilled, int thread,
+                               bool flush)
+        {
+            std::vector<Photon> &photons = photons_per_thread[thread];
+            if (spilled && (flush || photons.size() >= size_t(spillBufferSize)))
+            {
+                photonMap.spillPhotons(photons, first_paths[thread]);
+            }
+        };
+
         // build global photon map
         // photon tracing
         std::cout << "Tracing photons for global photon map..." << std::endl;
-#pragma omp parallel for
-        for (int i = 0; i < nPhotonsGlobal; ++i)
+        timer.begin("global photon tracing");
+        const bool global_spilled =
+            spilling &&
+            globalPhotonMap.beginSpill(scene_min, scene_max, nPhotonsGlobal);
+        const auto [global_begin, global_end] = getPhotonRange(nPhotonsGlobal);
+#pragma omp parallel for schedule(static)
+        for (int i = global_begin; i < global_end; ++i)
         {
-            auto &sampler_per_thread = *samplers[omp_get_thread_num()];
-
-            // sample initial ray from light and set initial throughput
-            Vec3f throughput;
-            Ray ray = sampleRayFromLight(scene, sampler_per_thread, throughput);
-
-            // trace photons
-            // whener hitting diffuse surface, add photon to the photon array
-            // recursively tracing photon with russian roulette
-            for (int k = 0; k < maxDepth; ++k)
+            const int thread = omp_get_thread_num();
+            if (logging)
             {
-                if (std::isnan(throughput[0]) || std::isnan(throughput[1]) ||
-                    std::isnan(throughput[2]))
-                {
-                    std::cout << "Error: Photon throughput is NaN!" << std::endl;
-                    break;
-                }
-                else if (throughput[0] < 0 || throughput[1] < 0 ||
-                         throughput[2] < 0)
-                {
-                    std::cout << "Error: Photon throughput is minus!" << std::endl;
-                    break;
-                }
-
-                IntersectInfo info;
-                if (scene.intersect(ray, info))
-                {
-                    const BxDFType bxdf_type = info.hitPrimitive->getBxDFType();
-                    if (bxdf_type == BxDFType::DIFFUSE)
-                    {
-                        // TODO: remove lock to get more speed
-#pragma omp critical
-                        {
-                            photons.emplace_back(throughput, info.surfaceInfo.position,
-                                                 -ray.direction);
-                        }
-                    }
-
-                    // russian roulette
-                    if (k > 0)
-                    {
-                        const float russian_roulette_prob = std::min(
-                            std::max(throughput[0], std::max(throughput[1], throughput[2])),
-                            1.0f);
-                        if (sampler_per_thread.getNext1D() >= russian_roulette_prob)
-                        {
-                            break;
-                        }
-                        throughput /= russian_roulette_prob;
-                    }
-
-                    // sample direction by BxDF
-                    Vec3f dir;
-                    float pdf_dir;
-                    const Vec3f f = info.hitPrimitive->sampleBxDF(
-                        -ray.direction, info.surfaceInfo, TransportDirection::FROM_LIGHT,
-                        sampler_per_thread, dir, pdf_dir);
-
-                    // update throughput and ray
-                    throughput *= f *
-                                  cosTerm(-ray.direction, dir, info.surfaceInfo,
-                                          TransportDirection::FROM_LIGHT) /
-                                  pdf_dir;
-                    ray = Ray(info.surfaceInfo.position, dir);
-                }
-                else
+                PhotonPathLog &log = logs_per_thread[thread];
+                traceGlobalPhoton(scene, *samplers[thread], i, log.photons, log.points,
+                                  &log.vertices);
+                log.endPath();
+            }
+            else
+            {
+                if (photons_per_thread[thread].empty())
                 {
-                    // photon goes to the sky
-                    break;
+                    first_paths[thread] = i;
                 }
+                traceGlobalPhoton(scene, *samplers[thread], i,
+                                  photons_per_thread[thread],
+                                  irradiance_points_per_thread[thread], nullptr);
+                spill(globalPhotonMap, global_spilled, thread, false);
             }
         }
+        for (size_t thread = 0; thread < photons_per_thread.size(); ++thread)
+        {
+            spill(globalPhotonMap, global_spilled, thread, true);
+        }
 
         // build photon map
-        std::cout << "Building global photon map..." << std::endl;
-        globalPhotonMap.setPhotons(photons);
-        globalPhotonMap.build();
+        if (isDistributed())
+        {
+            timer.begin("global photon gather");
+            communicator->allgather(photons_per_thread);
+            communicator->allgather(irradiance_points_per_thread);
+        }
+
+        if (logging)
+        {
+            for (auto &log : logs_per_thread)
+            {
+                globalPathLog.append(log);
+                log.clear();
+            }
+            buildGlobalPhotonMap(globalPathLog.photons, globalPathLog.points,
+                                 timer);
+        }
+        else
+        {
+            buildGlobalPhotonMap(photons_per_thread, irradiance_points_per_thread,
+                                 timer);
+        }
 
         // build caustics photon map
         if (finalGatheringDepth > 0)
         {
-            photons.clear();
+            // reuse photon buffers, keeping their capacity
+            for (auto &photons : photons_per_thread)
+            {
+                photons.clear();
+            }
 
             // photon tracing
             std::cout << "Tracing photons for caustics photon map..." << std::endl;
-#pragma omp parallel for
-            for (int i = 0; i < nPhotonsCaustics; ++i)
+            timer.begin("caustics photon tracing");
+            const bool caustics_spilled =
+                spilling &&
+                causticsPhotonMap.beginSpill(scene_min, scene_max, nPhotonsCaustics);
+            const auto [caustics_begin, caustics_end] =
+                getPhotonRange(nPhotonsCaustics);
+#pragma omp parallel for schedule(static)
+            for (int i = caustics_begin; i < caustics_end; ++i)
             {
-                auto &sampler_per_thread = *samplers[omp_get_thread_num()];
-
-                // sample initial ray from light and set initial throughput
-                Vec3f throughput;
-                Ray ray = sampleRayFromLight(scene, sampler_per_thread, throughput);
-
-                // when hitting diffuse surface after specular, add photon to the photon
-                // array
-                bool prev_specular = false;
-                for (int k = 0; k < maxDepth; ++k)
+                const int thread = omp_get_thread_num();
+                if (logging)
                 {
-                    if (std::isnan(throughput[0]) || std::isnan(throughput[1]) ||
-                        std::isnan(throughput[2]))
-                    {
-                        std::cout << "Error: Photon throughput is NaN!" << std::endl;
-                        break;
-                    }
-                    else if (throughput[0] < 0 || throughput[1] < 0 ||
-                             throughput[2] < 0)
+                    PhotonPathLog &log = logs_per_thread[thread];
+                    traceCausticsPhoton(scene, *samplers[thread], i, log.photons,
+                                        &log.vertices);
+                    log.endPath();
+                }
+                else
+                {
+                    if (photons_per_thread[thread].empty())
                     {
-                        std::cout << "Error: Photon throughput is minus!" << std::endl;
-                        break;
+                        first_paths[thread] = i;
                     }
+                    traceCausticsPhoton(scene, *samplers[thread], i,
+                                        photons_per_thread[thread], nullptr);
+                    spill(causticsPhotonMap, caustics_spilled, thread, false);
+                }
+            }
+            for (size_t thread = 0; thread < photons_per_thread.size(); ++thread)
+            {
+                spill(causticsPhotonMap, caustics_spilled, thread, true);
+            }
 
-                    IntersectInfo info;
-                    if (scene.intersect(ray, info))
-                    {
-                        const BxDFType bxdf_type = info.hitPrimitive->getBxDFType();
+            if (isDistributed())
+            {
+                timer.begin("caustics photon gather");
+                communicator->allgather(photons_per_thread);
+            }
 
-                        // break when hitting diffuse surface without previous specular
-                        if (!prev_specular && bxdf_type == BxDFType::DIFFUSE)
-                        {
-                            break;
-                        }
+            std::cout << "Building caustics photon map..." << std::endl;
+            timer.begin("caustics photon map build");
+            if (logging)
+            {
+                for (const auto &log : logs_per_thread)
+                {
+                    causticsPathLog.append(log);
+                }
+                causticsPhotonMap.setPhotons(causticsPathLog.photons);
+            }
+            else
+            {
+                causticsPhotonMap.setPhotons(photons_per_thread);
+            }
+            causticsPhotonMap.build();
+        }
 
-                        // add photon when hitting diffuse surface after specular
-                        if (prev_specular && bxdf_type == BxDFType::DIFFUSE)
-                        {
-                            // TODO: remove lock to get more speed
-#pragma omp critical
-                            {
-                                photons.emplace_back(throughput, info.surfaceInfo.position,
-                                                     -ray.direction);
-                            }
-                            break;
-                        }
+        // NOTE: maps are the same on every rank, root saves them
+        if (!photonMapCacheDir.empty() &&
+            (communicator == nullptr || communicator->isRoot()))
+        {
+            timer.begin("photon map save");
+            savePhotonMaps(scene, sampler);
+        }
+    }
 
-                        prev_specular = (bxdf_type == BxDFType::SPECULAR);
+    // update photon maps after the given faces moved
+    // NOTE: re-traces only the logged paths touching the moved faces, which
+    // gives the same maps as build. falls back to build without path log, when
+    // lights moved or when emission depends on the scene
+    void update(const Scene &scene, Sampler &sampler,
+                const std::vector<uint32_t> &movedFaces)
+    {
+        bool full = !pathLogging || isDistributed() ||
+                    emission == PhotonEmission::IMPORTANCE;
+        // NOTE: maps loaded from cache have no path log
+        if (!full && (globalPathLog.getNPaths() != nPhotonsGlobal ||
+                      (finalGatheringDepth > 0 &&
+                       causticsPathLog.getNPaths() != nPhotonsCaustics)))
+        {
+            std::cout << "Warning: no photon path log, re-tracing all photons"
+                      << std::endl;
+            full = true;
+        }
+        for (const uint32_t faceID : movedFaces)
+        {
+            full |= scene.isEmissive(faceID);
+        }
+        if (full)
+        {
+            build(scene, sampler);
+            return;
+        }
 
-                        // russian roulette
-                        if (k > 0)
-                        {
-                            const float russian_roulette_prob =
-                                std::min(std::max(throughput[0],
-                                                  std::max(throughput[1], throughput[2])),
-                                         1.0f);
-                            if (sampler_per_thread.getNext1D() >= russian_roulette_prob)
-                            {
-                                break;
-                            }
-                            throughput /= russian_roulette_prob;
-                        }
+        phaseTimes.clear();
+        PhaseTimer timer(phaseTimes);
 
-                        // sample direction by BxDF
-                        Vec3f dir;
-                        float pdf_dir;
-                        const Vec3f f =
-                            info.hitPrimitive->sampleBxDF(-ray.direction, info.surfaceInfo,
-                                                          TransportDirection::FROM_LIGHT,
-                                                          sampler_per_thread, dir, pdf_dir);
-
-                        // update throughput and ray
-                        throughput *= f *
-                                      cosTerm(-ray.direction, dir, info.surfaceInfo,
-                                              TransportDirection::FROM_LIGHT) /
-                                      pdf_dir;
-                        ray = Ray(info.surfaceInfo.position, dir);
-                    }
-                    else
-                    {
-                        // photon goes to the sky
-                        break;
-                    }
-                }
-            }
+        std::vector<bool> moved_faces(scene.nFaces(), false);
+        for (const uint32_t faceID : movedFaces)
+        {
+            moved_faces[faceID] = true;
+        }
+
+        // NOTE: widened, since rays start slightly off the surfaces
+        Vec3f bmin, bmax;
+        scene.getBounds(movedFaces, bmin, bmax);
+        bmin = bmin - Vec3f(RAY_EPS);
+        bmax = bmax + Vec3f(RAY_EPS);
+
+        std::cout << "Re-tracing photons for global photon map..." << std::endl;
+        timer.begin("global photon tracing");
+        int n_retraced = retracePaths(
+            sampler, moved_faces, bmin, bmax, globalPathLog,
+            [&](Sampler &sampler_per_thread, int i, PhotonPathLog &log)
+            {
+                traceGlobalPhoton(scene, sampler_per_thread, i, log.photons,
+                                  log.points, &log.vertices);
+            });
+        buildGlobalPhotonMap(globalPathLog.photons, globalPathLog.points, timer);
+        int n_paths = nPhotonsGlobal;
+
+        if (finalGatheringDepth > 0)
+        {
+            std::cout << "Re-tracing photons for caustics photon map..."
+                      << std::endl;
+            timer.begin("caustics photon tracing");
+            n_retraced += retracePaths(
+                sampler, moved_faces, bmin, bmax, causticsPathLog,
+                [&](Sampler &sampler_per_thread, int i, PhotonPathLog &log)
+                {
+                    traceCausticsPhoton(scene, sampler_per_thread, i, log.photons,
+                                        &log.vertices);
+                });
+            n_paths += nPhotonsCaustics;
 
             std::cout << "Building caustics photon map..." << std::endl;
-            causticsPhotonMap.setPhotons(photons);
+            timer.begin("caustics photon map build");
+            causticsPhotonMap.setPhotons(causticsPathLog.photons);
             causticsPhotonMap.build();
         }
+
+        std::cout << "Re-traced photons: " << n_retraced << " / " << n_paths
+                  << std::endl;
     }
 
     Vec3f integrate(const Ray &ray_in, const Scene &scene,
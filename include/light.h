@@ -4,17 +4,9 @@
 #include "sampler.h"
 #include "triangle.h"
 
-// light interface
-class Light
-{
-public:
-    virtual Vec3f Le(const SurfaceInfo &info, const Vec3f &dir) const = 0;
-    virtual SurfaceInfo samplePoint(Sampler &sampler, float &pdf) const = 0;
-    virtual Vec3f sampleDirection(const SurfaceInfo &surfInfo, Sampler &sampler,
-                                  float &pdf) const = 0;
-};
-
-class AreaLight : public Light
+// diffuse emitting triangle
+// NOTE: the only kind of light, so it is called without virtual dispatch
+class AreaLight
 {
 private:
     const Vec3f le; // emission
@@ -25,27 +17,41 @@ public:
         : le(le), triangle(triangle) {}
 
     // return emission
-    Vec3f Le(const SurfaceInfo &info, const Vec3f &dir) const override
+    Vec3f Le(const SurfaceInfo &info, const Vec3f &dir) const
     {
         return le;
     }
 
     // sample point on the light
-    SurfaceInfo samplePoint(Sampler &sampler, float &pdf) const override
+    SurfaceInfo samplePoint(Sampler &sampler, float &pdf) const
     {
         return triangle->samplePoint(sampler, pdf);
     }
 
     // sample direction from the light
     Vec3f sampleDirection(const SurfaceInfo &surfInfo, Sampler &sampler,
-                          float &pdf) const override
+                          float &pdf) const
+    {
+        return sampleDirection(surfInfo, sampler.getNext2D(), pdf);
+    }
+
+    // sample direction from the given primary sample in [0, 1]^2
+    Vec3f sampleDirection(const SurfaceInfo &surfInfo, const Vec2f &u,
+                          float &pdf) const
     {
-        const Vec3f dir = sampleCosineHemisphere(sampler.getNext2D(), pdf);
+        const Vec3f dir = sampleCosineHemisphere(u, pdf);
 
         // transform direction from local to world
         return localToWorld(dir, surfInfo.dpdu, surfInfo.shadingNormal,
                             surfInfo.dpdv);
     }
+
+    // luminance of total emitted power, used to choose lights
+    // NOTE: emission is uniform over the cosine weighted hemisphere
+    float getPower() const
+    {
+        return PI * luminance(le) * triangle->getSurfaceArea();
+    }
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,188 @@
+#ifndef _MAPPED_FILE_H
+#define _MAPPED_FILE_H
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <utility>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// read-only memory mapped file
+class MappedFile
+{
+private:
+    const std::byte *ptr = nullptr;
+    size_t length = 0;
+
+#ifdef _WIN32
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = nullptr;
+#endif
+
+#ifndef _WIN32
+    // page aligned bounds of the given range, rounded outward or inward
+    static void getPages(const void *data, size_t bytes, uintptr_t &begin,
+                         uintptr_t &end, bool outward)
+    {
+        static const uintptr_t page_size = sysconf(_SC_PAGESIZE);
+        const uintptr_t first = reinterpret_cast<uintptr_t>(data);
+        const uintptr_t last = first + bytes;
+        if (outward)
+        {
+            begin = first / page_size * page_size;
+            end = (last + page_size - 1) / page_size * page_size;
+        }
+        else
+        {
+            begin = (first + page_size - 1) / page_size * page_size;
+            end = last / page_size * page_size;
+        }
+    }
+#endif
+
+public:
+    MappedFile() {}
+    ~MappedFile() { close(); }
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    MappedFile(MappedFile &&other) noexcept { *this = std::move(other); }
+    MappedFile &operator=(MappedFile &&other) noexcept
+    {
+        if (this != &other)
+        {
+            close();
+            std::swap(ptr, other.ptr);
+            std::swap(length, other.length);
+#ifdef _WIN32
+            std::swap(file, other.file);
+            std::swap(mapping, other.mapping);
+#endif
+        }
+        return *this;
+    }
+
+    // map the whole file, return false on failure
+    // NOTE: empty files can't be mapped
+    bool open(const std::filesystem::path &filepath)
+    {
+        close();
+
+#ifdef _WIN32
+        file = CreateFileW(filepath.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+                           OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file == INVALID_HANDLE_VALUE)
+            return false;
+
+        LARGE_INTEGER file_size;
+        if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart == 0)
+        {
+            close();
+            return false;
+        }
+
+        mapping = CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (mapping == nullptr)
+        {
+            close();
+            return false;
+        }
+
+        ptr = static_cast<const std::byte *>(
+            MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+        if (ptr == nullptr)
+        {
+            close();
+            return false;
+        }
+        length = static_cast<size_t>(file_size.QuadPart);
+#else
+        const int fd = ::open(filepath.c_str(), O_RDONLY);
+        if (fd < 0)
+            return false;
+
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size == 0)
+        {
+            ::close(fd);
+            return false;
+        }
+
+        void *p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        // NOTE: mapping stays valid after closing the descriptor
+        ::close(fd);
+        if (p == MAP_FAILED)
+            return false;
+
+        ptr = static_cast<const std::byte *>(p);
+        length = st.st_size;
+#endif
+
+        return true;
+    }
+
+    void close()
+    {
+#ifdef _WIN32
+        if (ptr != nullptr)
+            UnmapViewOfFile(ptr);
+        if (mapping != nullptr)
+            CloseHandle(mapping);
+        if (file != INVALID_HANDLE_VALUE)
+            CloseHandle(file);
+        mapping = nullptr;
+        file = INVALID_HANDLE_VALUE;
+#else
+        if (ptr != nullptr)
+            munmap(const_cast<std::byte *>(ptr), length);
+#endif
+        ptr = nullptr;
+        length = 0;
+    }
+
+    bool isOpen() const { return ptr != nullptr; }
+    const std::byte *data() const { return ptr; }
+    size_t size() const { return length; }
+
+    // ask the OS to read the given range of a mapping ahead
+    static void prefetch(const void *data, size_t bytes)
+    {
+#ifndef _WIN32
+        uintptr_t begin, end;
+        getPages(data, bytes, begin, end, true);
+        if (begin < end)
+            madvise(reinterpret_cast<void *>(begin), end - begin, MADV_WILLNEED);
+#endif
+    }
+
+    // drop the pages of the given range of a mapping from memory, they are
+    // read from the file again on next access
+    // NOTE: only pages entirely inside the range are dropped. must be a read
+    // only file mapping, anonymous memory would be zeroed. both are no-ops on
+    // Windows
+    static void release(const void *data, size_t bytes)
+    {
+#ifndef _WIN32
+        uintptr_t begin, end;
+        getPages(data, bytes, begin, end, false);
+        if (begin < end)
+            madvise(reinterpret_cast<void *>(begin), end - begin, MADV_DONTNEED);
+#endif
+    }
+};
+
+#endif
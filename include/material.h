@@ -1,7 +1,6 @@
 #ifndef _MATERIAL_H
 #define _MATERIAL_H
-#include <memory>
-#include <vector>
+#include <cstdint>
 
 #include "geometry.h"
 #include "sampler.h"
@@ -20,8 +19,39 @@ enum class TransportDirection
 
 using DirectionPair = std::pair<Vec3f, Vec3f>;
 
+// all samplable directions of specular BxDF
+// NOTE: fixed size, so that branching at specular hits doesn't allocate. glass
+// has two directions at most(reflection, refraction)
+class DirectionPairs
+{
+public:
+    static constexpr int maxSize = 2;
+
+private:
+    DirectionPair pairs[maxSize];
+    int n = 0;
+
+public:
+    DirectionPairs() {}
+
+    int size() const { return n; }
+    bool empty() const { return n == 0; }
+
+    void push(const Vec3f &wi, const Vec3f &f) { pairs[n++] = DirectionPair(wi, f); }
+
+    DirectionPair &operator[](int i) { return pairs[i]; }
+    const DirectionPair &operator[](int i) const { return pairs[i]; }
+
+    DirectionPair *begin() { return pairs; }
+    DirectionPair *end() { return pairs + n; }
+    const DirectionPair *begin() const { return pairs; }
+    const DirectionPair *end() const { return pairs + n; }
+};
+
 // represent BRDF or BTDF
 // direction vectors are in tangent space(x: tangent, y: normal, z: bitangent)
+// NOTE: every BxDF implements evaluate, sampleDirection, sampleAllDirection.
+// they are called without virtual dispatch through Material
 class BxDF
 {
 private:
@@ -66,23 +96,6 @@ public:
 
     // get BxDF type
     BxDFType getType() const { return type; }
-
-    // evaluate BxDF
-    virtual Vec3f evaluate(const Vec3f &wo, const Vec3f &wi,
-                           const TransportDirection &transport_dir) const = 0;
-
-    // sample direction by BxDF.
-    // its pdf is propotional to the shape of BxDF
-    virtual Vec3f sampleDirection(const Vec3f &wo,
-                                  const TransportDirection &transport_dir,
-                                  Sampler &sampler, Vec3f &wi,
-                                  float &pdf) const = 0;
-
-    // get all samplable direction
-    // NOTE: for specular only
-    // NOTE: used for drawing fresnel reflection nicely at low number of samples
-    virtual std::vector<DirectionPair> sampleAllDirection(
-        const Vec3f &wo, const TransportDirection &transport_dir) const = 0;
 };
 
 class Lambert : public BxDF
@@ -94,7 +107,7 @@ public:
     Lambert(const Vec3f &rho) : BxDF(BxDFType::DIFFUSE), rho(rho) {}
 
     Vec3f evaluate(const Vec3f &wo, const Vec3f &wi,
-                   const TransportDirection &transport_dir) const override
+                   const TransportDirection &transport_dir) const
     {
         // when wo, wi is under the surface, return 0
         const float cosThetaO = cosTheta(wo);
@@ -108,7 +121,7 @@ public:
     Vec3f sampleDirection(const Vec3f &wo,
                           const TransportDirection &transport_dir,
                           Sampler &sampler, Vec3f &wi,
-                          float &pdf) const override
+                          float &pdf) const
     {
         // cosine weighted hemisphere sampling
         wi = sampleCosineHemisphere(sampler.getNext2D(), pdf);
@@ -116,11 +129,10 @@ public:
         return evaluate(wo, wi, transport_dir);
     }
 
-    std::vector<DirectionPair> sampleAllDirection(
-        const Vec3f &wo, const TransportDirection &transport_dir) const override
+    DirectionPairs sampleAllDirection(
+        const Vec3f &wo, const TransportDirection &transport_dir) const
     {
-        std::vector<DirectionPair> ret;
-        return ret;
+        return DirectionPairs();
     }
 };
 
@@ -134,7 +146,7 @@ public:
 
     // NOTE: delta function
     Vec3f evaluate(const Vec3f &wo, const Vec3f &wi,
-                   const TransportDirection &transport_dir) const override
+                   const TransportDirection &transport_dir) const
     {
         return Vec3f(0);
     }
@@ -142,7 +154,7 @@ public:
     Vec3f sampleDirection(const Vec3f &wo,
                           const TransportDirection &transport_dir,
                           Sampler &sampler, Vec3f &wi,
-                          float &pdf) const override
+                          float &pdf) const
     {
         wi = reflect(wo, Vec3f(0, 1, 0));
         pdf = 1.0f;
@@ -150,12 +162,12 @@ public:
         return rho / absCosTheta(wi);
     }
 
-    std::vector<DirectionPair> sampleAllDirection(
-        const Vec3f &wo, const TransportDirection &transport_dir) const override
+    DirectionPairs sampleAllDirection(
+        const Vec3f &wo, const TransportDirection &transport_dir) const
     {
-        std::vector<DirectionPair> ret;
+        DirectionPairs ret;
         const Vec3f wi = reflect(wo, Vec3f(0, 1, 0));
-        ret.emplace_back(wi, rho / absCosTheta(wi));
+        ret.push(wi, rho / absCosTheta(wi));
         return ret;
     }
 };
@@ -175,7 +187,7 @@ public:
 
     // NOTE: delta function
     Vec3f evaluate(const Vec3f &wo, const Vec3f &wi,
-                   const TransportDirection &transport_dir) const override
+                   const TransportDirection &transport_dir) const
     {
         return Vec3f(0);
     }
@@ -183,7 +195,7 @@ public:
     Vec3f sampleDirection(const Vec3f &wo,
                           const TransportDirection &transport_dir,
                           Sampler &sampler, Vec3f &wi,
-                          float &pdf) const override
+                          float &pdf) const
     {
         // set appropriate ior, normal
         float iorO, iorI;
@@ -238,10 +250,10 @@ public:
         }
     }
 
-    std::vector<DirectionPair> sampleAllDirection(
-        const Vec3f &wo, const TransportDirection &transport_dir) const override
+    DirectionPairs sampleAllDirection(
+        const Vec3f &wo, const TransportDirection &transport_dir) const
     {
-        std::vector<DirectionPair> ret;
+        DirectionPairs ret;
 
         // set appropriate ior, normal
         float iorO, iorI;
@@ -264,7 +276,7 @@ public:
 
         // reflection
         const Vec3f wr = reflect(wo, n);
-        ret.emplace_back(wr, fr * rho / absCosTheta(wr));
+        ret.push(wr, fr * rho / absCosTheta(wr));
 
         // refraction
         Vec3f tr;
@@ -276,7 +288,7 @@ public:
                 scalling = (iorO * iorO) / (iorI * iorI);
             }
 
-            ret.emplace_back(tr, (1.0f - fr) * scalling * rho / absCosTheta(tr));
+            ret.push(tr, (1.0f - fr) * scalling * rho / absCosTheta(tr));
         }
         else
         {
@@ -287,4 +299,87 @@ public:
     }
 };
 
+// kind of BxDF held by Material
+enum class MaterialType : uint8_t
+{
+    LAMBERT,
+    MIRROR,
+    GLASS
+};
+
+// entry of the flat material table
+// NOTE: tagged union of BxDFs, dispatched by a switch on the type instead of
+// virtual calls
+class Material
+{
+private:
+    MaterialType type;
+    union
+    {
+        Lambert lambert;
+        Mirror mirror;
+        Glass glass;
+    };
+
+public:
+    Material(const Lambert &lambert) : type(MaterialType::LAMBERT), lambert(lambert) {}
+    Material(const Mirror &mirror) : type(MaterialType::MIRROR), mirror(mirror) {}
+    Material(const Glass &glass) : type(MaterialType::GLASS), glass(glass) {}
+
+    MaterialType getMaterialType() const { return type; }
+
+    BxDFType getType() const
+    {
+        return type == MaterialType::LAMBERT ? BxDFType::DIFFUSE : BxDFType::SPECULAR;
+    }
+
+    // evaluate BxDF
+    Vec3f evaluate(const Vec3f &wo, const Vec3f &wi,
+                   const TransportDirection &transport_dir) const
+    {
+        switch (type)
+        {
+        case MaterialType::LAMBERT:
+            return lambert.evaluate(wo, wi, transport_dir);
+        case MaterialType::MIRROR:
+            return mirror.evaluate(wo, wi, transport_dir);
+        default:
+            return glass.evaluate(wo, wi, transport_dir);
+        }
+    }
+
+    // sample direction by BxDF.
+    // its pdf is propotional to the shape of BxDF
+    Vec3f sampleDirection(const Vec3f &wo, const TransportDirection &transport_dir,
+                          Sampler &sampler, Vec3f &wi, float &pdf) const
+    {
+        switch (type)
+        {
+        case MaterialType::LAMBERT:
+            return lambert.sampleDirection(wo, transport_dir, sampler, wi, pdf);
+        case MaterialType::MIRROR:
+            return mirror.sampleDirection(wo, transport_dir, sampler, wi, pdf);
+        default:
+            return glass.sampleDirection(wo, transport_dir, sampler, wi, pdf);
+        }
+    }
+
+    // get all samplable direction
+    // NOTE: for specular only
+    // NOTE: used for drawing fresnel reflection nicely at low number of samples
+    DirectionPairs sampleAllDirection(const Vec3f &wo,
+                                      const TransportDirection &transport_dir) const
+    {
+        switch (type)
+        {
+        case MaterialType::LAMBERT:
+            return lambert.sampleAllDirection(wo, transport_dir);
+        case MaterialType::MIRROR:
+            return mirror.sampleAllDirection(wo, transport_dir);
+        default:
+            return glass.sampleAllDirection(wo, transport_dir);
+        }
+    }
+};
+
 #endif
\ No newline at end of file
@@ -0,0 +1,17 @@
+#ifndef _OPTIONS_H
+#define _OPTIONS_H
+#include <string>
+
+// parse optional argument of the form --name=value
+// returns true and sets value when arg has the given name
+inline bool parseOption(const std::string &arg, const std::string &name,
+                        std::string &value)
+{
+    const std::string prefix = "--" + name + "=";
+    if (arg.compare(0, prefix.size(), prefix) != 0)
+        return false;
+    value = arg.substr(prefix.size());
+    return true;
+}
+
+#endif
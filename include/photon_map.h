@@ -1,11 +1,33 @@
 #ifndef _PHOTON_MAP_H
 #define _PHOTON_MAP_H
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
 #include <concepts>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <limits>
+#include <memory>
+#include <mutex>
 #include <numeric>
-#include <queue>
+#include <random>
+#include <string>
+#include <type_traits>
 #include <vector>
 
+#if defined(__AVX512F__) || defined(__AVX2__) || defined(__SSE2__) || \
+    defined(_M_X64)
+#include <immintrin.h>
+#endif
+
 #include "geometry.h"
+#include "mapped_file.h"
+#include "stats.h"
 
 struct Photon
 {
@@ -22,6 +44,95 @@ struct Photon
         : throughput(throughput), position(position), wi(wi) {}
 };
 
+// compact photon record(20 bytes)
+// NOTE: position is kept at full precision for kd-tree. throughput is stored as
+// RGBE(shared exponent), incident direction as 16 bit octahedral coordinates
+// Ward, Greg. Real pixels. Graphics Gems II, 1991.
+// Cigolle, Zina H., et al. A survey of efficient representations for
+// independent unit vectors. JCGT, 2014.
+struct CompactPhoton
+{
+    Vec3f position;
+    uint8_t rgbe[4];   // throughput
+    uint16_t octWi[2]; // incident direction
+
+    // implementation of Point concept
+    static constexpr int dim = 3;
+    float operator[](int i) const { return position[i]; }
+
+    CompactPhoton() : rgbe{0, 0, 0, 0}, octWi{0, 0} {}
+    CompactPhoton(const Photon &photon) : position(photon.position)
+    {
+        encodeRGBE(photon.throughput);
+        encodeOctahedral(photon.wi);
+    }
+
+    Vec3f getThroughput() const
+    {
+        if (rgbe[3] == 0)
+            return Vec3f(0);
+        const float f = std::ldexp(1.0f, static_cast<int>(rgbe[3]) - (128 + 8));
+        return Vec3f((rgbe[0] + 0.5f) * f, (rgbe[1] + 0.5f) * f,
+                     (rgbe[2] + 0.5f) * f);
+    }
+
+    Vec3f getWi() const
+    {
+        const float u = octWi[0] / 65535.0f * 2.0f - 1.0f;
+        const float v = octWi[1] / 65535.0f * 2.0f - 1.0f;
+        Vec3f n(u, v, 1.0f - std::abs(u) - std::abs(v));
+        if (n[2] < 0)
+        {
+            n[0] = (1.0f - std::abs(v)) * (u >= 0 ? 1.0f : -1.0f);
+            n[1] = (1.0f - std::abs(u)) * (v >= 0 ? 1.0f : -1.0f);
+        }
+        return normalize(n);
+    }
+
+    // decode to full photon record
+    Photon toPhoton() const { return Photon(getThroughput(), position, getWi()); }
+
+private:
+    void encodeRGBE(const Vec3f &c)
+    {
+        const float v = std::max(c[0], std::max(c[1], c[2]));
+        if (v < 1e-32f)
+        {
+            rgbe[0] = rgbe[1] = rgbe[2] = rgbe[3] = 0;
+            return;
+        }
+        int e;
+        const float scale = std::frexp(v, &e) * 256.0f / v;
+        for (int i = 0; i < 3; ++i)
+        {
+            rgbe[i] = static_cast<uint8_t>(
+                std::min(std::max(c[i], 0.0f) * scale, 255.0f));
+        }
+        rgbe[3] = static_cast<uint8_t>(std::clamp(e + 128, 0, 255));
+    }
+
+    void encodeOctahedral(const Vec3f &d)
+    {
+        const float l1 = std::abs(d[0]) + std::abs(d[1]) + std::abs(d[2]);
+        float u = d[0] / l1;
+        float v = d[1] / l1;
+        if (d[2] < 0)
+        {
+            const float pu = (1.0f - std::abs(v)) * (u >= 0 ? 1.0f : -1.0f);
+            const float pv = (1.0f - std::abs(u)) * (v >= 0 ? 1.0f : -1.0f);
+            u = pu;
+            v = pv;
+        }
+        const auto quantize = [](float x)
+        {
+            return static_cast<uint16_t>(
+                std::round(std::clamp(0.5f * x + 0.5f, 0.0f, 1.0f) * 65535.0f));
+        };
+        octWi[0] = quantize(u);
+        octWi[1] = quantize(v);
+    }
+};
+
 // Point concept
 template <typename T>
 concept Point = requires(T &x, int i) {
@@ -47,12 +158,90 @@ inline float distance2(const PointT &p1, const PointU &p2)
     return dist2;
 }
 
+// invoke visitor of range search on the given point
+// NOTE: visitor may return bool, false stops the search
+template <typename Visitor>
+inline bool visitPoint(Visitor &visitor, int idx, float dist2)
+{
+    if constexpr (std::is_same_v<std::invoke_result_t<Visitor &, int, float>, bool>)
+    {
+        return visitor(idx, dist2);
+    }
+    else
+    {
+        visitor(idx, dist2);
+        return true;
+    }
+}
+
+// bounded max-heap of (squared distance, index) pairs
+// NOTE: caller-owned storage for k-nearest neighbor search. its capacity is
+// allocated once and reused across queries, so searching doesn't allocate
+class KNNHeap
+{
+public:
+    using Entry = std::pair<float, int>;
+
+private:
+    std::vector<Entry> entries;
+    int k;
+
+public:
+    KNNHeap() : k(0) {}
+    KNNHeap(int k) { reset(k); }
+
+    // remove all entries and set the number of entries to keep
+    void reset(int k)
+    {
+        this->k = k;
+        entries.clear();
+        entries.reserve(k);
+    }
+
+    int size() const { return entries.size(); }
+    int capacity() const { return k; }
+    bool empty() const { return entries.empty(); }
+    bool full() const { return entries.size() >= k; }
+
+    // largest squared distance in the heap
+    // NOTE: heap must not be empty
+    float maxDist2() const { return entries.front().first; }
+
+    // insert entry, drop the farthest one when more than k entries are held
+    void push(float dist2, int idx)
+    {
+        if (entries.size() < k)
+        {
+            entries.emplace_back(dist2, idx);
+            std::push_heap(entries.begin(), entries.end());
+        }
+        else if (k > 0 && dist2 < entries.front().first)
+        {
+            std::pop_heap(entries.begin(), entries.end());
+            entries.back() = Entry(dist2, idx);
+            std::push_heap(entries.begin(), entries.end());
+        }
+    }
+
+    const Entry &operator[](int i) const { return entries[i]; }
+    std::vector<Entry>::const_iterator begin() const { return entries.begin(); }
+    std::vector<Entry>::const_iterator end() const { return entries.end(); }
+};
+
+// construction method of kd-tree
+enum class KdTreeBuildMethod
+{
+    SORT,           // sort points at every level, cycle separation axis by depth
+    PARALLEL_MEDIAN // select median, split along the largest extent, build
+                    // large subtrees as parallel tasks
+};
+
 // implementation of kd-tree
 template <typename PointT>
     requires Point<PointT>
 class KdTree
 {
-private:
+public:
     struct Node
     {
         int axis;          // separation axis(x=0, y=1, z=2)
@@ -63,9 +252,18 @@ private:
         Node() : axis(-1), idx(-1), leftChildIdx(-1), rightChildIdx(-1) {}
     };
 
+private:
     std::vector<Node> nodes; // array of tree nodes
     const PointT *points;    // pointer to array of points
     int nPoints;             // number of points
+    double buildTime = 0;    // wall time of last build in seconds
+
+    // nodes of a prebuilt tree, used instead of nodes when set
+    const Node *sharedNodes = nullptr;
+    int nSharedNodes = 0;
+
+    // minimum number of points to build subtree as a separate task
+    static constexpr int parallelBuildCutoff = 1 << 14;
 
     void buildNode(int *indices, int n_points, int depth)
     {
@@ -120,60 +318,145 @@ private:
         }
     }
 
-    using KNNQueue = std::priority_queue<std::pair<float, int>>;
-    template <typename PointU>
-        requires Point<PointU>
-    void searchKNearestNode(int nodeIdx, const PointU &queryPoint, int k,
-                            KNNQueue &queue) const
+    // build subtree of n_points points into nodes[nodeIdx]...
+    // NOTE: nodes are laid out in the same preorder as buildNode, so the size of
+    // each subtree is known in advance and subtrees can be built independently
+    void buildNodeMedian(int *indices, int n_points, int nodeIdx)
     {
-        if (nodeIdx == -1 || nodeIdx >= nodes.size())
+        if (n_points <= 0)
             return;
 
-        const Node &node = nodes[nodeIdx];
-
-        // median point
-        const PointT &median = points[node.idx];
-
-        // push to queue
-        const float dist2 = distance2(queryPoint, median);
-        queue.emplace(dist2, node.idx);
-
-        // if size of queue is larger than k, pop queue
-        if (queue.size() > k)
+        // choose separation axis with the largest extent of points
+        float bmin[PointT::dim];
+        float bmax[PointT::dim];
+        for (int d = 0; d < PointT::dim; ++d)
+        {
+            bmin[d] = std::numeric_limits<float>::max();
+            bmax[d] = std::numeric_limits<float>::lowest();
+        }
+        for (int i = 0; i < n_points; ++i)
         {
-            queue.pop();
+            const PointT &p = points[indices[i]];
+            for (int d = 0; d < PointT::dim; ++d)
+            {
+                bmin[d] = std::min(bmin[d], p[d]);
+                bmax[d] = std::max(bmax[d], p[d]);
+            }
+        }
+        int axis = 0;
+        for (int d = 1; d < PointT::dim; ++d)
+        {
+            if (bmax[d] - bmin[d] > bmax[axis] - bmin[axis])
+            {
+                axis = d;
+            }
         }
 
-        // if query point is lower than median, search left child
-        // else, search right child
-        const bool isLower = queryPoint[node.axis] < median[node.axis];
-        if (isLower)
+        // partition indices around the median in the separation axis
+        const int mid = (n_points - 1) / 2;
+        std::nth_element(indices, indices + mid, indices + n_points,
+                         [&](const int idx1, const int idx2)
+                         { return points[idx1][axis] < points[idx2][axis]; });
+
+        // left subtree follows parent node, right subtree follows left subtree
+        const int n_left = mid;
+        const int n_right = n_points - mid - 1;
+        Node &node = nodes[nodeIdx];
+        node.axis = axis;
+        node.idx = indices[mid];
+        node.leftChildIdx = n_left > 0 ? nodeIdx + 1 : -1;
+        node.rightChildIdx = n_right > 0 ? nodeIdx + 1 + n_left : -1;
+
+        if (n_points >= parallelBuildCutoff)
         {
-            searchKNearestNode(node.leftChildIdx, queryPoint, k, queue);
+#pragma omp task
+            buildNodeMedian(indices, n_left, nodeIdx + 1);
+            buildNodeMedian(indices + mid + 1, n_right, nodeIdx + 1 + n_left);
+#pragma omp taskwait
         }
         else
         {
-            searchKNearestNode(node.rightChildIdx, queryPoint, k, queue);
+            buildNodeMedian(indices, n_left, nodeIdx + 1);
+            buildNodeMedian(indices + mid + 1, n_right, nodeIdx + 1 + n_left);
         }
+    }
+
+    // maximum depth of traversal stack
+    // NOTE: tree is balanced, so its depth is bounded by log2 of nPoints
+    static constexpr int maxStackDepth = 64;
+
+    // iterative k-nearest neighbor search
+    // descend into the near child first and keep far children on a small stack
+    // together with their squared distance to the splitting plane. the search
+    // radius shrinks as the heap fills, and every point or subtree outside of it
+    // is rejected before touching the heap
+    template <typename PointU>
+        requires Point<PointU>
+    void searchKNearestNode(int nodeIdx, const PointU &queryPoint,
+                            KNNHeap &queue, float maxDist2) const
+    {
+        const Node *node_data = getNodes();
+        if (nodeIdx < 0 || nodeIdx >= getNNodes() || queue.capacity() <= 0)
+            return;
 
-        // at leaf node, if size of queue is smaller than k, or queue's largest
-        // minimum distance overlaps sibblings region, then search siblings
-        const float dist_to_siblings = median[node.axis] - queryPoint[node.axis];
-        if (queue.top().first > dist_to_siblings * dist_to_siblings)
+        struct StackEntry
         {
-            if (isLower)
-            {
-                searchKNearestNode(node.rightChildIdx, queryPoint, k, queue);
-            }
-            else
+            int nodeIdx;
+            float planeDist2; // squared distance to the splitting plane
+        };
+        StackEntry stack[maxStackDepth];
+        int stackSize = 0;
+        stack[stackSize++] = {nodeIdx, 0.0f};
+
+        // current squared search radius
+        float radius2 = maxDist2;
+
+        while (stackSize > 0)
+        {
+            const StackEntry entry = stack[--stackSize];
+
+            // skip subtree if its region is outside of the search radius
+            if (entry.planeDist2 >= radius2)
+                continue;
+
+            int idx = entry.nodeIdx;
+            while (idx != -1)
             {
-                searchKNearestNode(node.leftChildIdx, queryPoint, k, queue);
+                const Node &node = node_data[idx];
+                const PointT &median = points[node.idx];
+
+                // push median only when it is inside of the search radius
+                const float dist2 = distance2(queryPoint, median);
+                if (dist2 < radius2)
+                {
+                    queue.push(dist2, node.idx);
+                    if (queue.full())
+                    {
+                        radius2 = queue.maxDist2();
+                    }
+                }
+
+                // if query point is lower than median, search left child first
+                // else, search right child first
+                const float diff = queryPoint[node.axis] - median[node.axis];
+                const bool isLower = diff < 0;
+                const int nearChildIdx = isLower ? node.leftChildIdx : node.rightChildIdx;
+                const int farChildIdx = isLower ? node.rightChildIdx : node.leftChildIdx;
+
+                // remember siblings only if their region overlaps the search radius
+                const float planeDist2 = diff * diff;
+                if (farChildIdx != -1 && planeDist2 < radius2)
+                {
+                    stack[stackSize++] = {farChildIdx, planeDist2};
+                }
+
+                idx = nearChildIdx;
             }
         }
     }
 
 public:
-    KdTree() {}
+    KdTree() : points(nullptr), nPoints(0) {}
 
     void setPoints(const PointT *points, int nPoints)
     {
@@ -181,14 +464,57 @@ public:
         this->nPoints = nPoints;
     }
 
-    void buildTree()
+    void buildTree(const KdTreeBuildMethod &method =
+                       KdTreeBuildMethod::PARALLEL_MEDIAN)
     {
+        const auto start = std::chrono::steady_clock::now();
+
         // setup indices of points
         std::vector<int> indices(nPoints);
         std::iota(indices.begin(), indices.end(), 0);
 
         // build tree recursively
-        buildNode(indices.data(), nPoints, 0);
+        nodes.clear();
+        sharedNodes = nullptr;
+        nSharedNodes = 0;
+        if (method == KdTreeBuildMethod::SORT)
+        {
+            buildNode(indices.data(), nPoints, 0);
+        }
+        else
+        {
+            nodes.resize(nPoints);
+#pragma omp parallel
+#pragma omp single
+            buildNodeMedian(indices.data(), nPoints, 0);
+        }
+
+        buildTime = std::chrono::duration<double>(
+                        std::chrono::steady_clock::now() - start)
+                        .count();
+    }
+
+    // wall time of last build in seconds
+    double getBuildTime() const { return buildTime; }
+
+    // node array of the tree, for serialization
+    const Node *getNodes() const
+    {
+        return sharedNodes != nullptr ? sharedNodes : nodes.data();
+    }
+    int getNNodes() const
+    {
+        return sharedNodes != nullptr ? nSharedNodes : nodes.size();
+    }
+
+    // use prebuilt tree over the given points instead of building it
+    // NOTE: arrays are referenced, not copied, so they must outlive the tree
+    void setTree(const PointT *points, int nPoints, const Node *nodes, int nNodes)
+    {
+        setPoints(points, nPoints);
+        this->nodes.clear();
+        sharedNodes = nodes;
+        nSharedNodes = nNodes;
     }
 
     template <typename PointU>
@@ -197,52 +523,2796 @@ public:
         const PointU &queryPoint, int k, float &maxDist2)
         const
     {
-        KNNQueue queue;
-        searchKNearestNode(0, queryPoint, k, queue);
+        KNNHeap queue(k);
+        searchKNearest(queryPoint, k, queue);
 
         std::vector<int> ret(queue.size());
         maxDist2 = 0;
         for (int i = 0; i < ret.size(); ++i)
         {
-            const auto &p = queue.top();
-            ret[i] = p.second;
-            maxDist2 = std::max(maxDist2, p.first);
-            queue.pop();
+            ret[i] = queue[i].second;
+            maxDist2 = std::max(maxDist2, queue[i].first);
         }
 
         return ret;
     }
+
+    // search k-nearest points, write (squared distance, index) pairs into the
+    // given heap
+    // NOTE: doesn't allocate once the heap has grown to k entries
+    // NOTE: only points closer than sqrt(maxDist2) are returned
+    template <typename PointU>
+        requires Point<PointU>
+    void searchKNearest(const PointU &queryPoint, int k, KNNHeap &heap,
+                        float maxDist2 = std::numeric_limits<float>::infinity())
+        const
+    {
+        heap.reset(k);
+        searchKNearestNode(0, queryPoint, heap, maxDist2);
+    }
+
+    // visit every point closer than sqrt(maxDist2) with visitor(index, dist2)
+    // NOTE: search radius is fixed, so no heap is needed and points are visited
+    // in traversal order
+    template <typename PointU, typename Visitor>
+        requires Point<PointU> && std::invocable<Visitor &, int, float>
+    void searchRadius(const PointU &queryPoint, float maxDist2,
+                      Visitor &&visitor) const
+    {
+        if (getNNodes() == 0)
+            return;
+
+        const Node *node_data = getNodes();
+        int stack[maxStackDepth];
+        int stackSize = 0;
+        stack[stackSize++] = 0;
+
+        while (stackSize > 0)
+        {
+            int idx = stack[--stackSize];
+            while (idx != -1)
+            {
+                const Node &node = node_data[idx];
+                const PointT &median = points[node.idx];
+
+                const float dist2 = distance2(queryPoint, median);
+                if (dist2 < maxDist2 && !visitPoint(visitor, node.idx, dist2))
+                {
+                    return;
+                }
+
+                const float diff = queryPoint[node.axis] - median[node.axis];
+                const bool isLower = diff < 0;
+                const int nearChildIdx = isLower ? node.leftChildIdx : node.rightChildIdx;
+                const int farChildIdx = isLower ? node.rightChildIdx : node.leftChildIdx;
+
+                if (farChildIdx != -1 && diff * diff < maxDist2)
+                {
+                    stack[stackSize++] = farChildIdx;
+                }
+
+                idx = nearChildIdx;
+            }
+        }
+    }
 };
 
-class PhotonMap
+// implementation of implicit left-balanced kd-tree
+// NOTE: points are reordered in place into the order of a complete binary tree,
+// so children of node i are 2i+1 and 2i+2 and no node array is needed. only the
+// separation axis of each node is kept, packed by 2 bits per node
+// Jensen, Henrik Wann. Realistic image synthesis using photon mapping, 2001.
+template <typename PointT>
+    requires Point<PointT>
+class LeftBalancedKdTree
 {
 private:
-    std::vector<Photon> photons;
-    KdTree<Photon> kdtree;
+    static_assert(PointT::dim <= 4, "separation axis is packed into 2 bits");
+
+    const PointT *points;      // pointer to array of points, in tree order
+    PointT *writablePoints;    // points reordered by buildTree
+    int nPoints;               // number of points
+    std::vector<uint8_t> axes; // separation axes, 4 nodes per byte
+    double buildTime = 0;      // wall time of last build in seconds
+
+    // separation axes of a prebuilt tree, used instead of axes when set
+    const uint8_t *sharedAxes = nullptr;
+
+    // minimum number of points to build subtree as a separate task
+    static constexpr int parallelBuildCutoff = 1 << 14;
+
+    // maximum depth of traversal stack
+    static constexpr int maxStackDepth = 64;
+
+    static int getAxis(const uint8_t *axisBits, int nodeIdx)
+    {
+        return (axisBits[nodeIdx >> 2] >> ((nodeIdx & 3) << 1)) & 3;
+    }
+
+    // NOTE: nodes sharing a byte may be written by different tasks
+    void setAxis(int nodeIdx, int axis)
+    {
+        std::atomic_ref<uint8_t>(axes[nodeIdx >> 2])
+            .fetch_or(static_cast<uint8_t>(axis << ((nodeIdx & 3) << 1)));
+    }
+
+    // number of nodes in the left subtree of a complete binary tree with n nodes
+    static int leftSubtreeSize(int n)
+    {
+        if (n <= 1)
+            return 0;
+
+        // nodes above the last level form a perfect tree of height h
+        const int h = std::bit_width(static_cast<unsigned int>(n)) - 1;
+        const int half = 1 << (h - 1);
+        const int n_last = n - ((1 << h) - 1);
+        return (half - 1) + std::min(n_last, half);
+    }
+
+    // build subtree rooted at nodeIdx, write original index of each node to order
+    void buildNode(int *indices, int n_points, int nodeIdx, int *order)
+    {
+        if (n_points <= 0)
+            return;
+
+        // choose separation axis with the largest extent of points
+        float bmin[PointT::dim];
+        float bmax[PointT::dim];
+        for (int d = 0; d < PointT::dim; ++d)
+        {
+            bmin[d] = std::numeric_limits<float>::max();
+            bmax[d] = std::numeric_limits<float>::lowest();
+        }
+        for (int i = 0; i < n_points; ++i)
+        {
+            const PointT &p = points[indices[i]];
+            for (int d = 0; d < PointT::dim; ++d)
+            {
+                bmin[d] = std::min(bmin[d], p[d]);
+                bmax[d] = std::max(bmax[d], p[d]);
+            }
+        }
+        int axis = 0;
+        for (int d = 1; d < PointT::dim; ++d)
+        {
+            if (bmax[d] - bmin[d] > bmax[axis] - bmin[axis])
+            {
+                axis = d;
+            }
+        }
+
+        // split so that the left subtree keeps the shape of a complete tree
+        const int n_left = leftSubtreeSize(n_points);
+        const int n_right = n_points - n_left - 1;
+        std::nth_element(indices, indices + n_left, indices + n_points,
+                         [&](const int idx1, const int idx2)
+                         { return points[idx1][axis] < points[idx2][axis]; });
+
+        order[nodeIdx] = indices[n_left];
+        setAxis(nodeIdx, axis);
+
+        if (n_points >= parallelBuildCutoff)
+        {
+#pragma omp task
+            buildNode(indices, n_left, 2 * nodeIdx + 1, order);
+            buildNode(indices + n_left + 1, n_right, 2 * nodeIdx + 2, order);
+#pragma omp taskwait
+        }
+        else
+        {
+            buildNode(indices, n_left, 2 * nodeIdx + 1, order);
+            buildNode(indices + n_left + 1, n_right, 2 * nodeIdx + 2, order);
+        }
+    }
 
 public:
-    PhotonMap() {}
+    LeftBalancedKdTree() : points(nullptr), writablePoints(nullptr), nPoints(0) {}
+
+    // NOTE: points are reordered by buildTree
+    void setPoints(PointT *points, int nPoints)
+    {
+        this->points = points;
+        this->writablePoints = points;
+        this->nPoints = nPoints;
+    }
 
-    const int getNPhotons() const { return photons.size(); }
-    const Photon &getIthPhoton(int i) const { return photons[i]; }
+    // separation axes of the tree, for serialization
+    const uint8_t *getAxes() const
+    {
+        return sharedAxes != nullptr ? sharedAxes : axes.data();
+    }
+    int getNAxisBytes() const { return (nPoints + 3) / 4; }
 
-    void addPhoton(const Photon &photon) { photons.push_back(photon); }
-    void setPhotons(const std::vector<Photon> &photons)
+    // use prebuilt tree over the given points in tree order instead of
+    // building it
+    // NOTE: arrays are referenced, not copied, so they must outlive the tree
+    void setTree(const PointT *points, int nPoints, const uint8_t *axes)
     {
-        this->photons = photons;
+        this->points = points;
+        this->writablePoints = nullptr;
+        this->nPoints = nPoints;
+        this->axes.clear();
+        sharedAxes = axes;
     }
 
-    void build()
+    void buildTree()
     {
-        std::cout << "Photons:" << photons.size() << std::endl;
-        kdtree.setPoints(photons.data(), photons.size());
-        kdtree.buildTree();
+        const auto start = std::chrono::steady_clock::now();
+
+        // compute tree order of points
+        std::vector<int> order(nPoints);
+        {
+            std::vector<int> indices(nPoints);
+            std::iota(indices.begin(), indices.end(), 0);
+
+            sharedAxes = nullptr;
+            axes.assign(getNAxisBytes(), 0);
+#pragma omp parallel
+#pragma omp single
+            buildNode(indices.data(), nPoints, 0, order.data());
+        }
+
+        // permute points into tree order in place by following cycles
+        // NOTE: order[i] == i marks already placed points
+        for (int i = 0; i < nPoints; ++i)
+        {
+            if (order[i] == i)
+                continue;
+
+            const PointT tmp = writablePoints[i];
+            int cur = i;
+            while (true)
+            {
+                const int src = order[cur];
+                order[cur] = cur;
+                if (src == i)
+                {
+                    writablePoints[cur] = tmp;
+                    break;
+                }
+                writablePoints[cur] = writablePoints[src];
+                cur = src;
+            }
+        }
+
+        buildTime = std::chrono::duration<double>(
+                        std::chrono::steady_clock::now() - start)
+                        .count();
     }
 
-    std::vector<int> queryKNearestPhotons(const Vec3f &p, int k,
-                                          float &max_dist2) const
+    // wall time of last build in seconds
+    double getBuildTime() const { return buildTime; }
+
+    // search k-nearest points, write (squared distance, index) pairs into the
+    // given heap
+    // NOTE: index refers to point array in tree order
+    template <typename PointU>
+        requires Point<PointU>
+    void searchKNearest(const PointU &queryPoint, int k, KNNHeap &heap,
+                        float maxDist2 = std::numeric_limits<float>::infinity())
+        const
+    {
+        heap.reset(k);
+        addKNearest(queryPoint, heap, 0, maxDist2);
+    }
+
+    // add nearest points to the heap without resetting it, their indices
+    // offset by indexOffset
+    // NOTE: several trees are searched with one heap this way, e.g. chunks of
+    // an out-of-core photon map
+    template <typename PointU>
+        requires Point<PointU>
+    void addKNearest(const PointU &queryPoint, KNNHeap &heap, int indexOffset,
+                     float maxDist2 = std::numeric_limits<float>::infinity())
+        const
+    {
+        if (nPoints <= 0 || heap.capacity() <= 0)
+            return;
+
+        const uint8_t *axis_bits = getAxes();
+        struct StackEntry
+        {
+            int nodeIdx;
+            float planeDist2; // squared distance to the splitting plane
+        };
+        StackEntry stack[maxStackDepth];
+        int stackSize = 0;
+        stack[stackSize++] = {0, 0.0f};
+
+        // current squared search radius
+        float radius2 = heap.full() ? std::min(maxDist2, heap.maxDist2()) : maxDist2;
+
+        while (stackSize > 0)
+        {
+            const StackEntry entry = stack[--stackSize];
+            if (entry.planeDist2 >= radius2)
+                continue;
+
+            int idx = entry.nodeIdx;
+            while (idx < nPoints)
+            {
+                const PointT &median = points[idx];
+
+                const float dist2 = distance2(queryPoint, median);
+                if (dist2 < radius2)
+                {
+                    heap.push(dist2, indexOffset + idx);
+                    if (heap.full())
+                    {
+                        radius2 = heap.maxDist2();
+                    }
+                }
+
+                const int axis = getAxis(axis_bits, idx);
+                const float diff = queryPoint[axis] - median[axis];
+                const int nearChildIdx = diff < 0 ? 2 * idx + 1 : 2 * idx + 2;
+                const int farChildIdx = diff < 0 ? 2 * idx + 2 : 2 * idx + 1;
+
+                const float planeDist2 = diff * diff;
+                if (farChildIdx < nPoints && planeDist2 < radius2)
+                {
+                    stack[stackSize++] = {farChildIdx, planeDist2};
+                }
+
+                idx = nearChildIdx;
+            }
+        }
+    }
+
+    // visit every point closer than sqrt(maxDist2) with visitor(index, dist2)
+    template <typename PointU, typename Visitor>
+        requires Point<PointU> && std::invocable<Visitor &, int, float>
+    void searchRadius(const PointU &queryPoint, float maxDist2,
+                      Visitor &&visitor) const
     {
-        return kdtree.searchKNearest(p, k, max_dist2);
+        if (nPoints <= 0)
+            return;
+
+        const uint8_t *axis_bits = getAxes();
+        int stack[maxStackDepth];
+        int stackSize = 0;
+        stack[stackSize++] = 0;
+
+        while (stackSize > 0)
+        {
+            int idx = stack[--stackSize];
+            while (idx < nPoints)
+            {
+                const PointT &median = points[idx];
+
+                const float dist2 = distance2(queryPoint, median);
+                if (dist2 < maxDist2 && !visitPoint(visitor, idx, dist2))
+                {
+                    return;
+                }
+
+                const int axis = getAxis(axis_bits, idx);
+                const float diff = queryPoint[axis] - median[axis];
+                const int nearChildIdx = diff < 0 ? 2 * idx + 1 : 2 * idx + 2;
+                const int farChildIdx = diff < 0 ? 2 * idx + 2 : 2 * idx + 1;
+
+                if (farChildIdx < nPoints && diff * diff < maxDist2)
+                {
+                    stack[stackSize++] = farChildIdx;
+                }
+
+                idx = nearChildIdx;
+            }
+        }
+    }
+};
+
+// implementation of out-of-core kd-tree
+// NOTE: points are split by a top-level kd-tree into chunks of at most
+// chunkSize points, and each chunk is reordered into a left-balanced kd-tree
+// in place, so a chunk is a contiguous range of the point array. when the
+// points are in a file mapping, chunks are paged in when a search first
+// touches them and the least recently used ones are released once more than
+// maxResidentBytes are resident
+template <typename PointT>
+    requires Point<PointT>
+class ChunkedKdTree
+{
+public:
+    // node of top-level kd-tree
+    // NOTE: children of an inner node are child and child + 1
+    struct Node
+    {
+        float bmin[PointT::dim]; // bounds of points below the node
+        float bmax[PointT::dim];
+        int child;      // index of left child, -1 for leaf
+        int begin;      // first point of chunk
+        int count;      // number of points of chunk
+        int axesOffset; // first byte of separation axes of chunk
+    };
+
+private:
+    const PointT *points;   // pointer to array of points, in tree order
+    PointT *writablePoints; // points reordered by buildTree
+    int nPoints;            // number of points
+    std::vector<Node> nodes;
+    std::vector<uint8_t> axes; // separation axes of all chunks
+    double buildTime = 0;      // wall time of last build in seconds
+
+    // nodes and axes of a prebuilt tree, used instead of nodes and axes when set
+    const Node *sharedNodes = nullptr;
+    int nSharedNodes = 0;
+    const uint8_t *sharedAxes = nullptr;
+
+    // left-balanced kd-tree of each leaf, indexed by node
+    std::vector<LeftBalancedKdTree<PointT>> chunkTrees;
+
+    int chunkSize = 1 << 16;
+    size_t maxResidentBytes = 0; // 0 keeps every chunk in memory
+
+    // resident chunks of a tree in a file mapping
+    // NOTE: a released chunk is still searchable, its pages are read from the
+    // file again. so racing threads may only page a chunk in twice
+    struct ChunkCache
+    {
+        // epoch of last search touching each chunk, 0 when not resident
+        std::unique_ptr<std::atomic<uint64_t>[]> lastUse;
+        // NOTE: advanced by releaseChunks only, so that searches read it
+        // without writing to a shared line
+        std::atomic<uint64_t> epoch = 1;
+        std::atomic<int> nResident = 0;
+        int maxResident = 0;
+        std::mutex mutex;
+    };
+    std::unique_ptr<ChunkCache> cache;
+
+    // maximum depth of traversal stack
+    static constexpr int maxStackDepth = 64;
+
+    // build subtree of writable points [begin, end) with nodeIdx as root
+    // NOTE: writablePoints[0] is point pointOffset of the tree
+    void buildNode(int nodeIdx, int begin, int end, int pointOffset)
+    {
+        Node node;
+        for (int d = 0; d < PointT::dim; ++d)
+        {
+            node.bmin[d] = std::numeric_limits<float>::max();
+            node.bmax[d] = std::numeric_limits<float>::lowest();
+        }
+        for (int i = begin; i < end; ++i)
+        {
+            for (int d = 0; d < PointT::dim; ++d)
+            {
+                node.bmin[d] = std::min(node.bmin[d], writablePoints[i][d]);
+                node.bmax[d] = std::max(node.bmax[d], writablePoints[i][d]);
+            }
+        }
+        node.child = -1;
+        node.begin = pointOffset + begin;
+        node.count = end - begin;
+        node.axesOffset = 0;
+
+        if (node.count <= chunkSize)
+        {
+            nodes[nodeIdx] = node;
+            return;
+        }
+
+        // split at the median of the axis with the largest extent
+        int axis = 0;
+        for (int d = 1; d < PointT::dim; ++d)
+        {
+            if (node.bmax[d] - node.bmin[d] > node.bmax[axis] - node.bmin[axis])
+            {
+                axis = d;
+            }
+        }
+        const int mid = begin + node.count / 2;
+        std::nth_element(writablePoints + begin, writablePoints + mid,
+                         writablePoints + end,
+                         [&](const PointT &p1, const PointT &p2)
+                         { return p1[axis] < p2[axis]; });
+
+        node.child = nodes.size();
+        nodes.emplace_back();
+        nodes.emplace_back();
+        nodes[nodeIdx] = node;
+        buildNode(node.child, begin, mid, pointOffset);
+        buildNode(node.child + 1, mid, end, pointOffset);
+    }
+
+    // build left-balanced kd-tree of each chunk of writable points in place,
+    // for nodeIdx and nodes from firstIdx, which form its subtree
+    void buildChunks(int nodeIdx, int firstIdx, int pointOffset)
+    {
+        // place separation axes of chunks one after another
+        std::vector<int> leaves;
+        int n_axis_bytes = axes.size();
+        for (size_t i = firstIdx; i < nodes.size(); ++i)
+        {
+            if (nodes[i].child < 0)
+            {
+                leaves.push_back(i);
+            }
+        }
+        if (nodes[nodeIdx].child < 0)
+        {
+            leaves.push_back(nodeIdx);
+        }
+        for (const int leaf : leaves)
+        {
+            nodes[leaf].axesOffset = n_axis_bytes;
+            n_axis_bytes += (nodes[leaf].count + 3) / 4;
+        }
+        axes.resize(n_axis_bytes, 0);
+
+        // NOTE: tasks of each chunk run on its own thread
+#pragma omp parallel for schedule(dynamic)
+        for (size_t i = 0; i < leaves.size(); ++i)
+        {
+            const Node &node = nodes[leaves[i]];
+            LeftBalancedKdTree<PointT> tree;
+            tree.setPoints(writablePoints + (node.begin - pointOffset), node.count);
+            tree.buildTree();
+            std::copy(tree.getAxes(), tree.getAxes() + tree.getNAxisBytes(),
+                      axes.begin() + node.axesOffset);
+        }
+    }
+
+    // build subtree over partitions [p0, p1) with nodeIdx as root, see
+    // buildTree
+    template <typename ReadPartition, typename WritePoints>
+    bool buildPartitions(int nodeIdx, int p0, int p1, std::vector<PointT> &buffer,
+                         ReadPartition &readPartition, WritePoints &writePoints)
+    {
+        if (p1 - p0 == 1)
+        {
+            buffer.clear();
+            if (!readPartition(p0, buffer) ||
+                buffer.size() > size_t(std::numeric_limits<int>::max() - nPoints))
+                return false;
+
+            const int first_idx = nodes.size();
+            writablePoints = buffer.data();
+            buildNode(nodeIdx, 0, buffer.size(), nPoints);
+            buildChunks(nodeIdx, first_idx, nPoints);
+            writablePoints = nullptr;
+            if (!writePoints(buffer))
+                return false;
+            nPoints += buffer.size();
+            return true;
+        }
+
+        const int child = nodes.size();
+        nodes.emplace_back();
+        nodes.emplace_back();
+        const int mid = (p0 + p1) / 2;
+        if (!buildPartitions(child, p0, mid, buffer, readPartition, writePoints) ||
+            !buildPartitions(child + 1, mid, p1, buffer, readPartition, writePoints))
+            return false;
+
+        // NOTE: bounds of an empty partition are inverted, so that searches
+        // never enter it
+        const Node &left = nodes[child];
+        const Node &right = nodes[child + 1];
+        Node node;
+        for (int d = 0; d < PointT::dim; ++d)
+        {
+            node.bmin[d] = std::min(left.bmin[d], right.bmin[d]);
+            node.bmax[d] = std::max(left.bmax[d], right.bmax[d]);
+        }
+        node.child = child;
+        node.begin = left.begin;
+        node.count = left.count + right.count;
+        node.axesOffset = 0;
+        nodes[nodeIdx] = node;
+        return true;
+    }
+
+    // set up search structures of chunks over the current arrays
+    void setChunks()
+    {
+        const Node *node_array = getNodes();
+        chunkTrees.assign(getNNodes(), LeftBalancedKdTree<PointT>());
+        for (int i = 0; i < getNNodes(); ++i)
+        {
+            const Node &node = node_array[i];
+            if (node.child < 0)
+            {
+                chunkTrees[i].setTree(points + node.begin, node.count,
+                                      getAxes() + node.axesOffset);
+            }
+        }
+    }
+
+    // squared distance from query point to bounds of node, 0 inside
+    template <typename PointU>
+    static float boxDistance2(const PointU &queryPoint, const Node &node)
+    {
+        float dist2 = 0;
+        for (int d = 0; d < PointT::dim; ++d)
+        {
+            const float diff = std::max(
+                {node.bmin[d] - queryPoint[d], queryPoint[d] - node.bmax[d], 0.0f});
+            dist2 += diff * diff;
+        }
+        return dist2;
+    }
+
+    // time stamp of a new query, the current epoch
+    uint64_t beginSearch() const
+    {
+        return cache != nullptr ? cache->epoch.load(std::memory_order_relaxed)
+                                : 0;
+    }
+
+    // page chunk in if it isn't resident, release the least recently used
+    // chunks when too many are
+    // NOTE: lastUse is written only when its epoch changes
+    void touchChunk(int nodeIdx, uint64_t stamp) const
+    {
+        if (cache == nullptr)
+            return;
+
+        std::atomic<uint64_t> &last_use = cache->lastUse[nodeIdx];
+        uint64_t last = last_use.load(std::memory_order_relaxed);
+        while (true)
+        {
+            if (last != 0)
+            {
+                // NOTE: fails when releaseChunks set it to 0 meanwhile, then
+                // the chunk is paged in below
+                if (last >= stamp ||
+                    last_use.compare_exchange_weak(last, stamp,
+                                                   std::memory_order_relaxed))
+                    return;
+            }
+            else if (last_use.compare_exchange_weak(last, stamp,
+                                                    std::memory_order_relaxed))
+            {
+                break;
+            }
+        }
+
+        PM_STATS_ADD(chunkLoads, 1);
+        const Node &node = getNodes()[nodeIdx];
+        MappedFile::prefetch(points + node.begin, node.count * sizeof(PointT));
+        if (cache->nResident.fetch_add(1, std::memory_order_relaxed) + 1 >
+            cache->maxResident)
+        {
+            releaseChunks();
+        }
+    }
+
+    // release least recently used chunks until few enough are resident
+    // NOTE: scans all chunks, which is cheap next to reading a chunk
+    void releaseChunks() const
+    {
+        std::lock_guard<std::mutex> lock(cache->mutex);
+        // NOTE: chunks touched from now on are newer than all resident ones
+        cache->epoch.fetch_add(1, std::memory_order_relaxed);
+        const Node *node_array = getNodes();
+        while (cache->nResident.load(std::memory_order_relaxed) > cache->maxResident)
+        {
+            int victim = -1;
+            uint64_t oldest = std::numeric_limits<uint64_t>::max();
+            for (int i = 0; i < getNNodes(); ++i)
+            {
+                const uint64_t last_use =
+                    cache->lastUse[i].load(std::memory_order_relaxed);
+                if (last_use != 0 && last_use < oldest)
+                {
+                    victim = i;
+                    oldest = last_use;
+                }
+            }
+            if (victim < 0)
+                return;
+
+            // NOTE: skipped when another thread touched it meanwhile
+            if (cache->lastUse[victim].compare_exchange_strong(
+                    oldest, 0, std::memory_order_relaxed))
+            {
+                MappedFile::release(points + node_array[victim].begin,
+                                    node_array[victim].count * sizeof(PointT));
+                cache->nResident.fetch_sub(1, std::memory_order_relaxed);
+            }
+        }
+    }
+
+public:
+    ChunkedKdTree() : points(nullptr), writablePoints(nullptr), nPoints(0) {}
+
+    // NOTE: points are reordered by buildTree
+    void setPoints(PointT *points, int nPoints)
+    {
+        this->points = points;
+        this->writablePoints = points;
+        this->nPoints = nPoints;
+    }
+
+    // NOTE: takes effect on next build
+    void setChunkSize(int chunkSize) { this->chunkSize = std::max(chunkSize, 1); }
+    int getChunkSize() const { return chunkSize; }
+
+    // bytes of points kept resident by a tree in a file mapping, 0 to keep all
+    // NOTE: takes effect on next setTree. at least one chunk stays resident
+    void setMaxResidentBytes(size_t bytes) { maxResidentBytes = bytes; }
+    size_t getMaxResidentBytes() const { return maxResidentBytes; }
+
+    int getNPoints() const { return nPoints; }
+
+    // arrays of the tree, for serialization
+    const Node *getNodes() const
+    {
+        return sharedNodes != nullptr ? sharedNodes : nodes.data();
+    }
+    int getNNodes() const
+    {
+        return sharedNodes != nullptr ? nSharedNodes : nodes.size();
+    }
+    const uint8_t *getAxes() const
+    {
+        return sharedAxes != nullptr ? sharedAxes : axes.data();
+    }
+    int getNAxisBytes() const
+    {
+        int n_bytes = 0;
+        const Node *node_array = getNodes();
+        for (int i = 0; i < getNNodes(); ++i)
+        {
+            if (node_array[i].child < 0)
+            {
+                n_bytes += (node_array[i].count + 3) / 4;
+            }
+        }
+        return n_bytes;
+    }
+
+    // return true if the arrays form a tree over nPoints points
+    // NOTE: depth is bounded, since searches keep at most one entry per level
+    // on the traversal stack
+    static bool isValidTree(int nPoints, const Node *nodes, int nNodes,
+                            int nAxisBytes)
+    {
+        if ((nPoints > 0) != (nNodes > 0))
+            return false;
+        // children come after their parents, so depths are final in order
+        std::vector<int> depths(nNodes, 0);
+        for (int i = 0; i < nNodes; ++i)
+        {
+            const Node &node = nodes[i];
+            if (node.begin < 0 || node.count < 0 || node.begin > nPoints ||
+                node.count > nPoints - node.begin ||
+                (node.child >= 0 && (node.child <= i || node.child >= nNodes - 1)) ||
+                (node.child < 0 && (node.axesOffset < 0 ||
+                                    node.axesOffset > nAxisBytes - (node.count + 3) / 4)))
+                return false;
+            if (node.child >= 0)
+            {
+                if (depths[i] + 1 >= maxStackDepth)
+                    return false;
+                depths[node.child] = std::max(depths[node.child], depths[i] + 1);
+                depths[node.child + 1] =
+                    std::max(depths[node.child + 1], depths[i] + 1);
+            }
+        }
+        return true;
+    }
+
+    // use prebuilt tree over the given points in tree order instead of
+    // building it
+    // NOTE: arrays are referenced, not copied, so they must outlive the tree.
+    // points must be in a read-only file mapping, since chunks are released
+    // from memory when maxResidentBytes is set
+    void setTree(const PointT *points, int nPoints, const Node *nodes, int nNodes,
+                 const uint8_t *axes)
+    {
+        this->points = points;
+        this->writablePoints = nullptr;
+        this->nPoints = nPoints;
+        this->nodes.clear();
+        this->axes.clear();
+        sharedNodes = nodes;
+        nSharedNodes = nNodes;
+        sharedAxes = axes;
+        setChunks();
+
+        cache.reset();
+        if (maxResidentBytes > 0 && nNodes > 0)
+        {
+            cache = std::make_unique<ChunkCache>();
+            cache->lastUse = std::make_unique<std::atomic<uint64_t>[]>(nNodes);
+            cache->maxResident = std::max<size_t>(
+                maxResidentBytes / (sizeof(PointT) * size_t(chunkSize)), 1);
+        }
+    }
+
+    void buildTree()
+    {
+        const auto start = std::chrono::steady_clock::now();
+
+        sharedNodes = nullptr;
+        nSharedNodes = 0;
+        sharedAxes = nullptr;
+        cache.reset();
+        nodes.clear();
+        axes.clear();
+        if (nPoints > 0)
+        {
+            nodes.emplace_back();
+            buildNode(0, 0, nPoints, 0);
+            buildChunks(0, 1, 0);
+        }
+        setChunks();
+
+        buildTime = std::chrono::duration<double>(
+                        std::chrono::steady_clock::now() - start)
+                        .count();
+    }
+
+    // build tree over points read one partition at a time, returns false when
+    // reading or writing failed
+    // partitions are the 2^nLevels leaves of a binary tree, in order. the
+    // top-level nodes follow that tree, each partition is split further into
+    // chunks
+    // NOTE: readPartition(p, points) appends points of partition p, which are
+    // reordered and handed to writePoints(points) in tree order before the next
+    // partition is read, so that only one partition is held in memory. the
+    // tree keeps no points, set it up with setTree over the written ones
+    template <typename ReadPartition, typename WritePoints>
+        requires std::invocable<ReadPartition &, int, std::vector<PointT> &> &&
+                 std::invocable<WritePoints &, const std::vector<PointT> &>
+    bool buildTree(int nLevels, ReadPartition &&readPartition,
+                   WritePoints &&writePoints)
+    {
+        const auto start = std::chrono::steady_clock::now();
+
+        points = nullptr;
+        writablePoints = nullptr;
+        nPoints = 0;
+        sharedNodes = nullptr;
+        nSharedNodes = 0;
+        sharedAxes = nullptr;
+        cache.reset();
+        chunkTrees.clear();
+        nodes.assign(1, Node());
+        axes.clear();
+
+        std::vector<PointT> buffer;
+        const bool built = buildPartitions(0, 0, 1 << nLevels, buffer,
+                                           readPartition, writePoints);
+        if (!built || nPoints == 0)
+        {
+            nPoints = 0;
+            nodes.clear();
+            axes.clear();
+        }
+
+        buildTime = std::chrono::duration<double>(
+                        std::chrono::steady_clock::now() - start)
+                        .count();
+        return built;
+    }
+
+    // wall time of last build in seconds
+    double getBuildTime() const { return buildTime; }
+
+    // search k-nearest points, write (squared distance, index) pairs into the
+    // given heap
+    // NOTE: index refers to point array in tree order. chunks are visited
+    // nearest first, so a distant chunk is paged in only when its bounds are
+    // closer than the k-th point found so far
+    template <typename PointU>
+        requires Point<PointU>
+    void searchKNearest(const PointU &queryPoint, int k, KNNHeap &heap) const
+    {
+        heap.reset(k);
+        if (getNNodes() <= 0 || k <= 0)
+            return;
+
+        const Node *node_array = getNodes();
+        const uint64_t stamp = beginSearch();
+        struct StackEntry
+        {
+            int nodeIdx;
+            float boxDist2; // squared distance to the bounds of node
+        };
+        StackEntry stack[maxStackDepth];
+        int stackSize = 0;
+        stack[stackSize++] = {0, 0.0f};
+
+        // current squared search radius
+        float radius2 = std::numeric_limits<float>::infinity();
+
+        while (stackSize > 0)
+        {
+            const StackEntry entry = stack[--stackSize];
+            if (entry.boxDist2 >= radius2)
+                continue;
+
+            const Node &node = node_array[entry.nodeIdx];
+            if (node.child < 0)
+            {
+                touchChunk(entry.nodeIdx, stamp);
+                chunkTrees[entry.nodeIdx].addKNearest(queryPoint, heap, node.begin);
+                if (heap.full())
+                {
+                    radius2 = heap.maxDist2();
+                }
+                continue;
+            }
+
+            // push far child first, so that near child is searched first
+            const float left_dist2 = boxDistance2(queryPoint, node_array[node.child]);
+            const float right_dist2 =
+                boxDistance2(queryPoint, node_array[node.child + 1]);
+            const StackEntry left = {node.child, left_dist2};
+            const StackEntry right = {node.child + 1, right_dist2};
+            const StackEntry &near = left_dist2 <= right_dist2 ? left : right;
+            const StackEntry &far = left_dist2 <= right_dist2 ? right : left;
+            if (far.boxDist2 < radius2)
+            {
+                stack[stackSize++] = far;
+            }
+            stack[stackSize++] = near;
+        }
+    }
+
+    // visit every point closer than sqrt(maxDist2) with visitor(index, dist2)
+    template <typename PointU, typename Visitor>
+        requires Point<PointU> && std::invocable<Visitor &, int, float>
+    void searchRadius(const PointU &queryPoint, float maxDist2,
+                      Visitor &&visitor) const
+    {
+        if (getNNodes() <= 0)
+            return;
+
+        const Node *node_array = getNodes();
+        const uint64_t stamp = beginSearch();
+        int stack[maxStackDepth];
+        int stackSize = 0;
+        stack[stackSize++] = 0;
+
+        bool stopped = false;
+        while (stackSize > 0 && !stopped)
+        {
+            const int nodeIdx = stack[--stackSize];
+            const Node &node = node_array[nodeIdx];
+            if (boxDistance2(queryPoint, node) >= maxDist2)
+                continue;
+
+            if (node.child < 0)
+            {
+                touchChunk(nodeIdx, stamp);
+                chunkTrees[nodeIdx].searchRadius(
+                    queryPoint, maxDist2,
+                    [&](int idx, float dist2)
+                    {
+                        stopped = !visitPoint(visitor, node.begin + idx, dist2);
+                        return !stopped;
+                    });
+                continue;
+            }
+
+            stack[stackSize++] = node.child + 1;
+            stack[stackSize++] = node.child;
+        }
+    }
+};
+
+// compute squared distances from query point to every point of SoA bucket
+// returns bit mask of points closer than sqrt(maxDist2)
+// NOTE: instruction set is chosen at compile time(AVX-512, AVX2, SSE or scalar)
+template <int dim, int bucketSize>
+inline uint32_t bucketDistance2(const float (&coords)[dim][bucketSize],
+                                const float (&queryPoint)[dim], float maxDist2,
+                                float (&dist2)[bucketSize])
+{
+    uint32_t mask = 0;
+#if defined(__AVX512F__)
+    if constexpr (bucketSize % 16 == 0)
+    {
+        const __m512 r2 = _mm512_set1_ps(maxDist2);
+        for (int c = 0; c < bucketSize; c += 16)
+        {
+            __m512 d2 = _mm512_setzero_ps();
+            for (int d = 0; d < dim; ++d)
+            {
+                const __m512 diff = _mm512_sub_ps(_mm512_load_ps(&coords[d][c]),
+                                                  _mm512_set1_ps(queryPoint[d]));
+                d2 = _mm512_fmadd_ps(diff, diff, d2);
+            }
+            _mm512_store_ps(&dist2[c], d2);
+            mask |= static_cast<uint32_t>(_mm512_cmp_ps_mask(d2, r2, _CMP_LT_OQ))
+                    << c;
+        }
+        return mask;
+    }
+#endif
+#if defined(__AVX2__)
+    if constexpr (bucketSize % 8 == 0)
+    {
+        const __m256 r2 = _mm256_set1_ps(maxDist2);
+        for (int c = 0; c < bucketSize; c += 8)
+        {
+            __m256 d2 = _mm256_setzero_ps();
+            for (int d = 0; d < dim; ++d)
+            {
+                const __m256 diff = _mm256_sub_ps(_mm256_load_ps(&coords[d][c]),
+                                                  _mm256_set1_ps(queryPoint[d]));
+                d2 = _mm256_add_ps(d2, _mm256_mul_ps(diff, diff));
+            }
+            _mm256_store_ps(&dist2[c], d2);
+            mask |= static_cast<uint32_t>(
+                        _mm256_movemask_ps(_mm256_cmp_ps(d2, r2, _CMP_LT_OQ)))
+                    << c;
+        }
+        return mask;
+    }
+#endif
+#if defined(__SSE2__) || defined(_M_X64)
+    if constexpr (bucketSize % 4 == 0)
+    {
+        const __m128 r2 = _mm_set1_ps(maxDist2);
+        for (int c = 0; c < bucketSize; c += 4)
+        {
+            __m128 d2 = _mm_setzero_ps();
+            for (int d = 0; d < dim; ++d)
+            {
+                const __m128 diff = _mm_sub_ps(_mm_load_ps(&coords[d][c]),
+                                               _mm_set1_ps(queryPoint[d]));
+                d2 = _mm_add_ps(d2, _mm_mul_ps(diff, diff));
+            }
+            _mm_store_ps(&dist2[c], d2);
+            mask |= static_cast<uint32_t>(_mm_movemask_ps(_mm_cmplt_ps(d2, r2)))
+                    << c;
+        }
+        return mask;
+    }
+#endif
+    for (int c = 0; c < bucketSize; ++c)
+    {
+        float d2 = 0;
+        for (int d = 0; d < dim; ++d)
+        {
+            const float diff = coords[d][c] - queryPoint[d];
+            d2 += diff * diff;
+        }
+        dist2[c] = d2;
+        if (d2 < maxDist2)
+        {
+            mask |= 1u << c;
+        }
+    }
+    return mask;
+}
+
+// implementation of kd-tree with leaf buckets
+// NOTE: each leaf holds up to BucketSize points as SoA coordinates, so the tree
+// is shallow and distance tests in a leaf run with SIMD
+template <typename PointT, int BucketSize = 16>
+    requires Point<PointT>
+class BucketKdTree
+{
+private:
+    static_assert(BucketSize > 0 && BucketSize <= 32,
+                  "bucket mask is held in 32 bits");
+
+public:
+    struct Node
+    {
+        int axis;          // separation axis, -1 for leaf
+        float split;       // position of separation plane
+        int leftChildIdx;  // index of left child, index of bucket for leaf
+        int rightChildIdx; // index of right child
+    };
+
+    struct alignas(64) Bucket
+    {
+        float coords[PointT::dim][BucketSize]; // padded with infinity
+        int indices[BucketSize];               // padded with -1
+    };
+
+private:
+    std::vector<Node> nodes;     // array of tree nodes
+    std::vector<Bucket> buckets; // array of leaf buckets
+    const PointT *points;        // pointer to array of points
+    int nPoints;                 // number of points
+    double buildTime = 0;        // wall time of last build in seconds
+
+    // arrays of a prebuilt tree, used instead of nodes, buckets when set
+    const Node *sharedNodes = nullptr;
+    const Bucket *sharedBuckets = nullptr;
+    int nSharedNodes = 0;
+    int nSharedBuckets = 0;
+
+    // minimum number of points to build subtree as a separate task
+    static constexpr int parallelBuildCutoff = 1 << 14;
+
+    // maximum depth of traversal stack
+    static constexpr int maxStackDepth = 64;
+
+    // number of leaves of subtree with n points
+    // NOTE: ranges are halved, so sizes at each level differ by at most one
+    static int nLeaves(int n)
+    {
+        int64_t leaves = 0;
+        int64_t size = n;  // smaller size at current level
+        int64_t nSmall = 1; // number of ranges with size
+        int64_t nLarge = 0; // number of ranges with size + 1
+        while (nSmall + nLarge > 0)
+        {
+            if (size + 1 <= BucketSize)
+            {
+                leaves += nSmall + nLarge;
+                break;
+            }
+            if (size <= BucketSize)
+            {
+                leaves += nSmall;
+                nSmall = 0;
+            }
+
+            // split ranges of the current level in halves
+            const int64_t next = size / 2;
+            int64_t nextSmall = 0;
+            int64_t nextLarge = 0;
+            const auto count = [&](int64_t s, int64_t k)
+            {
+                if (s == next)
+                    nextSmall += k;
+                else
+                    nextLarge += k;
+            };
+            count(size / 2, nSmall);
+            count(size - size / 2, nSmall);
+            count((size + 1) / 2, nLarge);
+            count((size + 1) - (size + 1) / 2, nLarge);
+
+            size = next;
+            nSmall = nextSmall;
+            nLarge = nextLarge;
+        }
+        return leaves;
+    }
+
+    void buildNode(int *indices, int n_points, int nodeIdx, int bucketIdx)
+    {
+        Node &node = nodes[nodeIdx];
+
+        // make leaf bucket
+        if (n_points <= BucketSize)
+        {
+            node.axis = -1;
+            node.split = 0;
+            node.leftChildIdx = bucketIdx;
+            node.rightChildIdx = -1;
+
+            Bucket &bucket = buckets[bucketIdx];
+            for (int i = 0; i < BucketSize; ++i)
+            {
+                const bool valid = i < n_points;
+                for (int d = 0; d < PointT::dim; ++d)
+                {
+                    bucket.coords[d][i] = valid ? points[indices[i]][d]
+                                                : std::numeric_limits<float>::infinity();
+                }
+                bucket.indices[i] = valid ? indices[i] : -1;
+            }
+            return;
+        }
+
+        // choose separation axis with the largest extent of points
+        float bmin[PointT::dim];
+        float bmax[PointT::dim];
+        for (int d = 0; d < PointT::dim; ++d)
+        {
+            bmin[d] = std::numeric_limits<float>::max();
+            bmax[d] = std::numeric_limits<float>::lowest();
+        }
+        for (int i = 0; i < n_points; ++i)
+        {
+            const PointT &p = points[indices[i]];
+            for (int d = 0; d < PointT::dim; ++d)
+            {
+                bmin[d] = std::min(bmin[d], p[d]);
+                bmax[d] = std::max(bmax[d], p[d]);
+            }
+        }
+        int axis = 0;
+        for (int d = 1; d < PointT::dim; ++d)
+        {
+            if (bmax[d] - bmin[d] > bmax[axis] - bmin[axis])
+            {
+                axis = d;
+            }
+        }
+
+        // partition indices around the median, median goes to the right
+        const int mid = n_points / 2;
+        std::nth_element(indices, indices + mid, indices + n_points,
+                         [&](const int idx1, const int idx2)
+                         { return points[idx1][axis] < points[idx2][axis]; });
+
+        // nodes and buckets of left subtree follow parent node
+        const int n_left_leaves = nLeaves(mid);
+        node.axis = axis;
+        node.split = points[indices[mid]][axis];
+        node.leftChildIdx = nodeIdx + 1;
+        node.rightChildIdx = nodeIdx + 2 * n_left_leaves;
+
+        if (n_points >= parallelBuildCutoff)
+        {
+#pragma omp task
+            buildNode(indices, mid, node.leftChildIdx, bucketIdx);
+            buildNode(indices + mid, n_points - mid, node.rightChildIdx,
+                      bucketIdx + n_left_leaves);
+#pragma omp taskwait
+        }
+        else
+        {
+            buildNode(indices, mid, node.leftChildIdx, bucketIdx);
+            buildNode(indices + mid, n_points - mid, node.rightChildIdx,
+                      bucketIdx + n_left_leaves);
+        }
+    }
+
+public:
+    BucketKdTree() : points(nullptr), nPoints(0) {}
+
+    void setPoints(const PointT *points, int nPoints)
+    {
+        this->points = points;
+        this->nPoints = nPoints;
+    }
+
+    void buildTree()
+    {
+        const auto start = std::chrono::steady_clock::now();
+
+        nodes.clear();
+        buckets.clear();
+        sharedNodes = nullptr;
+        sharedBuckets = nullptr;
+        nSharedNodes = 0;
+        nSharedBuckets = 0;
+        if (nPoints > 0)
+        {
+            // setup indices of points
+            std::vector<int> indices(nPoints);
+            std::iota(indices.begin(), indices.end(), 0);
+
+            const int n_leaves = nLeaves(nPoints);
+            nodes.resize(2 * n_leaves - 1);
+            buckets.resize(n_leaves);
+#pragma omp parallel
+#pragma omp single
+            buildNode(indices.data(), nPoints, 0, 0);
+        }
+
+        buildTime = std::chrono::duration<double>(
+                        std::chrono::steady_clock::now() - start)
+                        .count();
+    }
+
+    // wall time of last build in seconds
+    double getBuildTime() const { return buildTime; }
+
+    // arrays of the tree, for serialization
+    const Node *getNodes() const
+    {
+        return sharedNodes != nullptr ? sharedNodes : nodes.data();
+    }
+    int getNNodes() const
+    {
+        return sharedNodes != nullptr ? nSharedNodes : nodes.size();
+    }
+    const Bucket *getBuckets() const
+    {
+        return sharedBuckets != nullptr ? sharedBuckets : buckets.data();
+    }
+    int getNBuckets() const
+    {
+        return sharedBuckets != nullptr ? nSharedBuckets : buckets.size();
+    }
+
+    // use prebuilt tree over the given points instead of building it
+    // NOTE: arrays are referenced, not copied, so they must outlive the tree
+    void setTree(const PointT *points, int nPoints, const Node *nodes, int nNodes,
+                 const Bucket *buckets, int nBuckets)
+    {
+        setPoints(points, nPoints);
+        this->nodes.clear();
+        this->buckets.clear();
+        sharedNodes = nodes;
+        sharedBuckets = buckets;
+        nSharedNodes = nNodes;
+        nSharedBuckets = nBuckets;
+    }
+
+    // search k-nearest points, write (squared distance, index) pairs into the
+    // given heap
+    template <typename PointU>
+        requires Point<PointU>
+    void searchKNearest(const PointU &queryPoint, int k, KNNHeap &heap,
+                        float maxDist2 = std::numeric_limits<float>::infinity())
+        const
+    {
+        heap.reset(k);
+        if (getNNodes() == 0 || k <= 0)
+            return;
+
+        const Node *node_data = getNodes();
+        const Bucket *bucket_data = getBuckets();
+
+        float q[PointT::dim];
+        for (int d = 0; d < PointT::dim; ++d)
+        {
+            q[d] = queryPoint[d];
+        }
+
+        struct StackEntry
+        {
+            int nodeIdx;
+            float planeDist2; // squared distance to the splitting plane
+        };
+        StackEntry stack[maxStackDepth];
+        int stackSize = 0;
+        stack[stackSize++] = {0, 0.0f};
+
+        // current squared search radius
+        float radius2 = maxDist2;
+
+        alignas(64) float dist2[BucketSize];
+        while (stackSize > 0)
+        {
+            const StackEntry entry = stack[--stackSize];
+            if (entry.planeDist2 >= radius2)
+                continue;
+
+            // descend to leaf, remember siblings overlapping the search radius
+            int idx = entry.nodeIdx;
+            while (node_data[idx].axis != -1)
+            {
+                const Node &node = node_data[idx];
+                const float diff = q[node.axis] - node.split;
+                const int nearChildIdx = diff < 0 ? node.leftChildIdx : node.rightChildIdx;
+                const int farChildIdx = diff < 0 ? node.rightChildIdx : node.leftChildIdx;
+
+                const float planeDist2 = diff * diff;
+                if (planeDist2 < radius2)
+                {
+                    stack[stackSize++] = {farChildIdx, planeDist2};
+                }
+
+                idx = nearChildIdx;
+            }
+
+            // test all points of bucket at once
+            const Bucket &bucket = bucket_data[node_data[idx].leftChildIdx];
+            uint32_t mask = bucketDistance2(bucket.coords, q, radius2, dist2);
+            while (mask != 0)
+            {
+                const int i = std::countr_zero(mask);
+                mask &= mask - 1;
+
+                // NOTE: radius may have shrunk by previous points of the bucket
+                if (dist2[i] < radius2)
+                {
+                    heap.push(dist2[i], bucket.indices[i]);
+                    if (heap.full())
+                    {
+                        radius2 = heap.maxDist2();
+                    }
+                }
+            }
+        }
+    }
+
+    // visit every point closer than sqrt(maxDist2) with visitor(index, dist2)
+    template <typename PointU, typename Visitor>
+        requires Point<PointU> && std::invocable<Visitor &, int, float>
+    void searchRadius(const PointU &queryPoint, float maxDist2,
+                      Visitor &&visitor) const
+    {
+        if (getNNodes() == 0)
+            return;
+
+        const Node *node_data = getNodes();
+        const Bucket *bucket_data = getBuckets();
+        float q[PointT::dim];
+        for (int d = 0; d < PointT::dim; ++d)
+        {
+            q[d] = queryPoint[d];
+        }
+
+        int stack[maxStackDepth];
+        int stackSize = 0;
+        stack[stackSize++] = 0;
+
+        alignas(64) float dist2[BucketSize];
+        while (stackSize > 0)
+        {
+            int idx = stack[--stackSize];
+            while (node_data[idx].axis != -1)
+            {
+                const Node &node = node_data[idx];
+                const float diff = q[node.axis] - node.split;
+                const int nearChildIdx = diff < 0 ? node.leftChildIdx : node.rightChildIdx;
+                const int farChildIdx = diff < 0 ? node.rightChildIdx : node.leftChildIdx;
+
+                if (diff * diff < maxDist2)
+                {
+                    stack[stackSize++] = farChildIdx;
+                }
+
+                idx = nearChildIdx;
+            }
+
+            const Bucket &bucket = bucket_data[node_data[idx].leftChildIdx];
+            uint32_t mask = bucketDistance2(bucket.coords, q, maxDist2, dist2);
+            while (mask != 0)
+            {
+                const int i = std::countr_zero(mask);
+                mask &= mask - 1;
+                if (!visitPoint(visitor, bucket.indices[i], dist2[i]))
+                {
+                    return;
+                }
+            }
+        }
+    }
+};
+
+// compute order of the given points along 3D morton curve over their bounds
+// NOTE: points close in space end up close in the order
+inline void mortonOrder(const Vec3f *points, int n_points, std::vector<int> &order)
+{
+    order.resize(n_points);
+    std::iota(order.begin(), order.end(), 0);
+    if (n_points <= 1)
+        return;
+
+    // bounds of points
+    Vec3f pmin = points[0];
+    Vec3f pmax = points[0];
+    for (int i = 1; i < n_points; ++i)
+    {
+        for (int j = 0; j < 3; ++j)
+        {
+            pmin[j] = std::min(pmin[j], points[i][j]);
+            pmax[j] = std::max(pmax[j], points[i][j]);
+        }
+    }
+
+    // quantize into 10 bits per axis
+    thread_local std::vector<uint32_t> codes;
+    codes.resize(n_points);
+    for (int i = 0; i < n_points; ++i)
+    {
+        uint32_t q[3];
+        for (int j = 0; j < 3; ++j)
+        {
+            const float extent = pmax[j] - pmin[j];
+            const float t = extent > 0 ? (points[i][j] - pmin[j]) / extent : 0;
+            q[j] = std::min(static_cast<uint32_t>(t * 1024.0f), 1023u);
+        }
+        codes[i] = mortonEncode3D(q[0], q[1], q[2]);
+    }
+
+    std::sort(order.begin(), order.end(),
+              [&](int i, int j) { return codes[i] < codes[j]; });
+}
+
+// record format of photons in photon map
+enum class PhotonFormat
+{
+    FULL,   // Photon, 36 bytes
+    COMPACT // CompactPhoton, 20 bytes
+};
+
+// memory layout of photon map
+enum class PhotonMapLayout
+{
+    KD_TREE,       // photons and separate array of kd-tree nodes
+    LEFT_BALANCED, // photons reordered into implicit left-balanced kd-tree
+    BUCKETED,      // kd-tree with SoA leaf buckets for SIMD distance tests
+    OUT_OF_CORE    // chunks of left-balanced kd-trees paged in from file
+};
+
+// inputs photons depend on, stored with persisted photon maps
+// NOTE: a persisted photon map is used only when its key is equal
+struct PhotonMapKey
+{
+    uint64_t sceneHash = 0;    // hash of scene geometry and materials
+    uint64_t nPhotons = 0;     // number of emitted photons
+    uint64_t seed = 0;         // seed of the sampler photons are traced with
+    uint64_t settingsHash = 0; // hash of other settings of photon tracing
+
+    bool operator==(const PhotonMapKey &other) const = default;
+
+    // hash of the whole key, e.g. for file names
+    uint64_t getHash() const { return hashBytes(this, sizeof(PhotonMapKey)); }
+};
+
+// array of a persisted photon map
+struct PhotonMapSection
+{
+    const void *data = nullptr;
+    uint64_t count = 0;
+    uint64_t elementSize = 0;
+
+    PhotonMapSection() {}
+    template <typename T>
+    PhotonMapSection(const T *data, uint64_t count)
+        : data(data), count(count), elementSize(sizeof(T)) {}
+
+    // return typed pointer if the section holds n elements of T
+    template <typename T>
+    const T *get(uint64_t n) const
+    {
+        return count == n && elementSize == sizeof(T)
+                   ? static_cast<const T *>(data)
+                   : nullptr;
+    }
+};
+
+constexpr int photonMapMaxSections = 3;
+using PhotonMapSections = std::array<PhotonMapSection, photonMapMaxSections>;
+
+// binary file of persisted photon map
+// NOTE: sections are aligned to the cache line, so that the mapped file is
+// searched in place(e.g. SIMD buckets)
+constexpr char photonMapMagic[8] = "PMPHOTN";
+constexpr uint32_t photonMapVersion = 1;
+constexpr uint64_t photonMapAlignment = 64;
+
+struct PhotonMapFileHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t type; // kind of stored map, format and layout of photon map
+    PhotonMapKey key;
+    uint64_t sectionOffsets[photonMapMaxSections];
+    uint64_t sectionCounts[photonMapMaxSections];
+    uint64_t sectionElementSizes[photonMapMaxSections];
+    uint64_t fileSize;
+};
+
+inline uint64_t alignPhotonMapOffset(uint64_t offset)
+{
+    return (offset + photonMapAlignment - 1) / photonMapAlignment *
+           photonMapAlignment;
+}
+
+// path of a new file in dir, e.g. dir/global-3f2a9c0e1b7d4a56.pmchunks
+// NOTE: named at random, so that concurrent runs sharing dir don't clobber
+// each other's files
+inline std::filesystem::path getUniquePath(const std::filesystem::path &dir,
+                                           const std::string &stem,
+                                           const std::string &extension)
+{
+    std::random_device device;
+    while (true)
+    {
+        const uint64_t id = (static_cast<uint64_t>(device()) << 32) | device();
+        char name[17];
+        std::snprintf(name, sizeof(name), "%016llx",
+                      static_cast<unsigned long long>(id));
+        const std::filesystem::path path = dir / (stem + "-" + name + extension);
+        std::error_code ec;
+        if (!std::filesystem::exists(path, ec) && !ec)
+            return path;
+    }
+}
+
+// photon map file written in pieces, elements of section 0 are appended
+// before the other sections are known
+// NOTE: written to a temporary file first, so that a concurrent run never
+// maps a partially written file
+class PhotonMapFileWriter
+{
+private:
+    std::filesystem::path filepath;
+    std::filesystem::path tmppath; // empty when not open
+    std::ofstream file;
+    uint64_t count = 0;       // elements of section 0
+    uint64_t elementSize = 0; // bytes of an element of section 0
+
+    // write data after zero padding
+    void writeAt(uint64_t at, const void *data, uint64_t bytes)
+    {
+        static const char zeros[photonMapAlignment] = {};
+        file.write(zeros, at - static_cast<uint64_t>(file.tellp()));
+        file.write(static_cast<const char *>(data), bytes);
+    }
+
+    void discard()
+    {
+        file.close();
+        std::error_code ec;
+        std::filesystem::remove(tmppath, ec);
+        tmppath.clear();
+    }
+
+public:
+    PhotonMapFileWriter() {}
+    ~PhotonMapFileWriter()
+    {
+        if (!tmppath.empty())
+        {
+            discard();
+        }
+    }
+
+    PhotonMapFileWriter(const PhotonMapFileWriter &) = delete;
+    PhotonMapFileWriter &operator=(const PhotonMapFileWriter &) = delete;
+
+    // return false on failure
+    bool open(const std::filesystem::path &filepath, uint64_t elementSize)
+    {
+        this->filepath = filepath;
+        this->tmppath = filepath.string() + ".tmp";
+        this->count = 0;
+        this->elementSize = elementSize;
+        file.open(tmppath, std::ios::binary);
+        if (!file)
+        {
+            tmppath.clear();
+            return false;
+        }
+
+        // NOTE: header is written by close
+        writeAt(alignPhotonMapOffset(sizeof(PhotonMapFileHeader)), nullptr, 0);
+        return static_cast<bool>(file);
+    }
+
+    // append n elements to section 0, return false on failure
+    bool append(const void *data, uint64_t n)
+    {
+        file.write(static_cast<const char *>(data), n * elementSize);
+        count += n;
+        return static_cast<bool>(file);
+    }
+
+    // write the other sections and header, return false on failure
+    // NOTE: data of section 0 is ignored, its count has to match the
+    // appended elements
+    bool close(uint32_t type, const PhotonMapKey &key,
+               const PhotonMapSections &sections)
+    {
+        if (tmppath.empty())
+            return false;
+        if (!file || sections[0].count != count ||
+            sections[0].elementSize != elementSize)
+        {
+            discard();
+            return false;
+        }
+
+        PhotonMapFileHeader header = {};
+        std::memcpy(header.magic, photonMapMagic, sizeof(header.magic));
+        header.version = photonMapVersion;
+        header.type = type;
+        header.key = key;
+
+        uint64_t offset = alignPhotonMapOffset(sizeof(PhotonMapFileHeader));
+        for (int i = 0; i < photonMapMaxSections; ++i)
+        {
+            header.sectionOffsets[i] = offset;
+            header.sectionCounts[i] = sections[i].count;
+            header.sectionElementSizes[i] = sections[i].elementSize;
+            offset = alignPhotonMapOffset(offset + sections[i].count *
+                                                       sections[i].elementSize);
+        }
+        header.fileSize = offset;
+
+        for (int i = 1; i < photonMapMaxSections; ++i)
+        {
+            writeAt(header.sectionOffsets[i], sections[i].data,
+                    sections[i].count * sections[i].elementSize);
+        }
+        writeAt(header.fileSize, nullptr, 0);
+        file.seekp(0);
+        file.write(reinterpret_cast<const char *>(&header),
+                   sizeof(PhotonMapFileHeader));
+        file.close();
+
+        std::error_code ec;
+        if (file)
+        {
+            std::filesystem::rename(tmppath, filepath, ec);
+        }
+        if (!file || ec)
+        {
+            discard();
+            return false;
+        }
+        tmppath.clear();
+        return true;
+    }
+};
+
+// write sections to a photon map file, return false on failure
+inline bool writePhotonMapFile(const std::filesystem::path &filepath,
+                               uint32_t type, const PhotonMapKey &key,
+                               const PhotonMapSections &sections)
+{
+    PhotonMapFileWriter writer;
+    return writer.open(filepath, sections[0].elementSize) &&
+           writer.append(sections[0].data, sections[0].count) &&
+           writer.close(type, key, sections);
+}
+
+// map photon map file, set sections to point into it
+// returns false when file is missing or doesn't match the given type and key
+inline bool mapPhotonMapFile(const std::filesystem::path &filepath,
+                             uint32_t type, const PhotonMapKey &key,
+                             MappedFile &file, PhotonMapSections &sections)
+{
+    if (!file.open(filepath) || file.size() < sizeof(PhotonMapFileHeader))
+        return false;
+
+    PhotonMapFileHeader header;
+    std::memcpy(&header, file.data(), sizeof(PhotonMapFileHeader));
+    if (std::memcmp(header.magic, photonMapMagic, sizeof(header.magic)) != 0 ||
+        header.version != photonMapVersion || header.type != type ||
+        !(header.key == key) || header.fileSize != file.size())
+    {
+        file.close();
+        return false;
+    }
+
+    for (int i = 0; i < photonMapMaxSections; ++i)
+    {
+        const uint64_t at = header.sectionOffsets[i];
+        const uint64_t bytes = header.sectionCounts[i] * header.sectionElementSizes[i];
+        if (at % photonMapAlignment != 0 || at > file.size() ||
+            bytes > file.size() - at)
+        {
+            file.close();
+            return false;
+        }
+        sections[i].data = file.data() + at;
+        sections[i].count = header.sectionCounts[i];
+        sections[i].elementSize = header.sectionElementSizes[i];
+    }
+    return true;
+}
+
+// photons spilled to one file per spatial partition while they are traced
+// partitions are the leaves of nLevels midpoint splits of the given bounds
+// NOTE: each batch is written with a key, e.g. the first photon path of a
+// thread buffer. threads trace disjoint ranges of paths, so sorting the
+// batches of a partition by key restores the order of tracing
+template <typename PointT>
+    requires Point<PointT>
+class PhotonSpill
+{
+private:
+    // batch in the file of a partition, or in memory after writing failed
+    struct Batch
+    {
+        int64_t key;
+        uint64_t count;
+        uint64_t offset;           // bytes from start of file
+        std::vector<PointT> points; // points kept in memory
+    };
+
+    struct Partition
+    {
+        std::filesystem::path path;
+        std::ofstream file;
+        bool failed = false;
+        std::vector<Batch> batches;
+        std::mutex mutex;
+    };
+
+    std::unique_ptr<Partition[]> partitions;
+    int nLevels = 0;
+    float bmin[PointT::dim];
+    float bmax[PointT::dim];
+    int axes[32]; // split axis of each level
+    std::atomic<uint64_t> nPoints = 0;
+
+    int nPartitions() const { return partitions != nullptr ? 1 << nLevels : 0; }
+
+    // index of the partition containing point
+    int getPartition(const PointT &point) const
+    {
+        float lo[PointT::dim];
+        float hi[PointT::dim];
+        std::copy(bmin, bmin + PointT::dim, lo);
+        std::copy(bmax, bmax + PointT::dim, hi);
+        int partition = 0;
+        for (int l = 0; l < nLevels; ++l)
+        {
+            const int axis = axes[l];
+            const float mid = 0.5f * (lo[axis] + hi[axis]);
+            partition <<= 1;
+            if (point[axis] < mid)
+            {
+                hi[axis] = mid;
+            }
+            else
+            {
+                lo[axis] = mid;
+                partition |= 1;
+            }
+        }
+        return partition;
+    }
+
+public:
+    PhotonSpill() {}
+    ~PhotonSpill() { clear(); }
+
+    PhotonSpill(const PhotonSpill &) = delete;
+    PhotonSpill &operator=(const PhotonSpill &) = delete;
+
+    bool isOpen() const { return partitions != nullptr; }
+    int getNLevels() const { return nLevels; }
+    uint64_t getNPoints() const { return nPoints.load(std::memory_order_relaxed); }
+
+    // create files of 2^nLevels partitions in dir, return false on failure
+    // NOTE: dim values of bmin, bmax are read
+    bool open(const std::filesystem::path &dir, const std::string &name,
+              const float *bmin, const float *bmax, int nLevels)
+    {
+        clear();
+        this->nLevels = std::clamp(nLevels, 0, 16);
+        std::copy(bmin, bmin + PointT::dim, this->bmin);
+        std::copy(bmax, bmax + PointT::dim, this->bmax);
+
+        // boxes of a level have the same shape, split their largest extent
+        float extent[PointT::dim];
+        for (int d = 0; d < PointT::dim; ++d)
+        {
+            extent[d] = std::max(bmax[d] - bmin[d], 0.0f);
+        }
+        for (int l = 0; l < this->nLevels; ++l)
+        {
+            axes[l] = std::max_element(extent, extent + PointT::dim) - extent;
+            extent[axes[l]] *= 0.5f;
+        }
+
+        partitions = std::make_unique<Partition[]>(1 << this->nLevels);
+        for (int i = 0; i < nPartitions(); ++i)
+        {
+            Partition &partition = partitions[i];
+            partition.path = getUniquePath(dir, name, ".pmspill");
+            partition.file.open(partition.path, std::ios::binary);
+            if (!partition.file)
+            {
+                clear();
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // write photons of a batch into the files of their partitions
+    // NOTE: thread safe. a partition whose file fails keeps its batches in
+    // memory
+    template <typename PhotonU>
+    void write(const std::vector<PhotonU> &photons, int64_t key)
+    {
+        std::vector<std::vector<PointT>> points(nPartitions());
+        for (const PhotonU &photon : photons)
+        {
+            const PointT point(photon);
+            points[getPartition(point)].push_back(point);
+        }
+        for (int i = 0; i < nPartitions(); ++i)
+        {
+            if (points[i].empty())
+                continue;
+
+            Partition &partition = partitions[i];
+            std::lock_guard<std::mutex> lock(partition.mutex);
+            Batch batch;
+            batch.key = key;
+            batch.count = points[i].size();
+            batch.offset = 0;
+            if (!partition.failed)
+            {
+                batch.offset = partition.file.tellp();
+                partition.file.write(reinterpret_cast<const char *>(points[i].data()),
+                                     points[i].size() * sizeof(PointT));
+                partition.file.flush();
+                if (!partition.file)
+                {
+                    std::cout << "Warning: Failed to spill photons to "
+                              << partition.path.generic_string()
+                              << ", keeping them in memory" << std::endl;
+                    partition.failed = true;
+                }
+            }
+            if (partition.failed)
+            {
+                batch.points = std::move(points[i]);
+            }
+            partition.batches.push_back(std::move(batch));
+        }
+        nPoints.fetch_add(photons.size(), std::memory_order_relaxed);
+    }
+
+    // append points of a partition in order of batch keys, return false on
+    // failure
+    // NOTE: not thread safe
+    bool read(int i, std::vector<PointT> &points)
+    {
+        Partition &partition = partitions[i];
+        partition.file.flush();
+        std::stable_sort(partition.batches.begin(), partition.batches.end(),
+                         [](const Batch &b1, const Batch &b2)
+                         { return b1.key < b2.key; });
+
+        uint64_t n_points = 0;
+        for (const Batch &batch : partition.batches)
+        {
+            n_points += batch.count;
+        }
+        size_t at = points.size();
+        points.resize(at + n_points);
+
+        std::ifstream file(partition.path, std::ios::binary);
+        for (const Batch &batch : partition.batches)
+        {
+            if (batch.points.empty())
+            {
+                file.seekg(batch.offset);
+                file.read(reinterpret_cast<char *>(points.data() + at),
+                          batch.count * sizeof(PointT));
+            }
+            else
+            {
+                std::copy(batch.points.begin(), batch.points.end(),
+                          points.begin() + at);
+            }
+            at += batch.count;
+        }
+        return static_cast<bool>(file);
+    }
+
+    // close and remove files
+    void clear()
+    {
+        for (int i = 0; i < nPartitions(); ++i)
+        {
+            partitions[i].file.close();
+            std::error_code ec;
+            std::filesystem::remove(partitions[i].path, ec);
+        }
+        partitions.reset();
+        nLevels = 0;
+        nPoints = 0;
+    }
+};
+
+class PhotonMap
+{
+private:
+    // photons of one record format and their search structures
+    template <typename PhotonT>
+    struct PhotonStorage
+    {
+        std::vector<PhotonT> photons;
+        KdTree<PhotonT> kdtree;
+        LeftBalancedKdTree<PhotonT> leftBalancedTree;
+        BucketKdTree<PhotonT> bucketTree;
+        ChunkedKdTree<PhotonT> chunkedTree;
+
+        // photons of out-of-core layout spilled while tracing, see beginSpill
+        PhotonSpill<PhotonT> spill;
+
+        // photons of a persisted map, used instead of photons when set
+        const PhotonT *sharedPhotons = nullptr;
+        int nSharedPhotons = 0;
+
+        const PhotonT *data() const
+        {
+            return sharedPhotons != nullptr ? sharedPhotons : photons.data();
+        }
+        int size() const
+        {
+            return sharedPhotons != nullptr ? nSharedPhotons : photons.size();
+        }
+
+        void clear()
+        {
+            photons.clear();
+            sharedPhotons = nullptr;
+            nSharedPhotons = 0;
+        }
+
+        // arrays of photons and search structure of the given layout
+        PhotonMapSections getSections(const PhotonMapLayout &layout) const
+        {
+            PhotonMapSections sections;
+            sections[0] = PhotonMapSection(data(), size());
+            if (layout == PhotonMapLayout::BUCKETED)
+            {
+                sections[1] =
+                    PhotonMapSection(bucketTree.getNodes(), bucketTree.getNNodes());
+                sections[2] = PhotonMapSection(bucketTree.getBuckets(),
+                                               bucketTree.getNBuckets());
+            }
+            else if (layout == PhotonMapLayout::LEFT_BALANCED)
+            {
+                sections[1] = PhotonMapSection(leftBalancedTree.getAxes(),
+                                               leftBalancedTree.getNAxisBytes());
+            }
+            else if (layout == PhotonMapLayout::OUT_OF_CORE)
+            {
+                sections[1] = PhotonMapSection(chunkedTree.getAxes(),
+                                               chunkedTree.getNAxisBytes());
+                sections[2] = PhotonMapSection(chunkedTree.getNodes(),
+                                               chunkedTree.getNNodes());
+            }
+            else
+            {
+                sections[1] = PhotonMapSection(kdtree.getNodes(), kdtree.getNNodes());
+            }
+            return sections;
+        }
+
+        // use persisted arrays instead of building, returns false if they
+        // don't fit the given layout
+        // NOTE: arrays are referenced, not copied
+        bool setSections(const PhotonMapSections &sections,
+                         const PhotonMapLayout &layout)
+        {
+            using KdNode = typename KdTree<PhotonT>::Node;
+            using BucketNode = typename BucketKdTree<PhotonT>::Node;
+            using Bucket = typename BucketKdTree<PhotonT>::Bucket;
+            using ChunkNode = typename ChunkedKdTree<PhotonT>::Node;
+
+            const uint64_t n = sections[0].count;
+            const PhotonT *p = sections[0].get<PhotonT>(n);
+            if (p == nullptr || n > std::numeric_limits<int>::max())
+                return false;
+
+            if (layout == PhotonMapLayout::BUCKETED)
+            {
+                const uint64_t n_buckets = sections[2].count;
+                const BucketNode *nodes = sections[1].get<BucketNode>(
+                    n_buckets > 0 ? 2 * n_buckets - 1 : 0);
+                const Bucket *buckets = sections[2].get<Bucket>(n_buckets);
+                if (nodes == nullptr || buckets == nullptr)
+                    return false;
+                bucketTree.setTree(p, n, nodes, sections[1].count, buckets, n_buckets);
+            }
+            else if (layout == PhotonMapLayout::LEFT_BALANCED)
+            {
+                const uint8_t *axes = sections[1].get<uint8_t>((n + 3) / 4);
+                if (axes == nullptr)
+                    return false;
+                leftBalancedTree.setTree(p, n, axes);
+            }
+            else if (layout == PhotonMapLayout::OUT_OF_CORE)
+            {
+                const uint8_t *axes = sections[1].get<uint8_t>(sections[1].count);
+                const ChunkNode *nodes = sections[2].get<ChunkNode>(sections[2].count);
+                if (axes == nullptr || nodes == nullptr ||
+                    sections[1].count > std::numeric_limits<int>::max() ||
+                    sections[2].count > std::numeric_limits<int>::max() ||
+                    !ChunkedKdTree<PhotonT>::isValidTree(n, nodes, sections[2].count,
+                                                         sections[1].count))
+                    return false;
+                chunkedTree.setTree(p, n, nodes, sections[2].count, axes);
+            }
+            else
+            {
+                const KdNode *nodes = sections[1].get<KdNode>(sections[1].count);
+                if (nodes == nullptr || sections[1].count > n)
+                    return false;
+                kdtree.setTree(p, n, nodes, sections[1].count);
+            }
+
+            // NOTE: frees memory of photons, e.g. of photons just written out
+            // of core
+            std::vector<PhotonT>().swap(photons);
+            sharedPhotons = p;
+            nSharedPhotons = n;
+            return true;
+        }
+
+        // returns wall time of build in seconds
+        double build(const PhotonMapLayout &layout)
+        {
+            sharedPhotons = nullptr;
+            nSharedPhotons = 0;
+            if (layout == PhotonMapLayout::BUCKETED)
+            {
+                bucketTree.setPoints(photons.data(), photons.size());
+                bucketTree.buildTree();
+                return bucketTree.getBuildTime();
+            }
+            else if (layout == PhotonMapLayout::LEFT_BALANCED)
+            {
+                // NOTE: reorders photons
+                leftBalancedTree.setPoints(photons.data(), photons.size());
+                leftBalancedTree.buildTree();
+                return leftBalancedTree.getBuildTime();
+            }
+            else if (layout == PhotonMapLayout::OUT_OF_CORE)
+            {
+                // NOTE: reorders photons
+                chunkedTree.setPoints(photons.data(), photons.size());
+                chunkedTree.buildTree();
+                return chunkedTree.getBuildTime();
+            }
+            else
+            {
+                kdtree.setPoints(photons.data(), photons.size());
+                kdtree.buildTree();
+                return kdtree.getBuildTime();
+            }
+        }
+
+        void searchKNearest(const Vec3f &p, int k, KNNHeap &heap,
+                            const PhotonMapLayout &layout) const
+        {
+            if (layout == PhotonMapLayout::BUCKETED)
+            {
+                bucketTree.searchKNearest(p, k, heap);
+            }
+            else if (layout == PhotonMapLayout::LEFT_BALANCED)
+            {
+                leftBalancedTree.searchKNearest(p, k, heap);
+            }
+            else if (layout == PhotonMapLayout::OUT_OF_CORE)
+            {
+                chunkedTree.searchKNearest(p, k, heap);
+            }
+            else
+            {
+                kdtree.searchKNearest(p, k, heap);
+            }
+        }
+
+        template <typename Visitor>
+        void searchRadius(const Vec3f &p, float max_dist2, Visitor &&visitor,
+                          const PhotonMapLayout &layout) const
+        {
+            if (layout == PhotonMapLayout::BUCKETED)
+            {
+                bucketTree.searchRadius(p, max_dist2, std::forward<Visitor>(visitor));
+            }
+            else if (layout == PhotonMapLayout::LEFT_BALANCED)
+            {
+                leftBalancedTree.searchRadius(p, max_dist2,
+                                              std::forward<Visitor>(visitor));
+            }
+            else if (layout == PhotonMapLayout::OUT_OF_CORE)
+            {
+                chunkedTree.searchRadius(p, max_dist2, std::forward<Visitor>(visitor));
+            }
+            else
+            {
+                kdtree.searchRadius(p, max_dist2, std::forward<Visitor>(visitor));
+            }
+        }
+    };
+
+    PhotonFormat format = PhotonFormat::FULL;
+    PhotonMapLayout layout = PhotonMapLayout::KD_TREE;
+    PhotonStorage<Photon> fullStorage;
+    PhotonStorage<CompactPhoton> compactStorage;
+
+    // mapped file of a loaded photon map
+    MappedFile mappedFile;
+
+    // directory of the file photons of out-of-core layout are paged in from,
+    // empty to keep them in memory
+    std::filesystem::path outOfCoreDir;
+    std::string outOfCoreName;
+    // NOTE: created by the first build, removed with the map
+    std::filesystem::path outOfCoreFile;
+
+    // maximum number of levels of spill partitions
+    static constexpr int maxSpillLevels = 8;
+
+    void removeOutOfCoreFile()
+    {
+        if (outOfCoreFile.empty())
+            return;
+        std::error_code ec;
+        std::filesystem::remove(outOfCoreFile, ec);
+        outOfCoreFile.clear();
+    }
+
+    template <typename PhotonT>
+    bool beginSpill(PhotonStorage<PhotonT> &storage, const Vec3f &bmin,
+                    const Vec3f &bmax, int nExpectedPhotons)
+    {
+        storage.spill.clear();
+        const size_t max_resident_bytes = storage.chunkedTree.getMaxResidentBytes();
+        if (layout != PhotonMapLayout::OUT_OF_CORE || outOfCoreDir.empty() ||
+            max_resident_bytes == 0)
+            return false;
+
+        // NOTE: sized by photon paths, about one photon is stored per path
+        const uint64_t partition_size =
+            std::max<uint64_t>(max_resident_bytes / sizeof(PhotonT),
+                               storage.chunkedTree.getChunkSize());
+        int n_levels = 0;
+        while (n_levels < maxSpillLevels &&
+               (partition_size << n_levels) < static_cast<uint64_t>(nExpectedPhotons))
+        {
+            ++n_levels;
+        }
+
+        std::error_code ec;
+        std::filesystem::create_directories(outOfCoreDir, ec);
+        const float lo[3] = {bmin[0], bmin[1], bmin[2]};
+        const float hi[3] = {bmax[0], bmax[1], bmax[2]};
+        if (!storage.spill.open(outOfCoreDir, outOfCoreName, lo, hi, n_levels))
+        {
+            std::cout << "Warning: Failed to create spill files in "
+                      << outOfCoreDir.generic_string()
+                      << ", keeping photons in memory" << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    // build out-of-core tree of spilled photons one partition at a time into
+    // outOfCoreFile and map it, or build it in memory when writing fails
+    template <typename PhotonT>
+    void buildSpilled(PhotonStorage<PhotonT> &storage)
+    {
+        // NOTE: photons set meanwhile go after the spilled ones
+        storage.spill.write(storage.photons, std::numeric_limits<int64_t>::max());
+        std::vector<PhotonT>().swap(storage.photons);
+        storage.clear();
+        std::cout << "Photons:" << storage.spill.getNPoints() << std::endl;
+
+        std::error_code ec;
+        std::filesystem::create_directories(outOfCoreDir, ec);
+        if (outOfCoreFile.empty())
+        {
+            outOfCoreFile = getUniquePath(outOfCoreDir, outOfCoreName, ".pmchunks");
+        }
+
+        PhotonMapFileWriter writer;
+        bool paged =
+            writer.open(outOfCoreFile, sizeof(PhotonT)) &&
+            storage.chunkedTree.buildTree(
+                storage.spill.getNLevels(),
+                [&](int partition, std::vector<PhotonT> &photons)
+                { return storage.spill.read(partition, photons); },
+                [&](const std::vector<PhotonT> &photons)
+                { return writer.append(photons.data(), photons.size()); });
+        std::cout << "Kd-tree build time: " << storage.chunkedTree.getBuildTime()
+                  << "s" << std::endl;
+
+        MappedFile file;
+        if (paged)
+        {
+            PhotonMapSections sections = storage.getSections(layout);
+            sections[0] = PhotonMapSection(static_cast<const PhotonT *>(nullptr),
+                                           storage.chunkedTree.getNPoints());
+            paged = writer.close(getFileType(), PhotonMapKey(), sections) &&
+                    mapPhotonMapFile(outOfCoreFile, getFileType(), PhotonMapKey(),
+                                     file, sections) &&
+                    storage.setSections(sections, layout);
+        }
+        if (paged)
+        {
+            mappedFile = std::move(file);
+        }
+        else
+        {
+            std::cout << "Warning: Failed to write photons to "
+                      << outOfCoreFile.generic_string()
+                      << ", keeping them in memory" << std::endl;
+            storage.clear();
+            for (int i = 0; i < (1 << storage.spill.getNLevels()); ++i)
+            {
+                storage.spill.read(i, storage.photons);
+            }
+            storage.build(layout);
+        }
+        storage.spill.clear();
+    }
+
+    // type of photon map file, tells format and layout
+    uint32_t getFileType() const
+    {
+        return 0x100 | (static_cast<uint32_t>(format) << 4) |
+               static_cast<uint32_t>(layout);
+    }
+
+public:
+    PhotonMap() {}
+    ~PhotonMap()
+    {
+        // NOTE: unmapped first, files in use can't be removed on Windows
+        fullStorage.clear();
+        compactStorage.clear();
+        mappedFile.close();
+        removeOutOfCoreFile();
+    }
+
+    PhotonMap(const PhotonMap &) = delete;
+    PhotonMap &operator=(const PhotonMap &) = delete;
+
+    // NOTE: photons already set are converted to the new format(compact ones
+    // keep their quantization), so the map has to be built again
+    void setFormat(const PhotonFormat &format)
+    {
+        if (format == this->format)
+            return;
+
+        std::vector<Photon> photons(getNPhotons());
+        for (int i = 0; i < getNPhotons(); ++i)
+        {
+            photons[i] = getIthPhoton(i);
+        }
+        this->format = format;
+        if (!photons.empty())
+        {
+            setPhotons(photons);
+        }
+    }
+    PhotonFormat getFormat() const { return format; }
+
+    // NOTE: takes effect on next build
+    void setLayout(const PhotonMapLayout &layout) { this->layout = layout; }
+    PhotonMapLayout getLayout() const { return layout; }
+
+    // write photons of out-of-core layout into a file of dir named after name
+    // after build, and keep at most maxResidentBytes of photons in memory while
+    // searching
+    // NOTE: takes effect on next build, load. chunkSize is the number of
+    // photons of a chunk
+    void setOutOfCore(const std::filesystem::path &dir, const std::string &name,
+                      size_t maxResidentBytes, int chunkSize = 1 << 16)
+    {
+        if (dir != outOfCoreDir || name != outOfCoreName)
+        {
+            removeOutOfCoreFile();
+        }
+        outOfCoreDir = dir;
+        outOfCoreName = name;
+        fullStorage.chunkedTree.setMaxResidentBytes(maxResidentBytes);
+        fullStorage.chunkedTree.setChunkSize(chunkSize);
+        compactStorage.chunkedTree.setMaxResidentBytes(maxResidentBytes);
+        compactStorage.chunkedTree.setChunkSize(chunkSize);
+    }
+
+    // spill photons of out-of-core layout into partitions of the given bounds
+    // while they are traced, so that the next build holds one partition at a
+    // time. returns false if photons stay in memory(other layouts, no
+    // out-of-core directory or resident limit)
+    // NOTE: partitions are sized to the resident limit by the expected number
+    // of photons, at most 2^8 of them
+    bool beginSpill(const Vec3f &bmin, const Vec3f &bmax, int nExpectedPhotons)
+    {
+        return format == PhotonFormat::COMPACT
+                   ? beginSpill(compactStorage, bmin, bmax, nExpectedPhotons)
+                   : beginSpill(fullStorage, bmin, bmax, nExpectedPhotons);
+    }
+
+    // move photons of a thread buffer into the spill, firstPath is the index
+    // of the first path traced into the buffer
+    // NOTE: thread safe
+    void spillPhotons(std::vector<Photon> &photons, int firstPath)
+    {
+        if (format == PhotonFormat::COMPACT)
+        {
+            compactStorage.spill.write(photons, firstPath);
+        }
+        else
+        {
+            fullStorage.spill.write(photons, firstPath);
+        }
+        photons.clear();
+    }
+
+    int getNPhotons() const
+    {
+        return format == PhotonFormat::COMPACT ? compactStorage.size()
+                                               : fullStorage.size();
+    }
+
+    // NOTE: compact photons are decoded on access
+    Photon getIthPhoton(int i) const
+    {
+        if (format == PhotonFormat::COMPACT)
+        {
+            return compactStorage.data()[i].toPhoton();
+        }
+        return fullStorage.data()[i];
+    }
+
+    // NOTE: discards photons of a loaded photon map
+    void addPhoton(const Photon &photon)
+    {
+        if (mappedFile.isOpen())
+        {
+            fullStorage.clear();
+            compactStorage.clear();
+            mappedFile.close();
+        }
+        if (format == PhotonFormat::COMPACT)
+        {
+            compactStorage.photons.emplace_back(photon);
+        }
+        else
+        {
+            fullStorage.photons.push_back(photon);
+        }
+    }
+
+    void setPhotons(const std::vector<Photon> &photons)
+    {
+        fullStorage.clear();
+        compactStorage.clear();
+        mappedFile.close();
+        if (format == PhotonFormat::COMPACT)
+        {
+            compactStorage.photons.assign(photons.begin(), photons.end());
+        }
+        else
+        {
+            fullStorage.photons = photons;
+        }
+    }
+
+    // merge photon buffers filled by each thread, in the given order
+    void setPhotons(const std::vector<std::vector<Photon>> &photonBuffers)
+    {
+        size_t nPhotons = 0;
+        for (const auto &buffer : photonBuffers)
+        {
+            nPhotons += buffer.size();
+        }
+
+        fullStorage.clear();
+        compactStorage.clear();
+        mappedFile.close();
+        if (format == PhotonFormat::COMPACT)
+        {
+            compactStorage.photons.reserve(nPhotons);
+            for (const auto &buffer : photonBuffers)
+            {
+                compactStorage.photons.insert(compactStorage.photons.end(),
+                                              buffer.begin(), buffer.end());
+            }
+        }
+        else
+        {
+            fullStorage.photons.reserve(nPhotons);
+            for (const auto &buffer : photonBuffers)
+            {
+                fullStorage.photons.insert(fullStorage.photons.end(),
+                                           buffer.begin(), buffer.end());
+            }
+        }
+    }
+
+    // NOTE: photons spilled since beginSpill are read back and built out of
+    // core, together with the photons set
+    void build()
+    {
+        if (format == PhotonFormat::COMPACT && compactStorage.spill.isOpen())
+        {
+            buildSpilled(compactStorage);
+            return;
+        }
+        if (format == PhotonFormat::FULL && fullStorage.spill.isOpen())
+        {
+            buildSpilled(fullStorage);
+            return;
+        }
+
+        std::cout << "Photons:" << getNPhotons() << std::endl;
+        const double build_time = format == PhotonFormat::COMPACT
+                                      ? compactStorage.build(layout)
+                                      : fullStorage.build(layout);
+        std::cout << "Kd-tree build time: " << build_time << "s" << std::endl;
+
+        // page photons out, they are read back by chunk while searching
+        if (layout == PhotonMapLayout::OUT_OF_CORE && !outOfCoreDir.empty())
+        {
+            std::error_code ec;
+            std::filesystem::create_directories(outOfCoreDir, ec);
+            if (outOfCoreFile.empty())
+            {
+                outOfCoreFile = getUniquePath(outOfCoreDir, outOfCoreName, ".pmchunks");
+            }
+
+            MappedFile file;
+            PhotonMapSections sections;
+            const bool paged =
+                save(outOfCoreFile, PhotonMapKey()) &&
+                mapPhotonMapFile(outOfCoreFile, getFileType(), PhotonMapKey(), file,
+                                 sections) &&
+                (format == PhotonFormat::COMPACT
+                     ? compactStorage.setSections(sections, layout)
+                     : fullStorage.setSections(sections, layout));
+            if (paged)
+            {
+                mappedFile = std::move(file);
+            }
+            else
+            {
+                std::cout << "Warning: Failed to write photons to "
+                          << outOfCoreFile.generic_string()
+                          << ", keeping them in memory" << std::endl;
+            }
+        }
+    }
+
+    // write built photon map to file, return false on failure
+    bool save(const std::filesystem::path &filepath, const PhotonMapKey &key) const
+    {
+        const PhotonMapSections sections =
+            format == PhotonFormat::COMPACT ? compactStorage.getSections(layout)
+                                            : fullStorage.getSections(layout);
+        return writePhotonMapFile(filepath, getFileType(), key, sections);
+    }
+
+    // map photon map saved with the same key, format and layout instead of
+    // building it, return false if there is none
+    // NOTE: photons and kd-tree are searched in the mapped file
+    bool load(const std::filesystem::path &filepath, const PhotonMapKey &key)
+    {
+        fullStorage.clear();
+        compactStorage.clear();
+
+        PhotonMapSections sections;
+        if (!mapPhotonMapFile(filepath, getFileType(), key, mappedFile, sections))
+            return false;
+
+        const bool loaded = format == PhotonFormat::COMPACT
+                                ? compactStorage.setSections(sections, layout)
+                                : fullStorage.setSections(sections, layout);
+        if (!loaded)
+        {
+            mappedFile.close();
+            return false;
+        }
+
+        std::cout << "Photons:" << getNPhotons() << std::endl;
+        return true;
+    }
+
+    std::vector<int> queryKNearestPhotons(const Vec3f &p, int k,
+                                          float &max_dist2) const
+    {
+        KNNHeap heap(k);
+        queryKNearestPhotons(p, k, heap);
+
+        std::vector<int> ret(heap.size());
+        max_dist2 = 0;
+        for (int i = 0; i < ret.size(); ++i)
+        {
+            ret[i] = heap[i].second;
+            max_dist2 = std::max(max_dist2, heap[i].first);
+        }
+
+        return ret;
+    }
+
+    // query k-nearest photons into caller-owned storage
+    void queryKNearestPhotons(const Vec3f &p, int k, KNNHeap &heap) const
+    {
+        PM_STATS_ADD(knnQueries, 1);
+        if (format == PhotonFormat::COMPACT)
+        {
+            compactStorage.searchKNearest(p, k, heap, layout);
+        }
+        else
+        {
+            fullStorage.searchKNearest(p, k, heap, layout);
+        }
+    }
+
+    // visit photons within sqrt(max_dist2) from p with visitor(index, dist2)
+    template <typename Visitor>
+    void queryRadius(const Vec3f &p, float max_dist2, Visitor &&visitor) const
+    {
+        PM_STATS_ADD(radiusQueries, 1);
+        if (format == PhotonFormat::COMPACT)
+        {
+            compactStorage.searchRadius(p, max_dist2,
+                                        std::forward<Visitor>(visitor), layout);
+        }
+        else
+        {
+            fullStorage.searchRadius(p, max_dist2, std::forward<Visitor>(visitor),
+                                     layout);
+        }
+    }
+
+    // query k-nearest photons of many points, callback(query index, heap) is
+    // called once per point
+    // NOTE: points are answered in morton order, so that consecutive
+    // descents hit kd-tree nodes which are still in cache
+    template <typename Callback>
+    void queryKNearestPhotonsBatch(const Vec3f *points, int n_points, int k,
+                                   Callback &&callback) const
+    {
+        thread_local std::vector<int> order;
+        thread_local KNNHeap heap;
+        mortonOrder(points, n_points, order);
+        for (const int query_idx : order)
+        {
+            queryKNearestPhotons(points[query_idx], k, heap);
+            callback(query_idx, static_cast<const KNNHeap &>(heap));
+        }
+    }
+
+    // visit photons within sqrt(max_dist2) from each of many points with
+    // visitor(query index, photon index, dist2)
+    // NOTE: points are answered in morton order
+    template <typename Visitor>
+    void queryRadiusBatch(const Vec3f *points, int n_points, float max_dist2,
+                          Visitor &&visitor) const
+    {
+        thread_local std::vector<int> order;
+        mortonOrder(points, n_points, order);
+        for (const int query_idx : order)
+        {
+            queryRadius(points[query_idx], max_dist2,
+                        [&](int photon_idx, float dist2)
+                        { visitor(query_idx, photon_idx, dist2); });
+        }
+    }
+};
+
+// precomputed irradiance at a photon position
+struct IrradiancePhoton
+{
+    Vec3f position;
+    Vec3f normal;      // shading normal at position
+    Vec3f irradiance;  // estimated from global photon map
+    float radius2 = 0; // squared radius of the estimate
+
+    // implementation of Point concept
+    static constexpr int dim = 3;
+    float operator[](int i) const { return position[i]; }
+
+    IrradiancePhoton() {}
+    IrradiancePhoton(const Vec3f &position, const Vec3f &normal)
+        : position(position), normal(normal) {}
+};
+
+// precomputed irradiance on a subset of photon positions
+// NOTE: lookup is a single nearest neighbor query with similar normal instead of
+// a full radiance estimate
+// Christensen, Per H. Faster photon map global illumination. Journal of
+// Graphics Tools, 1999.
+class IrradianceCache
+{
+private:
+    std::vector<IrradiancePhoton> points;
+    KdTree<IrradiancePhoton> kdtree;
+
+    // points of a loaded cache, used instead of points when set
+    MappedFile mappedFile;
+    const IrradiancePhoton *sharedPoints = nullptr;
+    int nSharedPoints = 0;
+
+    // type of photon map file
+    static constexpr uint32_t fileType = 0x200;
+
+    const IrradiancePhoton *getPoints() const
+    {
+        return sharedPoints != nullptr ? sharedPoints : points.data();
+    }
+
+    // number of neighbors searched for a point with similar normal
+    static constexpr int nCandidates = 8;
+
+    // minimum cosine between normals of query and cached point
+    static constexpr float minNormalCos = 0.9f;
+
+public:
+    IrradianceCache() {}
+
+    bool empty() const { return getNPoints() == 0; }
+    void clear()
+    {
+        points.clear();
+        kdtree = KdTree<IrradiancePhoton>();
+        sharedPoints = nullptr;
+        nSharedPoints = 0;
+        mappedFile.close();
+    }
+
+    int getNPoints() const
+    {
+        return sharedPoints != nullptr ? nSharedPoints : points.size();
+    }
+    IrradiancePhoton &getIthPoint(int i) { return points[i]; }
+
+    void setPoints(const std::vector<IrradiancePhoton> &points)
+    {
+        clear();
+        this->points = points;
+    }
+
+    // merge point buffers filled by each thread, in the given order
+    void setPoints(const std::vector<std::vector<IrradiancePhoton>> &pointBuffers)
+    {
+        clear();
+        for (const auto &buffer : pointBuffers)
+        {
+            points.insert(points.end(), buffer.begin(), buffer.end());
+        }
+    }
+
+    void build()
+    {
+        std::cout << "Irradiance photons:" << points.size() << std::endl;
+        kdtree.setPoints(points.data(), points.size());
+        kdtree.buildTree();
+    }
+
+    // write built cache to file, return false on failure
+    bool save(const std::filesystem::path &filepath, const PhotonMapKey &key) const
+    {
+        PhotonMapSections sections;
+        sections[0] = PhotonMapSection(getPoints(), getNPoints());
+        sections[1] = PhotonMapSection(kdtree.getNodes(), kdtree.getNNodes());
+        return writePhotonMapFile(filepath, fileType, key, sections);
+    }
+
+    // map cache saved with the same key instead of computing it, return false
+    // if there is none
+    bool load(const std::filesystem::path &filepath, const PhotonMapKey &key)
+    {
+        clear();
+
+        PhotonMapSections sections;
+        if (!mapPhotonMapFile(filepath, fileType, key, mappedFile, sections))
+            return false;
+
+        const uint64_t n = sections[0].count;
+        const IrradiancePhoton *p = sections[0].get<IrradiancePhoton>(n);
+        const KdTree<IrradiancePhoton>::Node *nodes =
+            sections[1].get<KdTree<IrradiancePhoton>::Node>(sections[1].count);
+        if (p == nullptr || nodes == nullptr || n > std::numeric_limits<int>::max() ||
+            sections[1].count > n)
+        {
+            clear();
+            return false;
+        }
+
+        sharedPoints = p;
+        nSharedPoints = n;
+        kdtree.setTree(p, n, nodes, sections[1].count);
+        std::cout << "Irradiance photons:" << getNPoints() << std::endl;
+        return true;
+    }
+
+    // look up irradiance of the nearest point with similar normal whose estimate
+    // covers the query point
+    // returns false if no such point was found
+    bool lookup(const Vec3f &p, const Vec3f &n, Vec3f &irradiance) const
+    {
+        PM_STATS_ADD(irradianceLookups, 1);
+        thread_local KNNHeap heap;
+        kdtree.searchKNearest(p, nCandidates, heap);
+
+        int nearest_idx = -1;
+        float nearest_dist2 = std::numeric_limits<float>::infinity();
+        for (const auto &[dist2, idx] : heap)
+        {
+            const IrradiancePhoton &point = getPoints()[idx];
+            if (dist2 < nearest_dist2 && dist2 <= point.radius2 &&
+                dot(point.normal, n) > minNormalCos)
+            {
+                nearest_idx = idx;
+                nearest_dist2 = dist2;
+            }
+        }
+
+        if (nearest_idx == -1)
+            return false;
+        irradiance = getPoints()[nearest_idx].irradiance;
+        return true;
     }
 };
 
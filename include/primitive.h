@@ -1,7 +1,6 @@
 #ifndef _PRIMITIVE_H
 #define _PRIMITIVE_H
 #include <cmath>
-#include <memory>
 
 #include "light.h"
 #include "material.h"
@@ -9,16 +8,17 @@
 
 // primitive provides an abstraction layer of the object's shape(triangle),
 // material, area light
+// NOTE: material and light are entries of the flat tables owned by the scene
 class Primitive
 {
 private:
     const Triangle *triangle;
-    const std::shared_ptr<BxDF> bxdf;
-    const std::shared_ptr<Light> areaLight;
+    const Material *bxdf;
+    const AreaLight *areaLight;
 
 public:
-    Primitive(const Triangle *triangle, const std::shared_ptr<BxDF> &bxdf,
-              const std::shared_ptr<Light> &areaLight = nullptr)
+    Primitive(const Triangle *triangle, const Material *bxdf,
+              const AreaLight *areaLight = nullptr)
         : triangle(triangle), bxdf(bxdf), areaLight(areaLight) {}
 
     bool hasAreaLight() const { return areaLight != nullptr; }
@@ -66,7 +66,7 @@ public:
     }
 
     // get all samplable direction
-    std::vector<DirectionPair> sampleAllBxDF(
+    DirectionPairs sampleAllBxDF(
         const Vec3f &wo, const SurfaceInfo &surfInfo,
         const TransportDirection &mode) const
     {
@@ -75,7 +75,7 @@ public:
             worldToLocal(wo, surfInfo.dpdu, surfInfo.shadingNormal, surfInfo.dpdv);
 
         // sample all direction in tangent space
-        std::vector<DirectionPair> dir_pairs = bxdf->sampleAllDirection(wo_l, mode);
+        DirectionPairs dir_pairs = bxdf->sampleAllDirection(wo_l, mode);
 
         // local to world transform
         for (auto &dp : dir_pairs)
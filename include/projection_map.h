@@ -0,0 +1,85 @@
+#ifndef _PROJECTION_MAP_H
+#define _PROJECTION_MAP_H
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include "geometry.h"
+#include "sampler.h"
+
+// importance of emission directions of one light
+// NOTE: cells partition the 2D primary sample space of
+// Light::sampleDirection, so that any direction sampling scheme can be
+// steered without knowing its parametrization
+// Jensen, Henrik Wann. Realistic image synthesis using photon mapping, 2001.
+// Section 5.2
+class ProjectionMap
+{
+public:
+    // number of cells along each axis of primary sample space
+    static constexpr int resolution = 16;
+    static constexpr int nCells = resolution * resolution;
+
+private:
+    AliasTable distribution;
+
+public:
+    ProjectionMap() {}
+
+    // NOTE: weights are given per cell in row major order
+    ProjectionMap(const std::vector<float> &weights) : distribution(weights) {}
+
+    bool empty() const { return distribution.empty(); }
+
+    static int cellIndex(const Vec2f &u)
+    {
+        const int x = std::min(static_cast<int>(u[0] * resolution), resolution - 1);
+        const int y = std::min(static_cast<int>(u[1] * resolution), resolution - 1);
+        return x + resolution * y;
+    }
+
+    // return uniform point in the given cell
+    static Vec2f cellToSample(int cell, const Vec2f &jitter)
+    {
+        return Vec2f((cell % resolution + jitter[0]) / resolution,
+                     (cell / resolution + jitter[1]) / resolution);
+    }
+
+    // sample primary sample proportional to cell weights
+    // NOTE: pdf is relative to the uniform distribution over [0, 1]^2
+    Vec2f sample(Sampler &sampler, float &pdf) const
+    {
+        float cell_pdf;
+        const int cell = distribution.sample(sampler.getNext1D(), cell_pdf);
+        pdf = cell_pdf * nCells;
+        return cellToSample(cell, sampler.getNext2D());
+    }
+
+    // grow marked cells by one cell in each direction
+    // NOTE: makes marking by a finite number of probe rays conservative. wraps
+    // around edges, since sample spaces are often periodic(e.g. azimuth)
+    static std::vector<float> dilate(const std::vector<float> &weights)
+    {
+        std::vector<float> ret(nCells, 0);
+        for (int y = 0; y < resolution; ++y)
+        {
+            for (int x = 0; x < resolution; ++x)
+            {
+                float w = 0;
+                for (int dy = -1; dy <= 1; ++dy)
+                {
+                    for (int dx = -1; dx <= 1; ++dx)
+                    {
+                        const int nx = (x + dx + resolution) % resolution;
+                        const int ny = (y + dy + resolution) % resolution;
+                        w = std::max(w, weights[nx + resolution * ny]);
+                    }
+                }
+                ret[x + resolution * y] = w;
+            }
+        }
+        return ret;
+    }
+};
+
+#endif
@@ -0,0 +1,683 @@
+#ifndef _RENDERER_H
+#define _RENDERER_H
+#include <omp.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <vector>
+
+#include "camera.h"
+#include "distributed.h"
+#include "geometry.h"
+#include "image.h"
+#include "integrator.h"
+#include "sampler.h"
+#include "scene.h"
+
+// hands out tiles to worker threads
+// tiles are ordered along the morton curve and split into contiguous ranges, one
+// per worker. each worker takes tiles from the front of its own range, and steals
+// from the back of other ranges when its own range runs out
+// NOTE: with several ranks, each rank keeps every nRanks-th tile along the
+// curve, so that ranks get tiles evenly spread over the image
+class TileScheduler
+{
+private:
+    std::vector<Tile> tiles;
+
+    // range of tiles owned by each worker
+    // NOTE: [begin, end) packed into 64 bits, so that taking and stealing a tile
+    // is a single compare and swap
+    struct alignas(64) WorkerRange
+    {
+        std::atomic<uint64_t> range;
+    };
+    std::unique_ptr<WorkerRange[]> ranges;
+    int nWorkers;
+
+    static uint64_t pack(uint32_t begin, uint32_t end)
+    {
+        return (static_cast<uint64_t>(end) << 32) | begin;
+    }
+
+    // take tile from the front of the given range
+    bool popFront(int worker, Tile &tile)
+    {
+        std::atomic<uint64_t> &range = ranges[worker].range;
+        uint64_t r = range.load();
+        while (true)
+        {
+            const uint32_t begin = r & 0xffffffff;
+            const uint32_t end = r >> 32;
+            if (begin >= end)
+                return false;
+            if (range.compare_exchange_weak(r, pack(begin + 1, end)))
+            {
+                tile = tiles[begin];
+                return true;
+            }
+        }
+    }
+
+    // take tile from the back of the given range
+    bool popBack(int worker, Tile &tile)
+    {
+        std::atomic<uint64_t> &range = ranges[worker].range;
+        uint64_t r = range.load();
+        while (true)
+        {
+            const uint32_t begin = r & 0xffffffff;
+            const uint32_t end = r >> 32;
+            if (begin >= end)
+                return false;
+            if (range.compare_exchange_weak(r, pack(begin, end - 1)))
+            {
+                tile = tiles[end - 1];
+                return true;
+            }
+        }
+    }
+
+public:
+    TileScheduler(int width, int height, int tileSize, int nWorkers,
+                  int rank = 0, int nRanks = 1)
+        : nWorkers(nWorkers)
+    {
+        // split image into tiles
+        const int n_tiles_x = (width + tileSize - 1) / tileSize;
+        const int n_tiles_y = (height + tileSize - 1) / tileSize;
+        std::vector<std::pair<uint32_t, Tile>> morton_tiles;
+        for (int ty = 0; ty < n_tiles_y; ++ty)
+        {
+            for (int tx = 0; tx < n_tiles_x; ++tx)
+            {
+                Tile tile;
+                tile.i0 = ty * tileSize;
+                tile.i1 = std::min(tile.i0 + tileSize, height);
+                tile.j0 = tx * tileSize;
+                tile.j1 = std::min(tile.j0 + tileSize, width);
+                morton_tiles.emplace_back(mortonEncode2D(tx, ty), tile);
+            }
+        }
+
+        // sort tiles in morton order
+        std::sort(morton_tiles.begin(), morton_tiles.end(),
+                  [](const auto &t1, const auto &t2)
+                  { return t1.first < t2.first; });
+        for (int t = rank; t < morton_tiles.size(); t += nRanks)
+        {
+            tiles.push_back(morton_tiles[t].second);
+        }
+
+        // give each worker a contiguous range of tiles
+        ranges = std::make_unique<WorkerRange[]>(nWorkers);
+        const size_t n_tiles = tiles.size();
+        for (int w = 0; w < nWorkers; ++w)
+        {
+            const uint32_t begin = n_tiles * w / nWorkers;
+            const uint32_t end = n_tiles * (w + 1) / nWorkers;
+            ranges[w].range.store(pack(begin, end));
+        }
+    }
+
+    int getNTiles() const { return tiles.size(); }
+
+    // number of pixels of all tiles
+    int getNPixels() const
+    {
+        int n_pixels = 0;
+        for (const auto &tile : tiles)
+        {
+            n_pixels += (tile.i1 - tile.i0) * (tile.j1 - tile.j0);
+        }
+        return n_pixels;
+    }
+
+    // get next tile for the given worker
+    // returns false when all tiles have been handed out
+    bool next(int worker, Tile &tile)
+    {
+        if (popFront(worker, tile))
+            return true;
+
+        // steal from other workers
+        for (int k = 1; k < nWorkers; ++k)
+        {
+            if (popBack((worker + k) % nWorkers, tile))
+                return true;
+        }
+        return false;
+    }
+};
+
+// running mean and variance of radiance samples of a pixel
+// NOTE: variance is tracked on luminance with Welford's online algorithm
+struct PixelStatistics
+{
+    Vec3f mean;
+    float meanLuminance = 0;
+    float m2 = 0; // sum of squared differences from mean luminance
+    int n = 0;
+
+    // keeps relative error of black pixels finite
+    static constexpr float epsilon = 1e-3f;
+
+    void add(const Vec3f &L)
+    {
+        ++n;
+        mean += (L - mean) / n;
+        const float y = luminance(L);
+        const float delta = y - meanLuminance;
+        meanLuminance += delta / n;
+        m2 += delta * (y - meanLuminance);
+    }
+
+    // standard error of mean luminance relative to mean luminance
+    float getRelativeError() const
+    {
+        if (n < 2)
+            return std::numeric_limits<float>::infinity();
+        const float variance = m2 / (n - 1);
+        return std::sqrt(variance / n) / (meanLuminance + epsilon);
+    }
+};
+
+// renders image tile by tile
+class Renderer
+{
+public:
+    // adaptive sampling spends at most this many times SPP on a pixel
+    static constexpr int maxSamplesMultiplier = 4;
+
+private:
+    // scratch buffers reused by each tile of a render thread
+    struct TileScratch
+    {
+        // clones of sampler of renderer
+        std::unique_ptr<Sampler> sampler;     // per pixel
+        std::unique_ptr<Sampler> tileSampler; // wavefront integration of tile
+
+        std::vector<Vec3f> radiance; // per pixel of tile
+
+        // camera rays of wavefront rendering
+        std::vector<Ray> rays;
+        std::vector<float> pdfs;
+        std::vector<int> pixels; // index of pixel in tile
+        std::vector<Vec3f> rayRadiance;
+
+        // adaptive sampling
+        std::vector<PixelStatistics> stats;
+        std::vector<int> sampleCounts;      // samples of each pixel in current round
+        std::vector<std::pair<float, int>> active; // error and pixel index
+        std::vector<Vec3f> sampleMap;       // total samples of each pixel
+        uint64_t nSamplesTaken = 0;
+    };
+
+    // maximum number of camera rays handed to integrateN at once
+    // NOTE: batches never span tiles, so a wavefront batch holds
+    // min(tile pixels x SPP, maxBatchRays) rays
+    static constexpr int maxBatchRays = 1 << 16;
+
+    int tileSize;
+    std::unique_ptr<Sampler> sampler = std::make_unique<UniformSampler>();
+    double renderTime = 0; // wall time of last render in seconds
+    int nTilesRendered = 0;
+
+    // relative error pixels are sampled down to, 0 disables adaptive sampling
+    float adaptiveThreshold = 0;
+    ImageWriter *sampleMapWriter = nullptr;
+    double averageSamples = 0; // per pixel of last render
+
+    // ranks sharing tiles, nullptr to render every tile here
+    const Communicator *communicator = nullptr;
+
+    // render one tile, sum of radiance samples is left in scratch
+    void renderTile(const Tile &tile, const Integrator &integrator,
+                    const Scene &scene, const Camera &camera, int nSamples,
+                    int width, int height, TileScratch &scratch) const
+    {
+        const int tile_width = tile.j1 - tile.j0;
+        std::vector<Vec3f> &radiance = scratch.radiance;
+        radiance.assign(tileSize * tileSize, Vec3f(0));
+
+        // sampler of this tile, started per pixel sample
+        Sampler &sampler = *scratch.sampler;
+
+        for (int i = tile.i0; i < tile.i1; ++i)
+        {
+            for (int j = tile.j0; j < tile.j1; ++j)
+            {
+                Vec3f &sum = radiance[(i - tile.i0) * tile_width + (j - tile.j0)];
+                for (int k = 0; k < nSamples; ++k)
+                {
+                    sampler.startPixelSample(j + width * i, k);
+                    PM_STATS_ADD(cameraSamples, 1);
+                    const float u = (2.0f * (j + sampler.getNext1D()) - width) / height;
+                    const float v = (2.0f * (i + sampler.getNext1D()) - height) / height;
+
+                    Ray ray;
+                    float pdf;
+                    if (camera.sampleRay(Vec2f(u, v), ray, pdf))
+                    {
+                        const Vec3f L = integrator.integrate(ray, scene, sampler) / pdf;
+
+                        if (!isValidRadiance(L, i, j))
+                            continue;
+
+                        sum += L;
+                    }
+                    else
+                    {
+                        sum = Vec3f(0);
+                    }
+                }
+            }
+        }
+    }
+
+    // render one tile by handing all camera rays of the tile to the integrator
+    // at once
+    // NOTE: camera rays whose sampling failed are skipped
+    void renderTileWavefront(const Tile &tile, const Integrator &integrator,
+                             const Scene &scene, const Camera &camera,
+                             int nSamples, int width, int height,
+                             TileScratch &scratch) const
+    {
+        const int tile_width = tile.j1 - tile.j0;
+        const int n_pixels = tile_width * (tile.i1 - tile.i0);
+        std::vector<Vec3f> &radiance = scratch.radiance;
+        radiance.assign(tileSize * tileSize, Vec3f(0));
+
+        // camera rays are sampled per pixel, integration of each batch takes
+        // the stream of tile
+        Sampler &sampler = *scratch.sampler;
+        Sampler &tile_sampler = *scratch.tileSampler;
+        const uint64_t tile_stream = getTileStream(tile, width, height);
+
+        // split samples into batches of bounded size
+        const int samples_per_batch =
+            std::clamp(maxBatchRays / n_pixels, 1, nSamples);
+        for (int k0 = 0; k0 < nSamples; k0 += samples_per_batch)
+        {
+            const int k1 = std::min(k0 + samples_per_batch, nSamples);
+
+            // generate camera rays
+            scratch.rays.clear();
+            scratch.pdfs.clear();
+            scratch.pixels.clear();
+            for (int i = tile.i0; i < tile.i1; ++i)
+            {
+                for (int j = tile.j0; j < tile.j1; ++j)
+                {
+                    for (int k = k0; k < k1; ++k)
+                    {
+                        sampler.startPixelSample(j + width * i, k);
+                        PM_STATS_ADD(cameraSamples, 1);
+                        const float u = (2.0f * (j + sampler.getNext1D()) - width) / height;
+                        const float v = (2.0f * (i + sampler.getNext1D()) - height) / height;
+
+                        Ray ray;
+                        float pdf;
+                        if (camera.sampleRay(Vec2f(u, v), ray, pdf))
+                        {
+                            scratch.rays.push_back(ray);
+                            scratch.pdfs.push_back(pdf);
+                            scratch.pixels.push_back((i - tile.i0) * tile_width +
+                                                     (j - tile.j0));
+                        }
+                    }
+                }
+            }
+
+            const int n_rays = scratch.rays.size();
+            scratch.rayRadiance.resize(n_rays);
+            tile_sampler.startPixelSample(tile_stream, k0);
+            integrator.integrateN(scratch.rays.data(), n_rays, scene, tile_sampler,
+                                  scratch.rayRadiance.data());
+
+            for (int r = 0; r < n_rays; ++r)
+            {
+                const Vec3f L = scratch.rayRadiance[r] / scratch.pdfs[r];
+                const int i = tile.i0 + scratch.pixels[r] / tile_width;
+                const int j = tile.j0 + scratch.pixels[r] % tile_width;
+                if (!isValidRadiance(L, i, j))
+                    continue;
+
+                radiance[scratch.pixels[r]] += L;
+            }
+        }
+    }
+
+    // stream of samples of wavefront integration in the tile
+    // NOTE: comes after the streams of pixels
+    static uint64_t getTileStream(const Tile &tile, int width, int height)
+    {
+        return static_cast<uint64_t>(width) * height + tile.j0 +
+               static_cast<uint64_t>(width) * tile.i0;
+    }
+
+    // check radiance sample, print error when invalid
+    static bool isValidRadiance(const Vec3f &L, int i, int j)
+    {
+        if (std::isnan(L[0]) || std::isnan(L[1]) || std::isnan(L[2]))
+        {
+            std::cout << "Error: Radiance of pixel [" << i << "," << j << "] is NaN!" << std::endl;
+            return false;
+        }
+        else if (L[0] < 0 || L[1] < 0 || L[2] < 0)
+        {
+            std::cout << "Error: Radiance of pixel [" << i << "," << j << "] is minus!" << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    // take scratch.sampleCounts[p] more samples of each pixel p of the tile
+    // NOTE: invalid samples and failed camera rays count as zero radiance, as they
+    // do in the sum of the other modes
+    void takeSamples(const Tile &tile, const Integrator &integrator,
+                     const Scene &scene, const Camera &camera, int width,
+                     int height, int round, TileScratch &scratch) const
+    {
+        const int tile_width = tile.j1 - tile.j0;
+        const int n_pixels = tile_width * (tile.i1 - tile.i0);
+        Sampler &sampler = *scratch.sampler;
+        Sampler &tile_sampler = *scratch.tileSampler;
+
+        // integrate rays of wavefront batch at once
+        // NOTE: batches of a round take consecutive samples of the tile stream
+        const uint64_t tile_stream = getTileStream(tile, width, height);
+        uint32_t batch = static_cast<uint32_t>(round) << 16;
+        const auto flush = [&]()
+        {
+            const int n_rays = scratch.rays.size();
+            scratch.rayRadiance.resize(n_rays);
+            tile_sampler.startPixelSample(tile_stream, batch++);
+            integrator.integrateN(scratch.rays.data(), n_rays, scene, tile_sampler,
+                                  scratch.rayRadiance.data());
+            for (int r = 0; r < n_rays; ++r)
+            {
+                const int p = scratch.pixels[r];
+                const Vec3f L = scratch.rayRadiance[r] / scratch.pdfs[r];
+                const bool valid = isValidRadiance(L, tile.i0 + p / tile_width,
+                                                   tile.j0 + p % tile_width);
+                scratch.stats[p].add(valid ? L : Vec3f(0));
+            }
+            scratch.rays.clear();
+            scratch.pdfs.clear();
+            scratch.pixels.clear();
+        };
+
+        scratch.rays.clear();
+        scratch.pdfs.clear();
+        scratch.pixels.clear();
+        for (int p = 0; p < n_pixels; ++p)
+        {
+            const int n = scratch.sampleCounts[p];
+            if (n == 0)
+                continue;
+
+            const int i = tile.i0 + p / tile_width;
+            const int j = tile.j0 + p % tile_width;
+            PixelStatistics &stats = scratch.stats[p];
+            const int first = stats.n;
+            for (int k = 0; k < n; ++k)
+            {
+                sampler.startPixelSample(j + width * i, first + k);
+                PM_STATS_ADD(cameraSamples, 1);
+                const float u = (2.0f * (j + sampler.getNext1D()) - width) / height;
+                const float v = (2.0f * (i + sampler.getNext1D()) - height) / height;
+
+                Ray ray;
+                float pdf;
+                if (!camera.sampleRay(Vec2f(u, v), ray, pdf))
+                {
+                    stats.add(Vec3f(0));
+                }
+                else if (integrator.isWavefront())
+                {
+                    scratch.rays.push_back(ray);
+                    scratch.pdfs.push_back(pdf);
+                    scratch.pixels.push_back(p);
+                }
+                else
+                {
+                    const Vec3f L = integrator.integrate(ray, scene, sampler) / pdf;
+                    stats.add(isValidRadiance(L, i, j) ? L : Vec3f(0));
+                }
+            }
+            scratch.nSamplesTaken += n;
+
+            if (scratch.rays.size() >= maxBatchRays)
+            {
+                flush();
+            }
+        }
+        if (!scratch.rays.empty())
+        {
+            flush();
+        }
+    }
+
+    // render one tile with adaptive sampling
+    // every pixel takes a few samples first. then each round gives more samples
+    // to the pixels whose relative error is still above the threshold, noisiest
+    // first, until the budget of nSamples per pixel of the tile is spent or all
+    // pixels converged. mean radiance is scaled by nSamples, so the result is
+    // averaged like the sum of the other modes
+    void renderTileAdaptive(const Tile &tile, const Integrator &integrator,
+                            const Scene &scene, const Camera &camera,
+                            int nSamples, int width, int height,
+                            TileScratch &scratch) const
+    {
+        const int tile_width = tile.j1 - tile.j0;
+        const int n_pixels = tile_width * (tile.i1 - tile.i0);
+
+        scratch.stats.assign(n_pixels, PixelStatistics());
+
+        const int min_samples = std::min(std::max(nSamples / 4, 4), nSamples);
+        const int max_samples = maxSamplesMultiplier * nSamples;
+        const int round_samples = std::max(min_samples / 2, 1);
+        int64_t budget = static_cast<int64_t>(nSamples) * n_pixels;
+
+        scratch.sampleCounts.assign(n_pixels, min_samples);
+        budget -= static_cast<int64_t>(min_samples) * n_pixels;
+        for (int round = 0;; ++round)
+        {
+            takeSamples(tile, integrator, scene, camera, width, height, round,
+                        scratch);
+
+            if (budget <= 0)
+                break;
+
+            // pixels still above threshold, noisiest first
+            scratch.active.clear();
+            for (int p = 0; p < n_pixels; ++p)
+            {
+                const PixelStatistics &stats = scratch.stats[p];
+                const float error = stats.getRelativeError();
+                if (stats.n < max_samples && error > adaptiveThreshold)
+                {
+                    scratch.active.emplace_back(error, p);
+                }
+            }
+            if (scratch.active.empty())
+                break;
+            std::sort(scratch.active.begin(), scratch.active.end(),
+                      [](const auto &a1, const auto &a2)
+                      { return a1.first > a2.first ||
+                               (a1.first == a2.first && a1.second < a2.second); });
+
+            scratch.sampleCounts.assign(n_pixels, 0);
+            for (const auto &a : scratch.active)
+            {
+                if (budget <= 0)
+                    break;
+                const int p = a.second;
+                const int n = std::min<int64_t>(
+                    {round_samples, max_samples - scratch.stats[p].n, budget});
+                scratch.sampleCounts[p] = n;
+                budget -= n;
+            }
+        }
+
+        scratch.radiance.resize(n_pixels);
+        scratch.sampleMap.resize(n_pixels);
+        for (int p = 0; p < n_pixels; ++p)
+        {
+            scratch.radiance[p] = scratch.stats[p].mean * nSamples;
+            scratch.sampleMap[p] = Vec3f(scratch.stats[p].n);
+        }
+    }
+
+    // write tile to image at once
+    void writeTile(const Tile &tile, const std::vector<Vec3f> &radiance,
+                   Image &image) const
+    {
+        const int tile_width = tile.j1 - tile.j0;
+        for (int i = tile.i0; i < tile.i1; ++i)
+        {
+            for (int j = tile.j0; j < tile.j1; ++j)
+            {
+                image.setPixel(i, j,
+                               radiance[(i - tile.i0) * tile_width + (j - tile.j0)]);
+            }
+        }
+    }
+
+    // render all tiles, finished tiles are handed to onTile(tile, radiance)
+    template <typename F>
+    void renderTiles(const Integrator &integrator, const Scene &scene,
+                     const Camera &camera, int nSamples, int width, int height,
+                     F &&onTile)
+    {
+        const auto start = std::chrono::steady_clock::now();
+
+        TileScheduler scheduler(
+            width, height, tileSize, omp_get_max_threads(),
+            communicator != nullptr ? communicator->getRank() : 0,
+            communicator != nullptr ? communicator->getSize() : 1);
+        uint64_t n_samples_taken = 0;
+
+#pragma omp parallel
+        {
+            TileScratch scratch;
+            scratch.sampler = sampler->clone();
+            scratch.tileSampler = sampler->clone();
+
+            Tile tile;
+            while (scheduler.next(omp_get_thread_num(), tile))
+            {
+                if (adaptiveThreshold > 0)
+                {
+                    renderTileAdaptive(tile, integrator, scene, camera, nSamples,
+                                       width, height, scratch);
+                }
+                else if (integrator.isWavefront())
+                {
+                    renderTileWavefront(tile, integrator, scene, camera, nSamples,
+                                        width, height, scratch);
+                }
+                else
+                {
+                    renderTile(tile, integrator, scene, camera, nSamples, width,
+                               height, scratch);
+                }
+                onTile(tile, scratch.radiance);
+
+                if (adaptiveThreshold > 0 && sampleMapWriter != nullptr)
+                {
+                    sampleMapWriter->writeTile(tile, scratch.sampleMap.data());
+                }
+            }
+
+#pragma omp atomic
+            n_samples_taken += scratch.nSamplesTaken;
+        }
+
+        renderTime = std::chrono::duration<double>(
+                         std::chrono::steady_clock::now() - start)
+                         .count();
+        nTilesRendered = scheduler.getNTiles();
+        std::cout << "Rendered " << nTilesRendered << " tiles in " << renderTime
+                  << "s (" << nTilesRendered / renderTime << " tiles/s)"
+                  << std::endl;
+
+        averageSamples = nSamples;
+        if (adaptiveThreshold > 0)
+        {
+            averageSamples =
+                static_cast<double>(n_samples_taken) /
+                std::max(scheduler.getNPixels(), 1);
+            std::cout << "Adaptive sampling took " << averageSamples
+                      << " samples per pixel on average" << std::endl;
+        }
+    }
+
+public:
+    Renderer(int tileSize = 16) : tileSize(tileSize) {}
+
+    // sample each pixel until relative standard error of its mean luminance
+    // falls below threshold, using at most nSamples per pixel on average and
+    // maxSamplesMultiplier * nSamples on a single pixel
+    // NOTE: 0 disables adaptive sampling
+    void setAdaptiveSampling(float threshold) { adaptiveThreshold = threshold; }
+
+    // sampler of camera rays and integration, cloned per render thread
+    void setSampler(const Sampler &sampler) { this->sampler = sampler.clone(); }
+
+    // write number of samples of each pixel during adaptive sampling
+    void setSampleMap(ImageWriter *writer) { sampleMapWriter = writer; }
+
+    // share tiles of each render with other ranks
+    // NOTE: only tiles of this rank are rendered. rendering into an image sums
+    // images of all ranks into the image of root, writers get tiles of this
+    // rank only
+    void setCommunicator(const Communicator *communicator)
+    {
+        this->communicator = communicator;
+    }
+
+    // render image, each pixel holds the sum of nSamples radiance samples
+    // NOTE: wavefront integrators get all camera rays of a tile at once
+    void render(const Integrator &integrator, const Scene &scene,
+                const Camera &camera, int nSamples, Image &image)
+    {
+        renderTiles(integrator, scene, camera, nSamples, image.getWidth(),
+                    image.getHeight(),
+                    [&](const Tile &tile, const std::vector<Vec3f> &radiance)
+                    { writeTile(tile, radiance, image); });
+
+        // NOTE: pixels of tiles of other ranks are left zero, so the sum is
+        // exact
+        if (communicator != nullptr)
+        {
+            communicator->reduceSum(image.getData(),
+                                    3 * image.getWidth() * image.getHeight());
+        }
+    }
+
+    // render image of the given size, streaming each finished tile to writer
+    // NOTE: writer should divide by nSamples, no frame buffer is kept
+    void render(const Integrator &integrator, const Scene &scene,
+                const Camera &camera, int nSamples, int width, int height,
+                ImageWriter &writer)
+    {
+        renderTiles(integrator, scene, camera, nSamples, width, height,
+                    [&](const Tile &tile, const std::vector<Vec3f> &radiance)
+                    { writer.writeTile(tile, radiance.data()); });
+    }
+
+    // wall time of last render in seconds
+    double getRenderTime() const { return renderTime; }
+    int getNTilesRendered() const { return nTilesRendered; }
+    // samples per pixel of last render
+    double getAverageSamples() const { return averageSamples; }
+};
+
+#endif
@@ -1,8 +1,11 @@
 #ifndef _SAMPLER_H
 #define _SAMPLER_H
+#include <algorithm>
 #include <cstdint>
+#include <iterator>
 #include <limits>
 #include <memory>
+#include <vector>
 
 #include "geometry.h"
 
@@ -25,67 +28,429 @@ inline uint32_t pcg32_random_r(pcg32_random_t *rng)
     return (xorshifted >> rot) | (xorshifted << ((-rot) & 31));
 }
 
-// random number generator
+// advance state of LCG by delta steps in O(log delta), negative delta(mod 2^64)
+// steps back
+// Brown, Forrest B. Random number generation with arbitrary strides.
+// Transactions of the American Nuclear Society 71 (1994)
+inline uint64_t pcg32_advance_lcg(uint64_t state, uint64_t delta,
+                                  uint64_t cur_mult, uint64_t cur_plus)
+{
+    uint64_t acc_mult = 1u;
+    uint64_t acc_plus = 0u;
+    while (delta > 0)
+    {
+        if (delta & 1)
+        {
+            acc_mult *= cur_mult;
+            acc_plus = acc_plus * cur_mult + cur_plus;
+        }
+        cur_plus = (cur_mult + 1) * cur_plus;
+        cur_mult *= cur_mult;
+        delta /= 2;
+    }
+    return acc_mult * state + acc_plus;
+}
+
+// map 32 bits to [0, 1)
+inline float uintToFloat(uint32_t x) { return (x >> 8) * 0x1p-24f; }
+
+// 64 bit finalizer of MurmurHash3, with improved constants
+// https://zimbry.blogspot.com/2011/09/better-bit-mixing-improving-on.html
+inline uint64_t mixBits(uint64_t v)
+{
+    v ^= v >> 31;
+    v *= 0x7fb5d329728ea185ull;
+    v ^= v >> 27;
+    v *= 0x81dadef4bc2dd44dull;
+    v ^= v >> 33;
+    return v;
+}
+
+// random number generator, PCG32 with selectable stream
 class RNG
 {
 private:
     pcg32_random_t state;
 
+    static constexpr uint64_t multiplier = 6364136223846793005ULL;
+
 public:
-    RNG()
+    RNG(uint64_t seed = 0, uint64_t stream = 0) { setSeed(seed, stream); }
+
+    // initialize as pcg32_srandom_r, stream selects the increment of the LCG
+    // so that generators of different streams never share a sequence
+    void setSeed(uint64_t seed, uint64_t stream = 0)
     {
-        state.state = 1;
-        state.inc = 1;
+        state.state = 0u;
+        state.inc = (stream << 1u) | 1u;
+        pcg32_random_r(&state);
+        state.state += seed;
+        pcg32_random_r(&state);
     }
-    RNG(uint64_t seed)
+
+    // skip delta numbers, negative delta goes back
+    void advance(int64_t delta)
     {
-        state.state = seed;
-        state.inc = 1;
+        state.state = pcg32_advance_lcg(state.state, static_cast<uint64_t>(delta),
+                                        multiplier, state.inc);
     }
 
-    uint64_t getSeed() const { return state.state; }
-    void setSeed(uint64_t seed) { state.state = seed; }
+    float getNext() { return uintToFloat(pcg32_random_r(&state)); }
 
-    float getNext()
+    // fill values with the next n numbers, same as calling getNext n times
+    // NOTE: 8 lanes run the LCG 8 states apart, so that the loop vectorizes
+    void fill(float *values, int n)
     {
-        constexpr float divider = 1.0f / std::numeric_limits<uint32_t>::max();
-        return pcg32_random_r(&state) * divider;
+        constexpr int lanes = 8;
+
+        // LCG of 8 steps
+        uint64_t lane_mult = 1;
+        uint64_t lane_plus = 0;
+        uint64_t lane_state[lanes];
+        for (int j = 0; j < lanes; ++j)
+        {
+            lane_state[j] = lane_mult * state.state + lane_plus;
+            lane_plus = lane_plus * multiplier + state.inc;
+            lane_mult *= multiplier;
+        }
+
+        int i = 0;
+        for (; i + lanes <= n; i += lanes)
+        {
+            for (int j = 0; j < lanes; ++j)
+            {
+                const uint64_t oldstate = lane_state[j];
+                lane_state[j] = oldstate * lane_mult + lane_plus;
+                const uint32_t xorshifted = ((oldstate >> 18u) ^ oldstate) >> 27u;
+                const uint32_t rot = oldstate >> 59u;
+                values[i + j] =
+                    uintToFloat((xorshifted >> rot) | (xorshifted << ((-rot) & 31)));
+            }
+        }
+        state.state = lane_state[0];
+
+        for (; i < n; ++i)
+        {
+            values[i] = getNext();
+        }
     }
 };
 
+enum class SamplerType
+{
+    UNIFORM,
+    SOBOL,
+    HALTON,
+};
+
 // sampler interface
+// NOTE: getNext1D/getNext2D are inlined and read from a small buffer, only
+// refilling the buffer is virtual. samplers of low discrepancy sequences
+// generate dimensions in pairs, so that every 1D and 2D sample takes its own
+// pair of dimensions of the current sample
 class Sampler
 {
 protected:
     RNG rng;
+    uint64_t seed;
+
+    static constexpr int bufferSize = 16;
+
+private:
+    float buffer[bufferSize];
+    int bufferPos = bufferSize;
+    const bool pairDimensions;
+
+    float getNextValue()
+    {
+        if (bufferPos == bufferSize)
+        {
+            generate(buffer, bufferSize);
+            bufferPos = 0;
+        }
+        return buffer[bufferPos++];
+    }
+
+protected:
+    // fill values with the next n numbers of the sample stream
+    virtual void generate(float *values, int n) = 0;
+
+    void discardBuffer() { bufferPos = bufferSize; }
 
 public:
-    Sampler() {}
+    Sampler(uint64_t seed = 0, bool pairDimensions = false)
+        : rng(seed), seed(seed), pairDimensions(pairDimensions) {}
+
+    virtual ~Sampler() {}
 
-    Sampler(uint64_t seed) : rng(seed) {}
+    uint64_t getSeed() const { return seed; }
 
-    uint64_t getSeed() const { return rng.getSeed(); }
-    void setSeed(uint64_t seed) { rng.setSeed(seed); }
+    // restart random stream of the given seed and stream
+    void setSeed(uint64_t seed, uint64_t stream = 0)
+    {
+        this->seed = seed;
+        rng.setSeed(seed, stream);
+        discardBuffer();
+    }
 
+    // start the given sample of a pixel or other stream of samples(e.g.
+    // photons), first dimension comes next
+    // NOTE: the sample only depends on seed, pixel and sample index, not on the
+    // samples taken before
+    virtual void startPixelSample(uint64_t pixel, uint32_t sampleIndex) = 0;
+
+    virtual SamplerType getType() const = 0;
     virtual std::unique_ptr<Sampler> clone() const = 0;
-    virtual float getNext1D() = 0;
-    virtual Vec2f getNext2D() = 0;
+
+    float getNext1D()
+    {
+        const float x = getNextValue();
+        if (pairDimensions)
+        {
+            ++bufferPos;
+        }
+        return x;
+    }
+
+    Vec2f getNext2D()
+    {
+        const float x = getNextValue();
+        const float y = getNextValue();
+        return Vec2f(x, y);
+    }
 };
 
 // uniform distribution sampler
 class UniformSampler : public Sampler
 {
+protected:
+    void generate(float *values, int n) override { rng.fill(values, n); }
+
 public:
-    UniformSampler() : Sampler() {}
-    UniformSampler(uint64_t seed) : Sampler(seed) {}
+    UniformSampler(uint64_t seed = 0) : Sampler(seed) {}
+
+    // every pixel has its own stream, every sample owns 2^32 numbers of it
+    void startPixelSample(uint64_t pixel, uint32_t sampleIndex) override
+    {
+        rng.setSeed(mixBits(seed ^ mixBits(pixel)), pixel);
+        rng.advance(static_cast<int64_t>(static_cast<uint64_t>(sampleIndex) << 32));
+        discardBuffer();
+    }
 
+    SamplerType getType() const override { return SamplerType::UNIFORM; }
+
+    // NOTE: clones continue the same stream
     std::unique_ptr<Sampler> clone() const override
     {
-        return std::make_unique<UniformSampler>();
+        return std::make_unique<UniformSampler>(*this);
     }
+};
 
-    float getNext1D() override { return rng.getNext(); }
-    Vec2f getNext2D() override { return Vec2f(rng.getNext(), rng.getNext()); }
+inline uint32_t reverseBits(uint32_t x)
+{
+    x = (x << 16) | (x >> 16);
+    x = ((x & 0x00ff00ff) << 8) | ((x & 0xff00ff00) >> 8);
+    x = ((x & 0x0f0f0f0f) << 4) | ((x & 0xf0f0f0f0) >> 4);
+    x = ((x & 0x33333333) << 2) | ((x & 0xcccccccc) >> 2);
+    x = ((x & 0x55555555) << 1) | ((x & 0xaaaaaaaa) >> 1);
+    return x;
+}
+
+// integer hash with good avalanche
+// https://github.com/skeeto/hash-prospector
+inline uint32_t hashUint(uint32_t x)
+{
+    x ^= x >> 16;
+    x *= 0x7feb352du;
+    x ^= x >> 15;
+    x *= 0x846ca68bu;
+    x ^= x >> 16;
+    return x;
+}
+
+inline uint32_t hashCombine(uint32_t seed, uint32_t v)
+{
+    return hashUint(seed ^ (v + 0x9e3779b9u + (seed << 6) + (seed >> 2)));
+}
+
+// nested uniform scramble(Owen scrambling) of bits from the top
+// Burley, Brent. Practical hash-based Owen scrambling. Journal of Computer
+// Graphics Techniques 9.4 (2020)
+inline uint32_t owenScramble(uint32_t x, uint32_t seed)
+{
+    x = reverseBits(x);
+    // Laine-Karras permutation with better constants
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return reverseBits(x);
+}
+
+// second dimension of sobol sequence, first one is reverseBits(index)
+inline uint32_t sobolSecond(uint32_t index)
+{
+    uint32_t r = 0;
+    for (uint32_t v = 1u << 31; index != 0; index >>= 1, v ^= v >> 1)
+    {
+        if (index & 1)
+        {
+            r ^= v;
+        }
+    }
+    return r;
+}
+
+// owen scrambled sobol sampler, padded by 2D
+// NOTE: every pair of dimensions is a 2D sobol point whose index is shuffled
+// per pixel and per pair, so the sequence has no dimension limit and pixels are
+// decorrelated
+// Burley, Brent. Practical hash-based Owen scrambling. Journal of Computer
+// Graphics Techniques 9.4 (2020)
+class SobolSampler : public Sampler
+{
+private:
+    uint32_t pixelHash = 0;
+    uint32_t sampleIndex = 0;
+    uint32_t dimension = 0; // next pair of dimensions
+
+protected:
+    void generate(float *values, int n) override
+    {
+        for (int i = 0; i < n; i += 2)
+        {
+            const uint32_t h = hashCombine(pixelHash, dimension++);
+            const uint32_t index = owenScramble(sampleIndex, h);
+            values[i] = uintToFloat(owenScramble(reverseBits(index), hashCombine(h, 0)));
+            values[i + 1] = uintToFloat(owenScramble(sobolSecond(index), hashCombine(h, 1)));
+        }
+    }
+
+public:
+    SobolSampler(uint64_t seed = 0) : Sampler(seed, true) {}
+
+    void startPixelSample(uint64_t pixel, uint32_t sampleIndex) override
+    {
+        pixelHash = static_cast<uint32_t>(mixBits(seed ^ mixBits(pixel)));
+        this->sampleIndex = sampleIndex;
+        dimension = 0;
+        discardBuffer();
+    }
+
+    SamplerType getType() const override { return SamplerType::SOBOL; }
+
+    std::unique_ptr<Sampler> clone() const override
+    {
+        return std::make_unique<SobolSampler>(*this);
+    }
+};
+
+// element i of a random permutation of [0, l) chosen by p
+// Kensler, Andrew. Correlated multi-jittered sampling. Pixar Technical Memo
+// 13-01 (2013)
+inline uint32_t permutationElement(uint32_t i, uint32_t l, uint32_t p)
+{
+    uint32_t w = l - 1;
+    w |= w >> 1;
+    w |= w >> 2;
+    w |= w >> 4;
+    w |= w >> 8;
+    w |= w >> 16;
+    do
+    {
+        i ^= p;
+        i *= 0xe170893d;
+        i ^= p >> 16;
+        i ^= (i & w) >> 4;
+        i ^= p >> 8;
+        i *= 0x0929eb3f;
+        i ^= p >> 23;
+        i ^= (i & w) >> 1;
+        i *= 1 | p >> 27;
+        i *= 0x6935fa69;
+        i ^= (i & w) >> 11;
+        i *= 0x74dcb303;
+        i ^= (i & w) >> 2;
+        i *= 0x9e501cc3;
+        i ^= (i & w) >> 2;
+        i *= 0xc860a3df;
+        i &= w;
+        i ^= i >> 5;
+    } while (i >= l);
+    return (i + p) % l;
+}
+
+// radical inverse of index in the given base, with Owen scrambled digits
+// NOTE: permutation of each digit is hashed from the digits before it. digits
+// continue after index runs out until float precision is reached
+inline float owenScrambledRadicalInverse(uint32_t base, uint64_t index,
+                                         uint32_t seed)
+{
+    const float inv_base = 1.0f / base;
+    const uint64_t limit = ~0ull / base - base;
+    uint64_t reversed = 0;
+    float inv_base_n = 1;
+    while (1 - inv_base_n < 1 && reversed < limit)
+    {
+        const uint64_t next = index / base;
+        const uint32_t digit = index - next * base;
+        const uint32_t digit_hash = hashCombine(seed, static_cast<uint32_t>(reversed));
+        reversed = reversed * base + permutationElement(digit, base, digit_hash);
+        inv_base_n *= inv_base;
+        index = next;
+    }
+    return std::min(reversed * inv_base_n, 1.0f - std::numeric_limits<float>::epsilon() / 2);
+}
+
+// halton sampler, digits are owen scrambled per pixel and dimension
+// NOTE: Cranley-Patterson rotation or digit shifts would keep samples of a pixel
+// on a line while SPP is below the bases. dimensions beyond the prime table are
+// hashed from pixel, sample index and dimension
+class HaltonSampler : public Sampler
+{
+private:
+    static constexpr uint32_t primes[32] = {
+        2,  3,  5,  7,  11, 13, 17, 19, 23, 29, 31, 37, 41, 43,  47,  53,
+        59, 61, 67, 71, 73, 79, 83, 89, 97, 101, 103, 107, 109, 113, 127, 131};
+
+    uint32_t pixelHash = 0;
+    uint32_t sampleIndex = 0;
+    uint32_t dimension = 0; // next dimension
+
+protected:
+    void generate(float *values, int n) override
+    {
+        for (int i = 0; i < n; ++i, ++dimension)
+        {
+            if (dimension >= std::size(primes))
+            {
+                values[i] = uintToFloat(
+                    hashCombine(hashCombine(pixelHash, sampleIndex), dimension));
+                continue;
+            }
+            values[i] = owenScrambledRadicalInverse(
+                primes[dimension], sampleIndex, hashCombine(pixelHash, dimension));
+        }
+    }
+
+public:
+    HaltonSampler(uint64_t seed = 0) : Sampler(seed, true) {}
+
+    void startPixelSample(uint64_t pixel, uint32_t sampleIndex) override
+    {
+        pixelHash = static_cast<uint32_t>(mixBits(seed ^ mixBits(pixel)));
+        this->sampleIndex = sampleIndex;
+        dimension = 0;
+        discardBuffer();
+    }
+
+    SamplerType getType() const override { return SamplerType::HALTON; }
+
+    std::unique_ptr<Sampler> clone() const override
+    {
+        return std::make_unique<HaltonSampler>(*this);
+    }
 };
 
 // sample direction in the hemisphere
@@ -100,4 +465,102 @@ inline Vec3f sampleCosineHemisphere(const Vec2f &uv, float &pdf)
     return sphericalToCartesian(theta, phi);
 }
 
+// discrete distribution sampled in O(1) by Walker's alias method
+// Vose, Michael D. A linear algorithm for generating random numbers with a
+// given distribution. IEEE Transactions on software engineering 17.9 (1991)
+class AliasTable
+{
+private:
+    std::vector<float> probs;      // probability of keeping each bin
+    std::vector<uint32_t> aliases; // bin taken otherwise
+    std::vector<float> pdfs;       // normalized weights
+
+public:
+    AliasTable() {}
+
+    // NOTE: falls back to uniform distribution when all weights are zero
+    AliasTable(const std::vector<float> &weights)
+    {
+        const uint32_t n = weights.size();
+        probs.resize(n);
+        aliases.resize(n);
+        pdfs.resize(n);
+        if (n == 0)
+            return;
+
+        double sum = 0;
+        for (const float w : weights)
+        {
+            sum += w;
+        }
+        for (uint32_t i = 0; i < n; ++i)
+        {
+            pdfs[i] = sum > 0 ? weights[i] / sum : 1.0 / n;
+        }
+
+        // split bins into under-full and over-full ones
+        std::vector<double> scaled(n);
+        std::vector<uint32_t> small, large;
+        for (uint32_t i = 0; i < n; ++i)
+        {
+            scaled[i] = static_cast<double>(pdfs[i]) * n;
+            if (scaled[i] < 1.0)
+            {
+                small.push_back(i);
+            }
+            else
+            {
+                large.push_back(i);
+            }
+        }
+
+        // fill each under-full bin with an over-full one
+        while (!small.empty() && !large.empty())
+        {
+            const uint32_t s = small.back();
+            small.pop_back();
+            const uint32_t l = large.back();
+
+            probs[s] = scaled[s];
+            aliases[s] = l;
+
+            scaled[l] -= 1.0 - scaled[s];
+            if (scaled[l] < 1.0)
+            {
+                large.pop_back();
+                small.push_back(l);
+            }
+        }
+
+        // remaining bins are full up to rounding error
+        for (const uint32_t i : large)
+        {
+            probs[i] = 1.0f;
+            aliases[i] = i;
+        }
+        for (const uint32_t i : small)
+        {
+            probs[i] = 1.0f;
+            aliases[i] = i;
+        }
+    }
+
+    uint32_t size() const { return pdfs.size(); }
+    bool empty() const { return pdfs.empty(); }
+
+    float getPdf(uint32_t i) const { return pdfs[i]; }
+
+    // sample bin with a single uniform number in [0, 1)
+    // NOTE: fraction of u * n decides between bin and its alias
+    uint32_t sample(float u, float &pdf) const
+    {
+        const uint32_t n = size();
+        const float un = u * n;
+        const uint32_t bin = std::min(static_cast<uint32_t>(un), n - 1);
+        const uint32_t i = (un - bin) < probs[bin] ? bin : aliases[bin];
+        pdf = pdfs[i];
+        return i;
+    }
+};
+
 #endif
\ No newline at end of file
@@ -1,24 +1,100 @@
 #ifndef _SCENE_H
 #define _SCENE_H
 #include <embree3/rtcore.h>
+#include <algorithm>
+#include <cstring>
 #include <iostream>
 #include <filesystem>
-#include <memory>
+#include <fstream>
 #include <optional>
+#include <string>
+#include <unordered_map>
 #include <vector>
 
 #include "geometry.h"
+#include "mapped_file.h"
 #include "primitive.h"
+#include "sampler.h"
+#include "stats.h"
 #include "tiny_obj_loader.h"
 
-// create default BxDF
-const std::shared_ptr<BxDF> createDefaultBxDF()
+// index triple of obj vertex
+struct VertexKey
+{
+    int vertex_index;
+    int normal_index;
+    int texcoord_index;
+
+    bool operator==(const VertexKey &other) const
+    {
+        return vertex_index == other.vertex_index &&
+               normal_index == other.normal_index &&
+               texcoord_index == other.texcoord_index;
+    }
+};
+
+struct VertexKeyHash
+{
+    size_t operator()(const VertexKey &key) const
+    {
+        uint64_t h = static_cast<uint32_t>(key.vertex_index);
+        h = h * 0x9e3779b97f4a7c15ull ^ static_cast<uint32_t>(key.normal_index);
+        h = h * 0x9e3779b97f4a7c15ull ^ static_cast<uint32_t>(key.texcoord_index);
+        return h ^ (h >> 29);
+    }
+};
+
+// binary scene cache
+// NOTE: written next to the obj file on first load and memory mapped on later
+// runs. sections are aligned, so that they can be handed to embree directly
+constexpr char sceneCacheMagic[8] = "PMSCENE";
+constexpr uint32_t sceneCacheVersion = 2;
+constexpr uint64_t sceneCacheAlignment = 64;
+
+struct SceneCacheHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t nVertices;
+    uint32_t nFaces;
+    uint32_t nMaterials;
+
+    // size and modification time of the obj file the cache was made from
+    uint64_t sourceSize;
+    int64_t sourceTime;
+
+    // byte offsets of sections from the beginning of the file
+    uint64_t verticesOffset;
+    uint64_t indicesOffset;
+    uint64_t normalsOffset;
+    uint64_t texcoordsOffset;
+    uint64_t materialIDsOffset;
+    uint64_t materialsOffset;
+    uint64_t fileSize;
+};
+
+// fields of tinyobj material used by the renderer
+struct SceneCacheMaterial
+{
+    float diffuse[3];
+    float specular[3];
+    float emission[3];
+    float ior;
+    int32_t illum;
+    char name[64]; // null terminated, truncated
+};
+
+inline uint64_t alignSceneCacheOffset(uint64_t offset)
 {
-    return std::make_shared<Lambert>(Vec3(0.9f));
+    return (offset + sceneCacheAlignment - 1) / sceneCacheAlignment *
+           sceneCacheAlignment;
 }
 
+// create default BxDF
+const Material createDefaultBxDF() { return Lambert(Vec3(0.9f)); }
+
 // create BxDF from tinyobj material
-const std::shared_ptr<BxDF> createBxDF(const tinyobj::material_t &material)
+const Material createBxDF(const tinyobj::material_t &material)
 {
     const Vec3f kd =
         Vec3f(material.diffuse[0], material.diffuse[1], material.diffuse[2]);
@@ -29,56 +105,136 @@ const std::shared_ptr<BxDF> createBxDF(const tinyobj::material_t &material)
     {
     case 5:
         // mirror
-        return std::make_shared<Mirror>(Vec3(1.0f));
+        return Mirror(Vec3(1.0f));
     case 7:
         // glass
-        return std::make_shared<Glass>(Vec3(1.0f), material.ior);
+        return Glass(Vec3(1.0f), material.ior);
     default:
         // lambert
-        return std::make_shared<Lambert>(kd);
+        return Lambert(kd);
     }
 }
 
 // create AreaLight from tinyobj material
-const std::shared_ptr<AreaLight> createAreaLight(
-    const tinyobj::material_t &material, const Triangle *tri)
+std::optional<AreaLight> createAreaLight(const tinyobj::material_t &material,
+                                         const Triangle *tri)
 {
     if (material.emission[0] > 0 || material.emission[1] > 0 ||
         material.emission[2] > 0)
     {
         const Vec3f le =
             Vec3f(material.emission[0], material.emission[1], material.emission[2]);
-        return std::make_shared<AreaLight>(le, tri);
+        return AreaLight(le, tri);
     }
     else
     {
-        return nullptr;
+        return std::nullopt;
     }
 }
 
+// embree packet types and functions for packet width N
+template <int N>
+struct RTCPacket;
+
+template <>
+struct RTCPacket<4>
+{
+    using Ray = RTCRay4;
+    using RayHit = RTCRayHit4;
+    static void intersect(const int *valid, RTCScene scene,
+                          RTCIntersectContext *context, RayHit *rayhit)
+    {
+        rtcIntersect4(valid, scene, context, rayhit);
+    }
+    static void occluded(const int *valid, RTCScene scene,
+                         RTCIntersectContext *context, Ray *ray)
+    {
+        rtcOccluded4(valid, scene, context, ray);
+    }
+};
+
+template <>
+struct RTCPacket<8>
+{
+    using Ray = RTCRay8;
+    using RayHit = RTCRayHit8;
+    static void intersect(const int *valid, RTCScene scene,
+                          RTCIntersectContext *context, RayHit *rayhit)
+    {
+        rtcIntersect8(valid, scene, context, rayhit);
+    }
+    static void occluded(const int *valid, RTCScene scene,
+                         RTCIntersectContext *context, Ray *ray)
+    {
+        rtcOccluded8(valid, scene, context, ray);
+    }
+};
+
+template <>
+struct RTCPacket<16>
+{
+    using Ray = RTCRay16;
+    using RayHit = RTCRayHit16;
+    static void intersect(const int *valid, RTCScene scene,
+                          RTCIntersectContext *context, RayHit *rayhit)
+    {
+        rtcIntersect16(valid, scene, context, rayhit);
+    }
+    static void occluded(const int *valid, RTCScene scene,
+                         RTCIntersectContext *context, Ray *ray)
+    {
+        rtcOccluded16(valid, scene, context, ray);
+    }
+};
+
 class Scene
 {
 private:
     // mesh data
-    // NOTE: assuming size of normals, texcoords == size of vertices
+    // NOTE: owned when parsed from obj, empty when mapped from scene cache.
+    // assuming size of normals, texcoords == size of vertices
     std::vector<float> vertices;
     std::vector<uint32_t> indices;
     std::vector<float> normals;
     std::vector<float> texcoords;
 
-    std::vector<std::optional<tinyobj::material_t>> materials;
+    // material ID of each face, -1 for default material
+    // NOTE: per face
+    std::vector<int32_t> materialIDs;
+
+    // views of mesh data
+    // NOTE: point into the vectors above or into the mapped scene cache.
+    // vertex data is padded by one float, since embree reads vertices with
+    // 16 byte loads
+    const float *vertexData = nullptr;
+    const uint32_t *indexData = nullptr;
+    const float *normalData = nullptr;
+    const float *texcoordData = nullptr;
+    const int32_t *materialIDData = nullptr;
+    uint32_t numVertices = 0;
+    uint32_t numFaces = 0;
+
+    // mapped scene cache
+    MappedFile sceneCache;
+
+    // materials
+    // NOTE: per material
+    std::vector<tinyobj::material_t> materials;
 
     // triangles
     // NOTE: per face
     std::vector<Triangle> triangles;
 
-    // BxDFs
-    // NOTE: per face
-    std::vector<std::shared_ptr<BxDF>> bxdfs;
+    // flat material table
+    // NOTE: per material, default material at the end
+    std::vector<Material> bxdfs;
 
     // lights
-    // NOTE: per face
-    std::vector<std::shared_ptr<Light>> lights;
+    // NOTE: per emissive face
+    std::vector<AreaLight> lights;
+
+    // distribution of lights proportional to their power
+    AliasTable lightDistribution;
 
     // primitives
     // NOTE: per face
@@ -88,7 +244,15 @@ private:
     RTCDevice device;
     RTCScene scene;
 
-    bool hasLight(uint32_t faceID) const { return lights[faceID] != nullptr; }
+    // whether geometry may move after build
+    bool dynamic = false;
+
+    // index of BxDF of the given face
+    size_t getBxDFIndex(uint32_t faceID) const
+    {
+        return materialIDData[faceID] >= 0 ? materialIDData[faceID]
+                                           : materials.size();
+    }
 
     void clear()
     {
@@ -96,31 +260,30 @@ private:
         indices.clear();
         normals.clear();
         texcoords.clear();
-        bxdfs.clear();
+        materialIDs.clear();
+
+        vertexData = nullptr;
+        indexData = nullptr;
+        normalData = nullptr;
+        texcoordData = nullptr;
+        materialIDData = nullptr;
+        numVertices = 0;
+        numFaces = 0;
+        sceneCache.close();
 
+        materials.clear();
         triangles.clear();
         bxdfs.clear();
         lights.clear();
+        lightDistribution = AliasTable();
         primitives.clear();
     }
 
-public:
-    Scene() {}
-    ~Scene()
-    {
-        clear();
-        rtcReleaseScene(scene);
-        rtcReleaseDevice(device);
-    }
-
-    // load obj file
-    // TODO: remove vertex duplication
-    void loadModel(const std::filesystem::path &filepath)
+    // parse obj file into mesh data
+    // NOTE: vertices are shared between faces referring to the same
+    // (position, normal, texcoords) triple
+    bool parseModel(const std::filesystem::path &filepath)
     {
-        clear();
-
-        std::cout << "Loading " << filepath.generic_string() << "..." << std::endl;
-
         tinyobj::ObjReaderConfig reader_config;
         reader_config.mtl_search_path = "./";
         reader_config.triangulate = true;
@@ -132,7 +295,7 @@ public:
             {
                 std::cout << "Failed to load " << filepath.generic_string() << ": " << reader.Error() << std::endl;
             }
-            return;
+            return false;
         }
 
         if (!reader.Warning().empty())
@@ -142,162 +305,433 @@ public:
 
         const auto &attrib = reader.GetAttrib();
         const auto &shapes = reader.GetShapes();
-        const auto &materials = reader.GetMaterials();
+        this->materials = reader.GetMaterials();
+
+        size_t n_faces = 0;
+        for (const auto &shape : shapes)
+        {
+            n_faces += shape.mesh.num_face_vertices.size();
+        }
+        this->indices.reserve(3 * n_faces);
+        this->materialIDs.reserve(n_faces);
+
+        // map from index triple of obj to vertex
+        std::unordered_map<VertexKey, uint32_t, VertexKeyHash> vertex_map;
+        vertex_map.reserve(attrib.vertices.size() / 3);
 
+        // add vertex to mesh data, return its index
+        const auto add_vertex = [&](const tinyobj::index_t &idx, const Vec3f &n,
+                                    const Vec2f &t)
+        {
+            for (int i = 0; i < 3; ++i)
+            {
+                this->vertices.push_back(
+                    attrib.vertices[3 * static_cast<size_t>(idx.vertex_index) + i]);
+                this->normals.push_back(n[i]);
+            }
+            this->texcoords.push_back(t[0]);
+            this->texcoords.push_back(t[1]);
+            return static_cast<uint32_t>(this->vertices.size() / 3 - 1);
+        };
         // loop over shapes
         for (size_t s = 0; s < shapes.size(); ++s)
         {
-            size_t index_offset = 0;
             // loop over faces
+            // NOTE: faces are triangulated by tinyobj
             for (size_t f = 0; f < shapes[s].mesh.num_face_vertices.size(); ++f)
             {
-                const size_t fv =
-                    static_cast<size_t>(shapes[s].mesh.num_face_vertices[f]);
+                const tinyobj::index_t *idx = &shapes[s].mesh.indices[3 * f];
 
-                std::vector<Vec3f> vertices;
-                std::vector<Vec3f> normals;
-                std::vector<Vec2f> texcoords;
-
-                // loop over vertices
-                // get vertices, normals, texcoords of a triangle
-                for (size_t v = 0; v < fv; ++v)
+                // when normals are missing, use geometric normal
+                // NOTE: vertices get unique to the face
+                bool has_normals = true;
+                bool has_texcoords = true;
+                for (int v = 0; v < 3; ++v)
+                {
+                    has_normals &= idx[v].normal_index >= 0;
+                    has_texcoords &= idx[v].texcoord_index >= 0;
+                }
+                Vec3f geometric_normal;
+                if (!has_normals)
                 {
-                    const tinyobj::index_t idx = shapes[s].mesh.indices[index_offset + v];
+                    Vec3f p[3];
+                    for (int v = 0; v < 3; ++v)
+                    {
+                        const size_t vi = 3 * static_cast<size_t>(idx[v].vertex_index);
+                        p[v] = Vec3f(attrib.vertices[vi + 0], attrib.vertices[vi + 1],
+                                     attrib.vertices[vi + 2]);
+                    }
+                    const Vec3f v1 = normalize(p[1] - p[0]);
+                    const Vec3f v2 = normalize(p[2] - p[0]);
+                    geometric_normal = normalize(cross(v1, v2));
+                }
 
-                    const tinyobj::real_t vx =
-                        attrib.vertices[3 * static_cast<size_t>(idx.vertex_index) + 0];
-                    const tinyobj::real_t vy =
-                        attrib.vertices[3 * static_cast<size_t>(idx.vertex_index) + 1];
-                    const tinyobj::real_t vz =
-                        attrib.vertices[3 * static_cast<size_t>(idx.vertex_index) + 2];
-                    vertices.push_back(Vec3f(vx, vy, vz));
+                // populate vertices, indices, normals, texcoords
+                for (int v = 0; v < 3; ++v)
+                {
+                    // when texcoords are missing, use barycentric coords
+                    // NOTE: corner of the face becomes part of the vertex identity
+                    const Vec2f t =
+                        has_texcoords
+                            ? Vec2f(attrib.texcoords[2 * static_cast<size_t>(
+                                                         idx[v].texcoord_index) +
+                                                     0],
+                                    attrib.texcoords[2 * static_cast<size_t>(
+                                                         idx[v].texcoord_index) +
+                                                     1])
+                            : Vec2f(v == 1, v == 2);
 
-                    if (idx.normal_index >= 0)
+                    if (!has_normals)
                     {
-                        const tinyobj::real_t nx =
-                            attrib.normals[3 * static_cast<size_t>(idx.normal_index) + 0];
-                        const tinyobj::real_t ny =
-                            attrib.normals[3 * static_cast<size_t>(idx.normal_index) + 1];
-                        const tinyobj::real_t nz =
-                            attrib.normals[3 * static_cast<size_t>(idx.normal_index) + 2];
-                        normals.push_back(Vec3f(nx, ny, nz));
+                        this->indices.push_back(add_vertex(idx[v], geometric_normal, t));
+                        continue;
                     }
 
-                    if (idx.texcoord_index >= 0)
+                    const VertexKey key = {idx[v].vertex_index, idx[v].normal_index,
+                                           has_texcoords ? idx[v].texcoord_index
+                                                         : -1 - v};
+                    const auto [it, inserted] = vertex_map.try_emplace(key, 0);
+                    if (inserted)
                     {
-                        const tinyobj::real_t tx =
-                            attrib
-                                .texcoords[2 * static_cast<size_t>(idx.texcoord_index) + 0];
-                        const tinyobj::real_t ty =
-                            attrib
-                                .texcoords[2 * static_cast<size_t>(idx.texcoord_index) + 1];
-                        texcoords.push_back(Vec2f(tx, ty));
+                        const size_t ni = 3 * static_cast<size_t>(idx[v].normal_index);
+                        it->second = add_vertex(
+                            idx[v],
+                            Vec3f(attrib.normals[ni + 0], attrib.normals[ni + 1],
+                                  attrib.normals[ni + 2]),
+                            t);
                     }
+                    this->indices.push_back(it->second);
                 }
 
-                // if normals is empty, add geometric normal
-                if (normals.size() == 0)
-                {
-                    const Vec3f v1 = normalize(vertices[1] - vertices[0]);
-                    const Vec3f v2 = normalize(vertices[2] - vertices[0]);
-                    const Vec3f n = normalize(cross(v1, v2));
-                    normals.push_back(n);
-                    normals.push_back(n);
-                    normals.push_back(n);
-                }
+                // populate materials
+                this->materialIDs.push_back(shapes[s].mesh.material_ids[f]);
+            }
+        }
 
-                // if texcoords is empty, add barycentric coords
-                if (texcoords.size() == 0)
-                {
-                    texcoords.push_back(Vec2f(0, 0));
-                    texcoords.push_back(Vec2f(1, 0));
-                    texcoords.push_back(Vec2f(0, 1));
-                }
+        // NOTE: embree reads vertex buffers with 16 byte loads
+        this->vertices.push_back(0);
 
-                // populate vertices, indices, normals, texcoords
-                for (int i = 0; i < 3; ++i)
-                {
-                    this->vertices.push_back(vertices[i][0]);
-                    this->vertices.push_back(vertices[i][1]);
-                    this->vertices.push_back(vertices[i][2]);
+        vertexData = this->vertices.data();
+        indexData = this->indices.data();
+        normalData = this->normals.data();
+        texcoordData = this->texcoords.data();
+        materialIDData = this->materialIDs.data();
+        numVertices = (this->vertices.size() - 1) / 3;
+        numFaces = this->indices.size() / 3;
 
-                    this->normals.push_back(normals[i][0]);
-                    this->normals.push_back(normals[i][1]);
-                    this->normals.push_back(normals[i][2]);
+        return true;
+    }
 
-                    this->texcoords.push_back(texcoords[i][0]);
-                    this->texcoords.push_back(texcoords[i][1]);
+    // size and modification time of obj file, to tell whether cache is stale
+    // NOTE: changes of the mtl file alone are not detected
+    static bool getSourceKey(const std::filesystem::path &filepath,
+                             uint64_t &size, int64_t &time)
+    {
+        std::error_code ec;
+        size = std::filesystem::file_size(filepath, ec);
+        if (ec)
+            return false;
+        time = std::filesystem::last_write_time(filepath, ec)
+                   .time_since_epoch()
+                   .count();
+        return !ec;
+    }
 
-                    this->indices.push_back(this->indices.size());
-                }
+    // write mesh data to scene cache
+    // NOTE: written to a temporary file first, so that a concurrent run never
+    // maps a partially written cache
+    void writeCache(const std::filesystem::path &cachepath,
+                    const std::filesystem::path &filepath) const
+    {
+        SceneCacheHeader header = {};
+        std::memcpy(header.magic, sceneCacheMagic, sizeof(header.magic));
+        header.version = sceneCacheVersion;
+        header.nVertices = numVertices;
+        header.nFaces = numFaces;
+        header.nMaterials = materials.size();
+        if (!getSourceKey(filepath, header.sourceSize, header.sourceTime))
+            return;
 
-                // populate materials
-                const int materialID = shapes[s].mesh.material_ids[f];
-                std::optional<tinyobj::material_t> material = std::nullopt;
-                if (materialID != -1)
-                {
-                    material = materials[materialID];
-                }
-                this->materials.push_back(material);
+        // lay out sections
+        uint64_t offset = alignSceneCacheOffset(sizeof(SceneCacheHeader));
+        const auto place = [&](uint64_t &sectionOffset, uint64_t bytes)
+        {
+            sectionOffset = offset;
+            offset = alignSceneCacheOffset(offset + bytes);
+        };
+        const uint64_t vertices_bytes = (3 * uint64_t(numVertices) + 1) * sizeof(float);
+        const uint64_t indices_bytes = 3 * uint64_t(numFaces) * sizeof(uint32_t);
+        const uint64_t normals_bytes = 3 * uint64_t(numVertices) * sizeof(float);
+        const uint64_t texcoords_bytes = 2 * uint64_t(numVertices) * sizeof(float);
+        const uint64_t material_ids_bytes = uint64_t(numFaces) * sizeof(int32_t);
+        const uint64_t materials_bytes =
+            uint64_t(header.nMaterials) * sizeof(SceneCacheMaterial);
+        place(header.verticesOffset, vertices_bytes);
+        place(header.indicesOffset, indices_bytes);
+        place(header.normalsOffset, normals_bytes);
+        place(header.texcoordsOffset, texcoords_bytes);
+        place(header.materialIDsOffset, material_ids_bytes);
+        place(header.materialsOffset, materials_bytes);
+        header.fileSize = offset;
 
-                index_offset += fv;
+        std::vector<SceneCacheMaterial> cache_materials(materials.size());
+        for (size_t i = 0; i < materials.size(); ++i)
+        {
+            for (int j = 0; j < 3; ++j)
+            {
+                cache_materials[i].diffuse[j] = materials[i].diffuse[j];
+                cache_materials[i].specular[j] = materials[i].specular[j];
+                cache_materials[i].emission[j] = materials[i].emission[j];
             }
+            cache_materials[i].ior = materials[i].ior;
+            cache_materials[i].illum = materials[i].illum;
+            std::memset(cache_materials[i].name, 0, sizeof(cache_materials[i].name));
+            materials[i].name.copy(cache_materials[i].name,
+                                   sizeof(cache_materials[i].name) - 1);
         }
 
+        const std::filesystem::path tmppath = cachepath.string() + ".tmp";
+        std::ofstream file(tmppath, std::ios::binary);
+        if (!file)
+        {
+            std::cout << "Warning: Failed to write scene cache "
+                      << cachepath.generic_string() << std::endl;
+            return;
+        }
+
+        // write section after zero padding
+        const auto write_section = [&](uint64_t sectionOffset, const void *data,
+                                       uint64_t bytes)
+        {
+            static const char zeros[sceneCacheAlignment] = {};
+            file.write(zeros, sectionOffset - static_cast<uint64_t>(file.tellp()));
+            file.write(static_cast<const char *>(data), bytes);
+        };
+        write_section(0, &header, sizeof(SceneCacheHeader));
+        write_section(header.verticesOffset, vertexData, vertices_bytes);
+        write_section(header.indicesOffset, indexData, indices_bytes);
+        write_section(header.normalsOffset, normalData, normals_bytes);
+        write_section(header.texcoordsOffset, texcoordData, texcoords_bytes);
+        write_section(header.materialIDsOffset, materialIDData, material_ids_bytes);
+        write_section(header.materialsOffset, cache_materials.data(),
+                      materials_bytes);
+        write_section(header.fileSize, nullptr, 0);
+        file.close();
+
+        std::error_code ec;
+        if (file)
+        {
+            std::filesystem::rename(tmppath, cachepath, ec);
+        }
+        if (!file || ec)
+        {
+            std::filesystem::remove(tmppath, ec);
+            std::cout << "Warning: Failed to write scene cache "
+                      << cachepath.generic_string() << std::endl;
+        }
+    }
+
+    // map scene cache, return false when it is missing or stale
+    // NOTE: contents of a cache with valid header are trusted
+    bool loadCache(const std::filesystem::path &cachepath,
+                   const std::filesystem::path &filepath)
+    {
+        MappedFile file;
+        if (!file.open(cachepath) || file.size() < sizeof(SceneCacheHeader))
+            return false;
+
+        SceneCacheHeader header;
+        std::memcpy(&header, file.data(), sizeof(SceneCacheHeader));
+
+        uint64_t source_size;
+        int64_t source_time;
+        if (std::memcmp(header.magic, sceneCacheMagic, sizeof(header.magic)) != 0 ||
+            header.version != sceneCacheVersion || header.fileSize != file.size() ||
+            !getSourceKey(filepath, source_size, source_time) ||
+            header.sourceSize != source_size || header.sourceTime != source_time)
+            return false;
+
+        // check that sections are aligned and inside the file
+        const auto valid_section = [&](uint64_t sectionOffset, uint64_t bytes)
+        {
+            return sectionOffset % sceneCacheAlignment == 0 &&
+                   sectionOffset <= file.size() &&
+                   bytes <= file.size() - sectionOffset;
+        };
+        if (!valid_section(header.verticesOffset,
+                           (3 * uint64_t(header.nVertices) + 1) * sizeof(float)) ||
+            !valid_section(header.indicesOffset,
+                           3 * uint64_t(header.nFaces) * sizeof(uint32_t)) ||
+            !valid_section(header.normalsOffset,
+                           3 * uint64_t(header.nVertices) * sizeof(float)) ||
+            !valid_section(header.texcoordsOffset,
+                           2 * uint64_t(header.nVertices) * sizeof(float)) ||
+            !valid_section(header.materialIDsOffset,
+                           uint64_t(header.nFaces) * sizeof(int32_t)) ||
+            !valid_section(header.materialsOffset,
+                           uint64_t(header.nMaterials) * sizeof(SceneCacheMaterial)))
+            return false;
+
+        const std::byte *base = file.data();
+        vertexData = reinterpret_cast<const float *>(base + header.verticesOffset);
+        indexData = reinterpret_cast<const uint32_t *>(base + header.indicesOffset);
+        normalData = reinterpret_cast<const float *>(base + header.normalsOffset);
+        texcoordData = reinterpret_cast<const float *>(base + header.texcoordsOffset);
+        materialIDData =
+            reinterpret_cast<const int32_t *>(base + header.materialIDsOffset);
+        numVertices = header.nVertices;
+        numFaces = header.nFaces;
+
+        const SceneCacheMaterial *cache_materials =
+            reinterpret_cast<const SceneCacheMaterial *>(base + header.materialsOffset);
+        materials.resize(header.nMaterials);
+        for (size_t i = 0; i < materials.size(); ++i)
+        {
+            for (int j = 0; j < 3; ++j)
+            {
+                materials[i].diffuse[j] = cache_materials[i].diffuse[j];
+                materials[i].specular[j] = cache_materials[i].specular[j];
+                materials[i].emission[j] = cache_materials[i].emission[j];
+            }
+            materials[i].ior = cache_materials[i].ior;
+            materials[i].illum = cache_materials[i].illum;
+            materials[i].name = std::string(
+                cache_materials[i].name,
+                strnlen(cache_materials[i].name, sizeof(cache_materials[i].name)));
+        }
+
+        sceneCache = std::move(file);
+        return true;
+    }
+
+    // populate triangles, BxDFs, lights, primitives from mesh data
+    void setupPrimitives()
+    {
         // populate  triangles
+        this->triangles.reserve(nFaces());
         for (size_t faceID = 0; faceID < nFaces(); ++faceID)
         {
             // add triangle
-            this->triangles.emplace_back(this->vertices.data(), this->indices.data(),
-                                         this->normals.data(), this->texcoords.data(),
-                                         faceID);
+            this->triangles.emplace_back(vertexData, indexData, normalData,
+                                         texcoordData, faceID);
         }
 
         // populate bxdfs
-        for (size_t faceID = 0; faceID < nFaces(); ++faceID)
+        for (const auto &m : this->materials)
         {
-            // add bxdf
-            // TODO: remove duplicate
-            const auto material = this->materials[faceID];
-            if (material)
-            {
-                const tinyobj::material_t &m = material.value();
-                this->bxdfs.push_back(createBxDF(m));
-            }
-            // default material
-            else
-            {
-                this->bxdfs.push_back(createDefaultBxDF());
-            }
+            this->bxdfs.push_back(createBxDF(m));
         }
+        // default material
+        this->bxdfs.push_back(createDefaultBxDF());
 
-        // populate lights, primitives
+        // populate lights
+        std::vector<int> light_indices(nFaces(), -1);
         for (size_t faceID = 0; faceID < nFaces(); ++faceID)
         {
-            // add light
-            std::shared_ptr<Light> light = nullptr;
-            const auto material = this->materials[faceID];
-            if (material)
+            const int materialID = materialIDData[faceID];
+            if (materialID >= 0)
             {
-                const tinyobj::material_t &m = material.value();
-                light = createAreaLight(m, &this->triangles[faceID]);
-                if (light != nullptr)
+                const std::optional<AreaLight> light = createAreaLight(
+                    this->materials[materialID], &this->triangles[faceID]);
+                if (light)
                 {
-                    lights.push_back(light);
+                    light_indices[faceID] = lights.size();
+                    lights.push_back(*light);
                 }
             }
+        }
+
+        // populate primitives
+        // NOTE: after lights are complete, since primitives point into them
+        this->primitives.reserve(nFaces());
+        for (size_t faceID = 0; faceID < nFaces(); ++faceID)
+        {
+            const AreaLight *light = light_indices[faceID] >= 0
+                                         ? &this->lights[light_indices[faceID]]
+                                         : nullptr;
+            primitives.emplace_back(&this->triangles[faceID],
+                                    &this->bxdfs[getBxDFIndex(faceID)], light);
+        }
+
+        // weight lights by emitted power
+        std::vector<float> light_powers(lights.size());
+        for (size_t i = 0; i < lights.size(); ++i)
+        {
+            light_powers[i] = lights[i].getPower();
+        }
+        lightDistribution = AliasTable(light_powers);
+    }
+
+public:
+    Scene() {}
+    ~Scene()
+    {
+        // NOTE: embree shares mesh data, release it first
+        rtcReleaseScene(scene);
+        rtcReleaseDevice(device);
+        clear();
+    }
+
+    // load obj file
+    // NOTE: when useCache is set, parsed mesh is kept in <obj>.pmcache and
+    // mapped instead of parsing the obj file again
+    void loadModel(const std::filesystem::path &filepath, bool useCache = true)
+    {
+        clear();
+
+        std::cout << "Loading " << filepath.generic_string() << "..." << std::endl;
 
-            // add primitive
-            primitives.emplace_back(&this->triangles[faceID], this->bxdfs[faceID],
-                                    light);
+        const std::filesystem::path cachepath = filepath.string() + ".pmcache";
+        if (useCache && loadCache(cachepath, filepath))
+        {
+            std::cout << "Mapped scene cache " << cachepath.generic_string()
+                      << std::endl;
+        }
+        else
+        {
+            if (!parseModel(filepath))
+                return;
+            if (useCache)
+            {
+                writeCache(cachepath, filepath);
+            }
         }
+
+        setupPrimitives();
+
         std::cout << "Vertices: " << nVertices() << std::endl;
         std::cout << "Faces: " << nFaces() << std::endl;
         std::cout << "Lights: " << lights.size() << std::endl;
     }
 
-    uint32_t nVertices() const { return vertices.size() / 3; }
-    uint32_t nFaces() const { return indices.size() / 3; }
+    uint32_t nVertices() const { return numVertices; }
+    uint32_t nFaces() const { return numFaces; }
+
+    // hash of mesh data and materials
+    // NOTE: identifies the scene, e.g. in keys of persisted photon maps
+    uint64_t getHash() const
+    {
+        uint64_t h = hashBytes(&numVertices, sizeof(numVertices));
+        h = hashBytes(&numFaces, sizeof(numFaces), h);
+        h = hashBytes(vertexData, 3 * size_t(numVertices) * sizeof(float), h);
+        h = hashBytes(indexData, 3 * size_t(numFaces) * sizeof(uint32_t), h);
+        h = hashBytes(normalData, 3 * size_t(numVertices) * sizeof(float), h);
+        h = hashBytes(texcoordData, 2 * size_t(numVertices) * sizeof(float), h);
+        h = hashBytes(materialIDData, size_t(numFaces) * sizeof(int32_t), h);
+        for (const auto &m : materials)
+        {
+            h = hashBytes(m.diffuse, sizeof(m.diffuse), h);
+            h = hashBytes(m.specular, sizeof(m.specular), h);
+            h = hashBytes(m.emission, sizeof(m.emission), h);
+            h = hashBytes(&m.ior, sizeof(m.ior), h);
+            h = hashBytes(&m.illum, sizeof(m.illum), h);
+        }
+        return h;
+    }
+
+    // let geometry move after build, BVH is refit instead of rebuilt
+    // NOTE: takes effect on next build
+    void setDynamic(bool dynamic) { this->dynamic = dynamic; }
 
     void build()
     {
@@ -306,35 +740,163 @@ public:
         // setup embree
         device = rtcNewDevice(NULL);
         scene = rtcNewScene(device);
+        if (dynamic)
+        {
+            rtcSetSceneFlags(scene, RTC_SCENE_FLAG_DYNAMIC);
+        }
 
         RTCGeometry geom = rtcNewGeometry(device, RTC_GEOMETRY_TYPE_TRIANGLE);
+        if (dynamic)
+        {
+            rtcSetGeometryBuildQuality(geom, RTC_BUILD_QUALITY_REFIT);
+        }
+
+        // share vertices and indices with embree
+        // NOTE: no copy is made, mesh data must outlive the embree scene
+        rtcSetSharedGeometryBuffer(geom, RTC_BUFFER_TYPE_VERTEX, 0,
+                                   RTC_FORMAT_FLOAT3, vertexData, 0,
+                                   3 * sizeof(float), nVertices());
+        rtcSetSharedGeometryBuffer(geom, RTC_BUFFER_TYPE_INDEX, 0, RTC_FORMAT_UINT3,
+                                   indexData, 0, 3 * sizeof(unsigned), nFaces());
+
+        rtcCommitGeometry(geom);
+        rtcAttachGeometry(scene, geom);
+        rtcReleaseGeometry(geom);
+        rtcCommitScene(scene);
+    }
+
+    // faces of the material with the given name
+    std::vector<uint32_t> getFacesWithMaterial(const std::string &name) const
+    {
+        std::vector<uint32_t> faceIDs;
+        for (uint32_t faceID = 0; faceID < nFaces(); ++faceID)
+        {
+            const int materialID = materialIDData[faceID];
+            if (materialID >= 0 && materials[materialID].name == name)
+            {
+                faceIDs.push_back(faceID);
+            }
+        }
+        return faceIDs;
+    }
+
+    // translate vertices of the given faces and update BVH
+    // returns all faces which moved, including faces sharing their vertices
+    // NOTE: vertices of a mapped scene cache are copied first. BVH is refit
+    // when the scene was built as dynamic, rebuilt otherwise
+    std::vector<uint32_t> moveFaces(const std::vector<uint32_t> &faceIDs,
+                                    const Vec3f &offset)
+    {
+        const bool copied = vertices.empty();
+        if (copied)
+        {
+            vertices.assign(vertexData, vertexData + 3 * size_t(numVertices) + 1);
+            vertexData = vertices.data();
+        }
 
-        // set vertices
-        float *vb = (float *)rtcSetNewGeometryBuffer(geom, RTC_BUFFER_TYPE_VERTEX, 0,
-                                                     RTC_FORMAT_FLOAT3,
-                                                     3 * sizeof(float), nVertices());
-        for (size_t i = 0; i < vertices.size(); ++i)
+        std::vector<bool> moved_vertices(nVertices(), false);
+        for (const uint32_t faceID : faceIDs)
+        {
+            for (int k = 0; k < 3; ++k)
+            {
+                moved_vertices[indexData[3 * faceID + k]] = true;
+            }
+        }
+        for (uint32_t v = 0; v < numVertices; ++v)
         {
-            vb[i] = vertices[i];
+            if (moved_vertices[v])
+            {
+                for (int d = 0; d < 3; ++d)
+                {
+                    vertices[3 * v + d] += offset[d];
+                }
+            }
         }
 
-        // set indices
-        unsigned *ib = (unsigned *)rtcSetNewGeometryBuffer(
-            geom, RTC_BUFFER_TYPE_INDEX, 0, RTC_FORMAT_UINT3, 3 * sizeof(unsigned),
-            nFaces());
-        for (size_t i = 0; i < indices.size(); ++i)
+        std::vector<uint32_t> moved_faces;
+        for (uint32_t faceID = 0; faceID < nFaces(); ++faceID)
         {
-            ib[i] = indices[i];
+            const bool moved = moved_vertices[indexData[3 * faceID + 0]] ||
+                               moved_vertices[indexData[3 * faceID + 1]] ||
+                               moved_vertices[indexData[3 * faceID + 2]];
+            if (moved)
+            {
+                moved_faces.push_back(faceID);
+            }
+            if (moved || copied)
+            {
+                triangles[faceID].update(vertexData);
+            }
         }
 
+        RTCGeometry geom = rtcGetGeometry(scene, 0);
+        if (copied)
+        {
+            rtcSetSharedGeometryBuffer(geom, RTC_BUFFER_TYPE_VERTEX, 0,
+                                       RTC_FORMAT_FLOAT3, vertexData, 0,
+                                       3 * sizeof(float), nVertices());
+        }
+        rtcUpdateGeometryBuffer(geom, RTC_BUFFER_TYPE_VERTEX, 0);
         rtcCommitGeometry(geom);
-        rtcAttachGeometry(scene, geom);
-        rtcReleaseGeometry(geom);
         rtcCommitScene(scene);
+
+        return moved_faces;
+    }
+
+    // bounding box of all faces
+    void getBounds(Vec3f &bmin, Vec3f &bmax) const
+    {
+        bmin = Vec3f(std::numeric_limits<float>::max());
+        bmax = Vec3f(std::numeric_limits<float>::lowest());
+        for (uint32_t v = 0; v < nVertices(); ++v)
+        {
+            for (int d = 0; d < 3; ++d)
+            {
+                bmin[d] = std::min(bmin[d], vertexData[3 * v + d]);
+                bmax[d] = std::max(bmax[d], vertexData[3 * v + d]);
+            }
+        }
+    }
+
+    // bounding box of the given faces
+    void getBounds(const std::vector<uint32_t> &faceIDs, Vec3f &bmin,
+                   Vec3f &bmax) const
+    {
+        bmin = Vec3f(std::numeric_limits<float>::max());
+        bmax = Vec3f(std::numeric_limits<float>::lowest());
+        for (const uint32_t faceID : faceIDs)
+        {
+            for (int k = 0; k < 3; ++k)
+            {
+                const uint32_t v = indexData[3 * faceID + k];
+                for (int d = 0; d < 3; ++d)
+                {
+                    bmin[d] = std::min(bmin[d], vertexData[3 * v + d]);
+                    bmax[d] = std::max(bmax[d], vertexData[3 * v + d]);
+                }
+            }
+        }
+    }
+
+    // whether the face is a light
+    bool isEmissive(uint32_t faceID) const
+    {
+        return primitives[faceID].hasAreaLight();
     }
 
     // ray-scene intersection
     bool intersect(const Ray &ray, IntersectInfo &info) const
+    {
+        HitRecord hit;
+        if (!intersect(ray, hit))
+            return false;
+        computeIntersectInfo(ray, hit, info);
+        return true;
+    }
+
+    // ray-scene intersection without surface info
+    // NOTE: for paths which may terminate at the hit(e.g. photons)
+    bool intersect(const Ray &ray, HitRecord &hit) const
     {
         RTCRayHit rayhit;
         rayhit.ray.org_x = ray.origin[0];
@@ -351,43 +913,217 @@ public:
         rtcInitIntersectContext(&context);
 
         rtcIntersect1(scene, &context, &rayhit);
+        PM_STATS_ADD(rays, 1);
 
         if (rayhit.hit.geomID != RTC_INVALID_GEOMETRY_ID)
         {
-            info.t = rayhit.ray.tfar;
+            hit.t = rayhit.ray.tfar;
+            hit.primID = rayhit.hit.primID;
+            hit.barycentric = Vec2f(rayhit.hit.u, rayhit.hit.v);
+            hit.hitPrimitive = &this->primitives[hit.primID];
+            return true;
+        }
+        else
+        {
+            return false;
+        }
+    }
 
-            // get triangle shape
-            const Triangle &tri = this->triangles[rayhit.hit.primID];
+    // compute full intersect info of the given hit
+    void computeIntersectInfo(const Ray &ray, const HitRecord &hit,
+                              IntersectInfo &info) const
+    {
+        setIntersectInfo(ray, hit.t, hit.primID, hit.barycentric[0],
+                         hit.barycentric[1], info);
+    }
 
-            // set surface info
-            info.surfaceInfo.position = ray(info.t);
-            info.surfaceInfo.barycentric = Vec2f(rayhit.hit.u, rayhit.hit.v);
-            info.surfaceInfo.texcoords =
-                tri.getTexcoords(info.surfaceInfo.barycentric);
-            info.surfaceInfo.geometricNormal = tri.getGeometricNormal();
-            info.surfaceInfo.shadingNormal =
-                tri.computeShadingNormal(info.surfaceInfo.barycentric);
-            orthonormalBasis(info.surfaceInfo.shadingNormal, info.surfaceInfo.dpdu,
-                             info.surfaceInfo.dpdv);
+    // compute only shading normal of the given hit
+    Vec3f computeShadingNormal(const HitRecord &hit) const
+    {
+        return this->triangles[hit.primID].computeShadingNormal(hit.barycentric);
+    }
 
-            // set primitive
-            info.hitPrimitive = &this->primitives[rayhit.hit.primID];
+    // packet ray-scene intersection
+    // NOTE: only the first nRays rays are traced
+    void intersect4(const Ray *rays, IntersectInfo *infos, bool *hits,
+                    int nRays = 4) const
+    {
+        intersectPacket<4>(rays, nRays, infos, hits);
+    }
+    void intersect8(const Ray *rays, IntersectInfo *infos, bool *hits,
+                    int nRays = 8) const
+    {
+        intersectPacket<8>(rays, nRays, infos, hits);
+    }
+    void intersect16(const Ray *rays, IntersectInfo *infos, bool *hits,
+                     int nRays = 16) const
+    {
+        intersectPacket<16>(rays, nRays, infos, hits);
+    }
 
-            return true;
+    // stream ray-scene intersection
+    // NOTE: rays are traced in packets of 16, coherent rays(e.g. primary rays
+    // of a tile) should be adjacent in the stream
+    void intersectN(const Ray *rays, int nRays, IntersectInfo *infos,
+                    bool *hits) const
+    {
+        for (int i = 0; i < nRays; i += 16)
+        {
+            intersectPacket<16>(rays + i, std::min(nRays - i, 16), infos + i,
+                                hits + i);
         }
-        else
+    }
+
+    // return true if anything is hit between ray.tmin and ray.tmax
+    // NOTE: stops at the first hit and does not compute surface info
+    bool occluded(const Ray &ray) const
+    {
+        RTCRay rtc_ray;
+        rtc_ray.org_x = ray.origin[0];
+        rtc_ray.org_y = ray.origin[1];
+        rtc_ray.org_z = ray.origin[2];
+        rtc_ray.dir_x = ray.direction[0];
+        rtc_ray.dir_y = ray.direction[1];
+        rtc_ray.dir_z = ray.direction[2];
+        rtc_ray.tnear = ray.tmin;
+        rtc_ray.tfar = ray.tmax;
+        rtc_ray.mask = -1;
+        rtc_ray.flags = 0;
+        rtc_ray.time = 0;
+
+        RTCIntersectContext context;
+        rtcInitIntersectContext(&context);
+
+        rtcOccluded1(scene, &context, &rtc_ray);
+        PM_STATS_ADD(shadowRays, 1);
+
+        // NOTE: embree sets tfar to -inf when occluded
+        return rtc_ray.tfar < 0;
+    }
+
+    // stream occlusion test
+    void occludedN(const Ray *rays, int nRays, bool *occluded) const
+    {
+        for (int i = 0; i < nRays; i += 16)
         {
-            return false;
+            occludedPacket<16>(rays + i, std::min(nRays - i, 16), occluded + i);
         }
     }
 
-    std::shared_ptr<Light> sampleLight(Sampler &sampler, float &pdf) const
+    uint32_t nLights() const { return lights.size(); }
+    const AreaLight &getLight(uint32_t lightIdx) const { return lights[lightIdx]; }
+
+    // sample light proportional to its power
+    const AreaLight *sampleLight(Sampler &sampler, float &pdf) const
     {
-        unsigned int lightIdx = lights.size() * sampler.getNext1D();
-        if (lightIdx == lights.size())
-            lightIdx--;
-        pdf = 1.0f / lights.size();
-        return lights[lightIdx];
+        uint32_t lightIdx;
+        return sampleLight(sampler, pdf, lightIdx);
+    }
+
+    // sample light proportional to its power, return its index too
+    const AreaLight *sampleLight(Sampler &sampler, float &pdf,
+                                 uint32_t &lightIdx) const
+    {
+        lightIdx = lightDistribution.sample(sampler.getNext1D(), pdf);
+        return &lights[lightIdx];
+    }
+
+private:
+    // set intersect info from embree hit
+    void setIntersectInfo(const Ray &ray, float t, unsigned int primID, float u,
+                          float v, IntersectInfo &info) const
+    {
+        info.t = t;
+
+        // get triangle shape
+        const Triangle &tri = this->triangles[primID];
+
+        // set surface info
+        info.surfaceInfo.position = ray(info.t);
+        info.surfaceInfo.barycentric = Vec2f(u, v);
+        info.surfaceInfo.texcoords =
+            tri.getTexcoords(info.surfaceInfo.barycentric);
+        info.surfaceInfo.geometricNormal = tri.getGeometricNormal();
+        info.surfaceInfo.shadingNormal =
+            tri.computeShadingNormal(info.surfaceInfo.barycentric);
+        orthonormalBasis(info.surfaceInfo.shadingNormal, info.surfaceInfo.dpdu,
+                         info.surfaceInfo.dpdv);
+
+        // set primitive
+        info.hitPrimitive = &this->primitives[primID];
+    }
+
+    // fill SoA ray packet, invalid lanes are masked out
+    template <int N, typename RTCRayN>
+    static void setRayPacket(const Ray *rays, int nRays, RTCRayN &packet,
+                             int *valid)
+    {
+        for (int k = 0; k < N; ++k)
+        {
+            valid[k] = k < nRays ? -1 : 0;
+            const Ray &ray = rays[k < nRays ? k : 0];
+            packet.org_x[k] = ray.origin[0];
+            packet.org_y[k] = ray.origin[1];
+            packet.org_z[k] = ray.origin[2];
+            packet.dir_x[k] = ray.direction[0];
+            packet.dir_y[k] = ray.direction[1];
+            packet.dir_z[k] = ray.direction[2];
+            packet.tnear[k] = ray.tmin;
+            packet.tfar[k] = ray.tmax;
+            packet.mask[k] = -1;
+            packet.flags[k] = 0;
+            packet.time[k] = 0;
+        }
+    }
+
+    template <int N>
+    void intersectPacket(const Ray *rays, int nRays, IntersectInfo *infos,
+                         bool *hits) const
+    {
+        alignas(64) int valid[N];
+        alignas(64) typename RTCPacket<N>::RayHit rayhit;
+        setRayPacket<N>(rays, nRays, rayhit.ray, valid);
+        for (int k = 0; k < N; ++k)
+        {
+            rayhit.hit.geomID[k] = RTC_INVALID_GEOMETRY_ID;
+        }
+
+        RTCIntersectContext context;
+        rtcInitIntersectContext(&context);
+        context.flags = RTC_INTERSECT_CONTEXT_FLAG_COHERENT;
+
+        RTCPacket<N>::intersect(valid, scene, &context, &rayhit);
+        PM_STATS_ADD(rays, nRays);
+
+        for (int k = 0; k < nRays; ++k)
+        {
+            hits[k] = rayhit.hit.geomID[k] != RTC_INVALID_GEOMETRY_ID;
+            if (hits[k])
+            {
+                setIntersectInfo(rays[k], rayhit.ray.tfar[k],
+                                 rayhit.hit.primID[k], rayhit.hit.u[k],
+                                 rayhit.hit.v[k], infos[k]);
+            }
+        }
+    }
+
+    template <int N>
+    void occludedPacket(const Ray *rays, int nRays, bool *occluded) const
+    {
+        alignas(64) int valid[N];
+        alignas(64) typename RTCPacket<N>::Ray packet;
+        setRayPacket<N>(rays, nRays, packet, valid);
+
+        RTCIntersectContext context;
+        rtcInitIntersectContext(&context);
+
+        RTCPacket<N>::occluded(valid, scene, &context, &packet);
+        PM_STATS_ADD(shadowRays, nRays);
+
+        for (int k = 0; k < nRays; ++k)
+        {
+            occluded[k] = packet.tfar[k] < 0;
+        }
     }
 };
 
@@ -0,0 +1,469 @@
+#ifndef _SPPM_H
+#define _SPPM_H
+#include <omp.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <vector>
+
+#include "camera.h"
+#include "geometry.h"
+#include "image.h"
+#include "integrator.h"
+#include "sampler.h"
+#include "scene.h"
+#include "stats.h"
+
+// implementation of stochastic progressive photon mapping
+// NOTE: camera passes store one visible point per pixel, photon passes splat
+// photons onto them and shrink their radii. photons are never stored, so
+// memory stays bounded by the number of pixels
+// Hachisuka, Toshiya, and Henrik Wann Jensen. Stochastic progressive photon
+// mapping. ACM Transactions on Graphics (TOG) 28.5 (2009)
+class ProgressivePhotonMapping
+{
+private:
+    // number of photons traced per pass
+    const int nPhotonsPerPass;
+
+    // initial search radius of every pixel
+    const float initialRadius;
+
+    // maximum depth of photon tracing, eye tracing
+    const int maxDepth;
+
+    // ratio of photons kept at each radius reduction
+    const float alpha;
+
+    // number of photons handed to a thread at once
+    static constexpr int photonChunkSize = 1024;
+
+    // sample stream of photons of first pass, far from the streams of pixels
+    static constexpr uint64_t photonStream = 1ull << 62;
+
+    // wall time of each phase of the last render, summed over passes
+    PhaseTimes phaseTimes;
+
+    struct PixelState
+    {
+        // visible point of current pass
+        bool hasVisiblePoint = false;
+        Vec3f wo;
+        IntersectInfo info;
+        Vec3f throughput; // from camera to visible point
+
+        // direct illumination accumulated over passes
+        Vec3f Ld;
+
+        // progressive estimate
+        float radius2 = 0;
+        float N = 0;  // accumulated number of photons
+        Vec3f tau;    // accumulated flux
+
+        // photons of current pass
+        // NOTE: written by photon pass with atomics
+        float phi[3] = {0, 0, 0};
+        int M = 0;
+    };
+
+    std::vector<PixelState> pixels;
+
+    // hash grid over visible points
+    // NOTE: cells store pixel indices, CSR layout
+    Vec3f gridMin;
+    float cellSize = 0;
+    std::vector<int> cellOffsets;
+    std::vector<int> cellEntries;
+
+    static uint32_t hashCell(int ix, int iy, int iz, uint32_t nCells)
+    {
+        return ((static_cast<uint32_t>(ix) * 73856093u) ^
+                (static_cast<uint32_t>(iy) * 19349663u) ^
+                (static_cast<uint32_t>(iz) * 83492791u)) %
+               nCells;
+    }
+
+    void getCell(const Vec3f &p, int &ix, int &iy, int &iz) const
+    {
+        ix = static_cast<int>((p[0] - gridMin[0]) / cellSize);
+        iy = static_cast<int>((p[1] - gridMin[1]) / cellSize);
+        iz = static_cast<int>((p[2] - gridMin[2]) / cellSize);
+    }
+
+    // trace camera ray until it hits diffuse surface, store visible point
+    void traceCameraPath(const Scene &scene, const Ray &camera_ray, float pdf,
+                         Sampler &sampler, PixelState &pixel) const
+    {
+        pixel.hasVisiblePoint = false;
+
+        Ray ray = camera_ray;
+        Vec3f throughput(1.0f / pdf);
+        for (int k = 0; k < maxDepth; ++k)
+        {
+            IntersectInfo info;
+            if (!scene.intersect(ray, info))
+            {
+                // ray goes out to the sky
+                return;
+            }
+
+            // when directly hitting light
+            if (info.hitPrimitive->hasAreaLight())
+            {
+                pixel.Ld += throughput * info.hitPrimitive->Le(info.surfaceInfo,
+                                                               -ray.direction);
+                return;
+            }
+
+            const BxDFType bxdf_type = info.hitPrimitive->getBxDFType();
+            if (bxdf_type == BxDFType::DIFFUSE)
+            {
+                // direct illumination by explicit light sampling
+                pixel.Ld += throughput *
+                            Integrator::computeDirectIllumination(
+                                scene, -ray.direction, info, sampler);
+
+                pixel.hasVisiblePoint = true;
+                pixel.wo = -ray.direction;
+                pixel.info = info;
+                pixel.throughput = throughput;
+                return;
+            }
+            else if (bxdf_type == BxDFType::SPECULAR)
+            {
+                // sample direction by BxDF
+                Vec3f dir;
+                float pdf_dir;
+                const Vec3f f = info.hitPrimitive->sampleBxDF(
+                    -ray.direction, info.surfaceInfo, TransportDirection::FROM_CAMERA,
+                    sampler, dir, pdf_dir);
+                throughput *= f *
+                              Integrator::cosTerm(-ray.direction, dir, info.surfaceInfo,
+                                                  TransportDirection::FROM_CAMERA) /
+                              pdf_dir;
+                ray = Ray(info.surfaceInfo.position, dir);
+            }
+            else
+            {
+                std::cout << "Error: Invalid BxDF type!" << std::endl;
+                return;
+            }
+        }
+    }
+
+    // build hash grid over visible points of current pass
+    void buildGrid()
+    {
+        // bounds of visible points, largest radius
+        Vec3f pmin(std::numeric_limits<float>::max());
+        float max_radius2 = 0;
+        int n_visible = 0;
+        for (const auto &pixel : pixels)
+        {
+            if (!pixel.hasVisiblePoint)
+                continue;
+            const Vec3f &p = pixel.info.surfaceInfo.position;
+            for (int j = 0; j < 3; ++j)
+            {
+                pmin[j] = std::min(pmin[j], p[j]);
+            }
+            max_radius2 = std::max(max_radius2, pixel.radius2);
+            ++n_visible;
+        }
+
+        const float max_radius = std::sqrt(max_radius2);
+        gridMin = pmin - Vec3f(max_radius);
+        // NOTE: each visible point overlaps at most 2x2x2 cells
+        cellSize = 2.0f * max_radius;
+
+        // no photon can reach visible points of zero radius
+        if (!(cellSize > 0))
+        {
+            cellOffsets.assign(1, 0);
+            cellEntries.clear();
+            return;
+        }
+
+        const uint32_t n_cells = std::max(n_visible, 1);
+        cellOffsets.assign(n_cells + 1, 0);
+
+        // visit cells overlapped by each visible point
+        const auto for_each_cell = [&](const PixelState &pixel, auto &&f)
+        {
+            const float r = std::sqrt(pixel.radius2);
+            const Vec3f &p = pixel.info.surfaceInfo.position;
+            int x0, y0, z0, x1, y1, z1;
+            getCell(p - Vec3f(r), x0, y0, z0);
+            getCell(p + Vec3f(r), x1, y1, z1);
+            for (int iz = z0; iz <= z1; ++iz)
+            {
+                for (int iy = y0; iy <= y1; ++iy)
+                {
+                    for (int ix = x0; ix <= x1; ++ix)
+                    {
+                        f(hashCell(ix, iy, iz, n_cells));
+                    }
+                }
+            }
+        };
+
+        // count entries per cell
+        for (const auto &pixel : pixels)
+        {
+            if (!pixel.hasVisiblePoint)
+                continue;
+            for_each_cell(pixel, [&](uint32_t h) { cellOffsets[h + 1]++; });
+        }
+        for (uint32_t h = 0; h < n_cells; ++h)
+        {
+            cellOffsets[h + 1] += cellOffsets[h];
+        }
+
+        // fill entries
+        cellEntries.resize(cellOffsets[n_cells]);
+        std::vector<int> fill(cellOffsets.begin(), cellOffsets.end() - 1);
+        for (int i = 0; i < pixels.size(); ++i)
+        {
+            if (!pixels[i].hasVisiblePoint)
+                continue;
+            for_each_cell(pixels[i],
+                          [&](uint32_t h) { cellEntries[fill[h]++] = i; });
+        }
+    }
+
+    // add photon to visible points around the given point
+    void splatPhoton(const Vec3f &p, const Vec3f &wi, const Vec3f &throughput)
+    {
+        if (cellEntries.empty())
+            return;
+
+        // NOTE: cells below grid origin hold no visible point
+        int ix, iy, iz;
+        getCell(p, ix, iy, iz);
+        if (ix < 0 || iy < 0 || iz < 0)
+            return;
+        const uint32_t h = hashCell(ix, iy, iz, cellOffsets.size() - 1);
+        for (int e = cellOffsets[h]; e < cellOffsets[h + 1]; ++e)
+        {
+            PixelState &pixel = pixels[cellEntries[e]];
+            const SurfaceInfo &surf = pixel.info.surfaceInfo;
+            const Vec3f d = p - surf.position;
+            if (dot(d, d) > pixel.radius2)
+                continue;
+
+            const Vec3f phi =
+                throughput * pixel.info.hitPrimitive->evaluateBxDF(
+                                 pixel.wo, wi, surf, TransportDirection::FROM_CAMERA);
+#pragma omp atomic
+            pixel.phi[0] += phi[0];
+#pragma omp atomic
+            pixel.phi[1] += phi[1];
+#pragma omp atomic
+            pixel.phi[2] += phi[2];
+#pragma omp atomic
+            pixel.M++;
+        }
+    }
+
+    // trace one photon from light, splatting it at every diffuse hit
+    // NOTE: direct illumination is computed at visible points by NEE, so the
+    // first hit is not splatted
+    void tracePhoton(const Scene &scene, Sampler &sampler)
+    {
+        Vec3f throughput;
+        Ray ray = Integrator::sampleRayFromLight(scene, sampler, throughput);
+
+        for (int k = 0; k < maxDepth; ++k)
+        {
+            if (std::isnan(throughput[0]) || std::isnan(throughput[1]) ||
+                std::isnan(throughput[2]))
+            {
+                std::cout << "Error: Photon throughput is NaN!" << std::endl;
+                break;
+            }
+            else if (throughput[0] < 0 || throughput[1] < 0 || throughput[2] < 0)
+            {
+                std::cout << "Error: Photon throughput is minus!" << std::endl;
+                break;
+            }
+
+            // NOTE: shading frame is computed only for photons surviving
+            // russian roulette
+            HitRecord hit;
+            if (!scene.intersect(ray, hit))
+            {
+                // photon goes to the sky
+                break;
+            }
+
+            if (k > 0 && hit.hitPrimitive->getBxDFType() == BxDFType::DIFFUSE)
+            {
+                splatPhoton(ray(hit.t), -ray.direction, throughput);
+            }
+
+            // russian roulette
+            if (k > 0)
+            {
+                const float russian_roulette_prob = std::min(
+                    std::max(throughput[0], std::max(throughput[1], throughput[2])),
+                    1.0f);
+                if (sampler.getNext1D() >= russian_roulette_prob)
+                {
+                    break;
+                }
+                throughput /= russian_roulette_prob;
+            }
+
+            // sample direction by BxDF
+            IntersectInfo info;
+            scene.computeIntersectInfo(ray, hit, info);
+            Vec3f dir;
+            float pdf_dir;
+            const Vec3f f = info.hitPrimitive->sampleBxDF(
+                -ray.direction, info.surfaceInfo, TransportDirection::FROM_LIGHT,
+                sampler, dir, pdf_dir);
+
+            // update throughput and ray
+            throughput *= f *
+                          Integrator::cosTerm(-ray.direction, dir, info.surfaceInfo,
+                                              TransportDirection::FROM_LIGHT) /
+                          pdf_dir;
+            ray = Ray(info.surfaceInfo.position, dir);
+        }
+    }
+
+    // shrink radius of each pixel by photons of current pass
+    void updatePixels()
+    {
+#pragma omp parallel for
+        for (int i = 0; i < pixels.size(); ++i)
+        {
+            PixelState &pixel = pixels[i];
+            if (pixel.M > 0)
+            {
+                const float N_new = pixel.N + alpha * pixel.M;
+                const float radius2_new = pixel.radius2 * N_new / (pixel.N + pixel.M);
+                const Vec3f phi(pixel.phi[0], pixel.phi[1], pixel.phi[2]);
+                pixel.tau = (pixel.tau + pixel.throughput * phi) * radius2_new /
+                            pixel.radius2;
+                pixel.N = N_new;
+                pixel.radius2 = radius2_new;
+            }
+
+            pixel.phi[0] = pixel.phi[1] = pixel.phi[2] = 0;
+            pixel.M = 0;
+        }
+    }
+
+public:
+    ProgressivePhotonMapping(int nPhotonsPerPass, float initialRadius,
+                             int maxDepth, float alpha = 2.0f / 3.0f)
+        : nPhotonsPerPass(nPhotonsPerPass),
+          initialRadius(initialRadius),
+          maxDepth(maxDepth),
+          alpha(alpha) {}
+
+    const PhaseTimes &getPhaseTimes() const { return phaseTimes; }
+
+    // render image with the given number of camera/photon passes, each pixel
+    // holds the radiance estimate
+    void render(const Scene &scene, const Camera &camera, int nPasses,
+                Image &image)
+    {
+        const auto start = std::chrono::steady_clock::now();
+        phaseTimes.clear();
+        PhaseTimer timer(phaseTimes);
+
+        const int width = image.getWidth();
+        const int height = image.getHeight();
+        const int n_pixels = width * height;
+
+        pixels.assign(n_pixels, PixelState());
+        for (auto &pixel : pixels)
+        {
+            pixel.radius2 = initialRadius * initialRadius;
+        }
+
+        const int n_chunks =
+            (nPhotonsPerPass + photonChunkSize - 1) / photonChunkSize;
+
+        for (int pass = 0; pass < nPasses; ++pass)
+        {
+            // camera pass
+            timer.begin("camera pass");
+#pragma omp parallel for schedule(dynamic, 64)
+            for (int idx = 0; idx < n_pixels; ++idx)
+            {
+                const int i = idx / width;
+                const int j = idx % width;
+
+                UniformSampler sampler;
+                sampler.startPixelSample(idx, pass);
+                PM_STATS_ADD(cameraSamples, 1);
+
+                const float u = (2.0f * (j + sampler.getNext1D()) - width) / height;
+                const float v = (2.0f * (i + sampler.getNext1D()) - height) / height;
+
+                Ray ray;
+                float pdf;
+                if (camera.sampleRay(Vec2f(u, v), ray, pdf))
+                {
+                    traceCameraPath(scene, ray, pdf, sampler, pixels[idx]);
+                }
+                else
+                {
+                    pixels[idx].hasVisiblePoint = false;
+                }
+            }
+
+            timer.begin("grid build");
+            buildGrid();
+
+            // photon pass
+            timer.begin("photon pass");
+#pragma omp parallel for schedule(dynamic)
+            for (int chunk = 0; chunk < n_chunks; ++chunk)
+            {
+                UniformSampler sampler;
+
+                const int n =
+                    std::min(photonChunkSize, nPhotonsPerPass - chunk * photonChunkSize);
+                for (int k = 0; k < n; ++k)
+                {
+                    // NOTE: every pass has its own stream of photons
+                    sampler.startPixelSample(photonStream + pass,
+                                             chunk * photonChunkSize + k);
+                    PM_STATS_ADD(photons, 1);
+                    tracePhoton(scene, sampler);
+                }
+            }
+
+            timer.begin("pixel update");
+            updatePixels();
+        }
+        timer.end();
+
+        // write radiance estimate
+        for (int idx = 0; idx < n_pixels; ++idx)
+        {
+            const PixelState &pixel = pixels[idx];
+            Vec3f L = pixel.Ld / nPasses;
+            if (pixel.radius2 > 0)
+            {
+                L += pixel.tau / (static_cast<float>(nPasses) * nPhotonsPerPass *
+                                  PI * pixel.radius2);
+            }
+            image.setPixel(idx / width, idx % width, L);
+        }
+
+        const double time = std::chrono::duration<double>(
+                                std::chrono::steady_clock::now() - start)
+                                .count();
+        std::cout << "Rendered " << nPasses << " passes of " << nPhotonsPerPass
+                  << " photons in " << time << "s" << std::endl;
+    }
+};
+
+#endif
@@ -0,0 +1,178 @@
+#ifndef _STATS_H
+#define _STATS_H
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+// event counters of one thread
+// NOTE: padded to a cache line, so that threads don't share lines
+struct alignas(64) ThreadCounters
+{
+    uint64_t rays = 0;        // closest hit queries
+    uint64_t shadowRays = 0;  // occlusion queries
+    uint64_t photons = 0;     // emitted photons
+    uint64_t knnQueries = 0;  // k-nearest photon queries
+    uint64_t radiusQueries = 0;
+    uint64_t irradianceLookups = 0;
+    uint64_t cameraSamples = 0;
+    uint64_t chunkLoads = 0; // out-of-core photon chunks paged in
+
+    ThreadCounters &operator+=(const ThreadCounters &other)
+    {
+        rays += other.rays;
+        shadowRays += other.shadowRays;
+        photons += other.photons;
+        knnQueries += other.knnQueries;
+        radiusQueries += other.radiusQueries;
+        irradianceLookups += other.irradianceLookups;
+        cameraSamples += other.cameraSamples;
+        chunkLoads += other.chunkLoads;
+        return *this;
+    }
+};
+
+// counters of all threads
+// NOTE: each thread increments its own counters without atomics(like pbrt's
+// stats), so they are only read and reset outside of parallel regions
+class Stats
+{
+private:
+    std::mutex mutex;
+    // NOTE: deque keeps counters in place when a thread registers, and counters
+    // of finished threads are kept
+    std::deque<ThreadCounters> threads;
+
+    ThreadCounters *registerThread()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return &threads.emplace_back();
+    }
+
+public:
+    static Stats &get()
+    {
+        static Stats stats;
+        return stats;
+    }
+
+    // counters of the calling thread
+    static ThreadCounters &counters()
+    {
+        thread_local ThreadCounters *counters = get().registerThread();
+        return *counters;
+    }
+
+    // counters of each thread in order of the first count
+    std::vector<ThreadCounters> getPerThread()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return std::vector<ThreadCounters>(threads.begin(), threads.end());
+    }
+
+    ThreadCounters getTotal()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        ThreadCounters total;
+        for (const auto &counters : threads)
+        {
+            total += counters;
+        }
+        return total;
+    }
+
+    void reset()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto &counters : threads)
+        {
+            counters = ThreadCounters();
+        }
+    }
+};
+
+// add n events to a counter of the calling thread
+// NOTE: compiled out unless PM_ENABLE_STATS is defined, so that renders don't
+// pay for the thread_local lookup in hot paths
+#ifdef PM_ENABLE_STATS
+#define PM_STATS_ADD(counter, n) (Stats::counters().counter += (n))
+#else
+#define PM_STATS_ADD(counter, n) ((void)0)
+#endif
+
+// wall time of named phases in order of the first measurement
+class PhaseTimes
+{
+private:
+    std::vector<std::pair<std::string, double>> phases;
+
+public:
+    // add seconds to the phase, repeated phases are summed
+    void add(const std::string &name, double seconds)
+    {
+        for (auto &[phase, total] : phases)
+        {
+            if (phase == name)
+            {
+                total += seconds;
+                return;
+            }
+        }
+        phases.emplace_back(name, seconds);
+    }
+
+    // seconds of the phase, 0 if never measured
+    double get(const std::string &name) const
+    {
+        for (const auto &[phase, seconds] : phases)
+        {
+            if (phase == name)
+                return seconds;
+        }
+        return 0;
+    }
+
+    const std::vector<std::pair<std::string, double>> &getPhases() const
+    {
+        return phases;
+    }
+
+    void clear() { phases.clear(); }
+};
+
+// measure consecutive phases, each one ends when the next begins
+class PhaseTimer
+{
+private:
+    using Clock = std::chrono::steady_clock;
+
+    PhaseTimes &times;
+    std::string name;
+    Clock::time_point start;
+
+public:
+    PhaseTimer(PhaseTimes &times) : times(times) {}
+    ~PhaseTimer() { end(); }
+
+    void begin(const std::string &name)
+    {
+        end();
+        this->name = name;
+        start = Clock::now();
+    }
+
+    void end()
+    {
+        if (name.empty())
+            return;
+        times.add(name,
+                  std::chrono::duration<double>(Clock::now() - start).count());
+        name.clear();
+    }
+};
+
+#endif
@@ -26,6 +26,15 @@ public:
           texcoords(texcoords),
           faceID(faceID)
     {
+        update(vertices);
+    }
+
+    // recompute geometric normal and surface area after vertices moved
+    // NOTE: vertices may have been copied to another array
+    void update(const float *vertices)
+    {
+        this->vertices = vertices;
+
         const Vec3ui vidx = getIndices();
         const Vec3f p1 = getVertexPosition(vidx[0]);
         const Vec3f p2 = getVertexPosition(vidx[1]);
@@ -38,6 +47,8 @@ public:
         surfaceArea = 0.5f * length(cross(p2 - p1, p3 - p1));
     }
 
+    float getSurfaceArea() const { return surfaceArea; }
+
     // return vertex position
     Vec3f getVertexPosition(uint32_t vertexID) const
     {
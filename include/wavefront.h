@@ -0,0 +1,413 @@
+#ifndef _WAVEFRONT_H
+#define _WAVEFRONT_H
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <vector>
+
+#include "integrator.h"
+
+// kind of path stored in the wavefront queue
+enum class PathType : uint8_t
+{
+    CAMERA,   // path from camera, hits are shaded as in integrateRecursive
+    GATHERING // final gathering path, hits are shaded as in
+              // computeIndirectIlluminationRecursive
+};
+
+// SoA queue of paths waiting for intersection
+struct PathQueue
+{
+    std::vector<Ray> rays;
+    std::vector<Vec3f> throughputs;
+    std::vector<int> pixels; // index of camera ray the path contributes to
+    std::vector<int> depths;
+    std::vector<PathType> types;
+
+    int size() const { return rays.size(); }
+
+    void clear()
+    {
+        rays.clear();
+        throughputs.clear();
+        pixels.clear();
+        depths.clear();
+        types.clear();
+    }
+
+    void push(const Ray &ray, const Vec3f &throughput, int pixel, int depth,
+              const PathType &type)
+    {
+        rays.push_back(ray);
+        throughputs.push_back(throughput);
+        pixels.push_back(pixel);
+        depths.push_back(depth);
+        types.push_back(type);
+    }
+};
+
+// photon mapping evaluated breadth-first
+// NOTE: every stage processes a whole queue of paths, so that rays are traced
+// in packets and photon lookups are answered in morton order. the estimate
+// equals integrateRecursive, only the order of consumed random numbers differs
+// NOTE: queues are per render thread and hold the camera rays of one tile
+// (tile pixels x SPP, at most Renderer::maxBatchRays), not of all tiles in
+// flight, so the batch size grows with --tile-size
+class WavefrontPhotonMapping : public PhotonMapping
+{
+private:
+    // scratch queues of one render thread
+    struct Queues
+    {
+        PathQueue current;
+        PathQueue next;
+        std::vector<IntersectInfo> infos;
+        std::unique_ptr<bool[]> hits;
+        int hitsCapacity = 0;
+
+        // indices into current queue of diffuse hits to shade
+        std::vector<int> diffuse;
+        // indices into current queue of specular hits to continue
+        std::vector<int> specular;
+
+        // shadow rays of diffuse hits and their unoccluded contribution
+        std::vector<Ray> shadowRays;
+        std::vector<Vec3f> shadowRadiance;
+        std::vector<int> shadowPixels;
+        std::unique_ptr<bool[]> occluded;
+        int occludedCapacity = 0;
+
+        // deferred photon map lookups, with pixel and throughput of their path
+        // NOTE: lookups of final gathering rays are kept apart, since only they
+        // may use precomputed irradiance
+        PhotonLookupBatch globalLookups;
+        std::vector<int> globalPixels;
+        std::vector<Vec3f> globalThroughputs;
+        PhotonLookupBatch gatheringLookups;
+        std::vector<int> gatheringPixels;
+        std::vector<Vec3f> gatheringThroughputs;
+        PhotonLookupBatch causticsLookups;
+        std::vector<int> causticsPixels;
+        std::vector<Vec3f> causticsThroughputs;
+
+        void clearLookups()
+        {
+            globalLookups.clear();
+            globalPixels.clear();
+            globalThroughputs.clear();
+            gatheringLookups.clear();
+            gatheringPixels.clear();
+            gatheringThroughputs.clear();
+            causticsLookups.clear();
+            causticsPixels.clear();
+            causticsThroughputs.clear();
+        }
+
+        void pushGlobalLookup(const Vec3f &wo, const IntersectInfo &info,
+                              int pixel, const Vec3f &throughput)
+        {
+            globalLookups.push(wo, info);
+            globalPixels.push_back(pixel);
+            globalThroughputs.push_back(throughput);
+        }
+
+        void pushGatheringLookup(const Vec3f &wo, const IntersectInfo &info,
+                                 int pixel, const Vec3f &throughput)
+        {
+            gatheringLookups.push(wo, info);
+            gatheringPixels.push_back(pixel);
+            gatheringThroughputs.push_back(throughput);
+        }
+
+        void pushCausticsLookup(const Vec3f &wo, const IntersectInfo &info,
+                                int pixel, const Vec3f &throughput)
+        {
+            causticsLookups.push(wo, info);
+            causticsPixels.push_back(pixel);
+            causticsThroughputs.push_back(throughput);
+        }
+
+        void reserveHits(int n)
+        {
+            infos.resize(n);
+            if (n > hitsCapacity)
+            {
+                hits = std::make_unique<bool[]>(n);
+                hitsCapacity = n;
+            }
+        }
+
+        void reserveOccluded(int n)
+        {
+            if (n > occludedCapacity)
+            {
+                occluded = std::make_unique<bool[]>(n);
+                occludedCapacity = n;
+            }
+        }
+    };
+
+    // intersect all paths of the queue
+    void intersectStage(const Scene &scene, Queues &q) const
+    {
+        const int n = q.current.size();
+        q.reserveHits(n);
+        scene.intersectN(q.current.rays.data(), n, q.infos.data(), q.hits.get());
+    }
+
+    // sort hits by BxDF type, terminate paths whose radiance is known here
+    // NOTE: photon map lookups are deferred to resolveLookupsStage
+    void classifyStage(Queues &q, Vec3f *radiance) const
+    {
+        q.diffuse.clear();
+        q.specular.clear();
+        q.clearLookups();
+
+        const PathQueue &paths = q.current;
+        for (int i = 0; i < paths.size(); ++i)
+        {
+            // ray goes out to the sky
+            if (!q.hits[i])
+                continue;
+
+            const IntersectInfo &info = q.infos[i];
+            const Vec3f wo = -paths.rays[i].direction;
+            const BxDFType bxdf_type = info.hitPrimitive->getBxDFType();
+
+            if (paths.types[i] == PathType::CAMERA)
+            {
+                // when directly hitting light
+                if (info.hitPrimitive->hasAreaLight())
+                {
+                    radiance[paths.pixels[i]] +=
+                        paths.throughputs[i] * info.hitPrimitive->Le(info.surfaceInfo, wo);
+                }
+                else if (bxdf_type == BxDFType::DIFFUSE)
+                {
+                    if (paths.depths[i] >= finalGatheringDepth)
+                    {
+                        q.pushGlobalLookup(wo, info, paths.pixels[i],
+                                           paths.throughputs[i]);
+                    }
+                    else
+                    {
+                        q.diffuse.push_back(i);
+                    }
+                }
+                else if (bxdf_type == BxDFType::SPECULAR)
+                {
+                    q.specular.push_back(i);
+                }
+                else
+                {
+                    std::cout << "Error: Invalid BxDF type!" << std::endl;
+                }
+            }
+            else
+            {
+                // when hitting diffuse, compute radiance with photon map
+                if (bxdf_type == BxDFType::DIFFUSE)
+                {
+                    q.pushGatheringLookup(wo, info, paths.pixels[i],
+                                          paths.throughputs[i]);
+                }
+                // when hitting specular, continue gathering
+                else if (bxdf_type == BxDFType::SPECULAR)
+                {
+                    q.specular.push_back(i);
+                }
+            }
+        }
+    }
+
+    // NEE, caustics and final gathering ray of diffuse hits on camera paths
+    void shadeDiffuseStage(const Scene &scene, Sampler &sampler, Queues &q,
+                           Vec3f *radiance) const
+    {
+        const PathQueue &paths = q.current;
+
+        q.shadowRays.clear();
+        q.shadowRadiance.clear();
+        q.shadowPixels.clear();
+
+        for (const int i : q.diffuse)
+        {
+            const IntersectInfo &info = q.infos[i];
+            const Vec3f wo = -paths.rays[i].direction;
+            const Vec3f &throughput = paths.throughputs[i];
+            const int pixel = paths.pixels[i];
+
+            // sample light, shadow ray is traced later with the others
+            Ray ray_shadow;
+            const Vec3f Ld =
+                sampleDirectIllumination(scene, wo, info, sampler, ray_shadow);
+            q.shadowRays.push_back(ray_shadow);
+            q.shadowRadiance.push_back(throughput * Ld);
+            q.shadowPixels.push_back(pixel);
+
+            // compute caustics illumination with caustics photon map
+            q.pushCausticsLookup(wo, info, pixel, throughput);
+
+            // spawn final gathering ray
+            if (0 < maxDepth)
+            {
+                Vec3f dir;
+                float pdf_dir;
+                const Vec3f f = info.hitPrimitive->sampleBxDF(
+                    wo, info.surfaceInfo, TransportDirection::FROM_CAMERA, sampler,
+                    dir, pdf_dir);
+                const float cos = std::abs(dot(info.surfaceInfo.shadingNormal, dir));
+                q.next.push(Ray(info.surfaceInfo.position, dir),
+                            throughput * f * cos / pdf_dir, pixel, 0,
+                            PathType::GATHERING);
+            }
+        }
+
+        // trace all shadow rays at once
+        const int n_shadow = q.shadowRays.size();
+        q.reserveOccluded(n_shadow);
+        scene.occludedN(q.shadowRays.data(), n_shadow, q.occluded.get());
+        for (int i = 0; i < n_shadow; ++i)
+        {
+            if (!q.occluded[i])
+            {
+                radiance[q.shadowPixels[i]] += q.shadowRadiance[i];
+            }
+        }
+    }
+
+    // answer deferred photon map lookups as batches sorted by position
+    void resolveLookupsStage(Queues &q, Vec3f *radiance) const
+    {
+        computeRadianceWithPhotonMapBatch(q.globalLookups);
+        for (int i = 0; i < q.globalLookups.size(); ++i)
+        {
+            radiance[q.globalPixels[i]] +=
+                q.globalThroughputs[i] * q.globalLookups.radiance[i];
+        }
+
+        computeGatheredRadianceWithPhotonMapBatch(q.gatheringLookups);
+        for (int i = 0; i < q.gatheringLookups.size(); ++i)
+        {
+            radiance[q.gatheringPixels[i]] +=
+                q.gatheringThroughputs[i] * q.gatheringLookups.radiance[i];
+        }
+
+        computeCausticsWithPhotonMapBatch(q.causticsLookups);
+        for (int i = 0; i < q.causticsLookups.size(); ++i)
+        {
+            radiance[q.causticsPixels[i]] +=
+                q.causticsThroughputs[i] * q.causticsLookups.radiance[i];
+        }
+    }
+
+    // generate next rays of specular hits
+    void continueSpecularStage(Sampler &sampler, Queues &q) const
+    {
+        const PathQueue &paths = q.current;
+        for (const int i : q.specular)
+        {
+            const IntersectInfo &info = q.infos[i];
+            const Vec3f wo = -paths.rays[i].direction;
+            const Vec3f &throughput = paths.throughputs[i];
+            const int pixel = paths.pixels[i];
+            const int depth = paths.depths[i] + 1;
+
+            // path is terminated at the next intersection anyway
+            if (depth >= maxDepth)
+                continue;
+
+            if (paths.types[i] == PathType::GATHERING)
+            {
+                // sample direction by BxDF
+                Vec3f dir;
+                float pdf_dir;
+                const Vec3f f = info.hitPrimitive->sampleBxDF(
+                    wo, info.surfaceInfo, TransportDirection::FROM_CAMERA, sampler,
+                    dir, pdf_dir);
+                const float cos = std::abs(dot(info.surfaceInfo.shadingNormal, dir));
+                q.next.push(Ray(info.surfaceInfo.position, dir),
+                            throughput * f * cos / pdf_dir, pixel, depth,
+                            PathType::GATHERING);
+            }
+            else if (paths.depths[i] >= 3)
+            {
+                // sample direction by BxDF
+                Vec3f dir;
+                float pdf_dir;
+                const Vec3f f = info.hitPrimitive->sampleBxDF(
+                    wo, info.surfaceInfo, TransportDirection::FROM_CAMERA, sampler,
+                    dir, pdf_dir);
+                const Vec3f f_cos = f *
+                                    cosTerm(wo, dir, info.surfaceInfo,
+                                            TransportDirection::FROM_CAMERA) /
+                                    pdf_dir;
+                q.next.push(Ray(info.surfaceInfo.position, dir), throughput * f_cos,
+                            pixel, depth, PathType::CAMERA);
+            }
+            // sample all direction at shallow depth
+            // NOTE: to prevent noise at fresnel reflection
+            else
+            {
+                const DirectionPairs dir_pairs =
+                    info.hitPrimitive->sampleAllBxDF(wo, info.surfaceInfo,
+                                                     TransportDirection::FROM_CAMERA);
+                for (const auto &dp : dir_pairs)
+                {
+                    const Vec3f dir = dp.first;
+                    const Vec3f f = dp.second;
+                    q.next.push(Ray(info.surfaceInfo.position, dir),
+                                throughput * f *
+                                    std::abs(dot(dir, info.surfaceInfo.shadingNormal)),
+                                pixel, depth, PathType::CAMERA);
+                }
+            }
+        }
+    }
+
+public:
+    using PhotonMapping::PhotonMapping;
+
+    Vec3f integrate(const Ray &ray, const Scene &scene,
+                    Sampler &sampler) const override
+    {
+        Vec3f radiance;
+        integrateN(&ray, 1, scene, sampler, &radiance);
+        return radiance;
+    }
+
+    void integrateN(const Ray *rays, int nRays, const Scene &scene,
+                    Sampler &sampler, Vec3f *radiance) const override
+    {
+        // NOTE: each render thread reuses its queues for the whole frame
+        thread_local Queues q;
+
+        // generate camera paths
+        q.current.clear();
+        for (int i = 0; i < nRays; ++i)
+        {
+            radiance[i] = Vec3f(0);
+            if (0 < maxDepth)
+            {
+                q.current.push(rays[i], Vec3f(1), i, 0, PathType::CAMERA);
+            }
+        }
+
+        while (q.current.size() > 0)
+        {
+            q.next.clear();
+
+            intersectStage(scene, q);
+            classifyStage(q, radiance);
+            shadeDiffuseStage(scene, sampler, q, radiance);
+            resolveLookupsStage(q, radiance);
+            continueSpecularStage(sampler, q);
+
+            std::swap(q.current, q.next);
+        }
+    }
+
+    bool isWavefront() const override { return true; }
+};
+
+#endif
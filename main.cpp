@@ -1,12 +1,57 @@
+#include <algorithm>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
 #include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
 #include "camera.h"
+#include "distributed.h"
 #include "image.h"
 #include "integrator.h"
+#include "options.h"
 #include "photon_map.h"
+#include "renderer.h"
 #include "scene.h"
+#include "sppm.h"
+#include "wavefront.h"
 
-int main(int, char **c)
+// output file of the given frame, numbered before the extension
+// e.g. output.ppm -> output_0003.ppm
+std::string getFrameOutput(const std::string &output, int frame)
 {
+    char number[16];
+    std::snprintf(number, sizeof(number), "_%04d", frame);
+    const size_t dot = output.rfind('.');
+    if (dot == std::string::npos || output.find('/', dot) != std::string::npos)
+        return output + number;
+    return output.substr(0, dot) + number + output.substr(dot);
+}
+
+// read cameras of each frame, one line of position and forward direction
+// "px py pz dx dy dz" per frame
+bool loadCameraPath(const std::string &filename, std::vector<Camera> &cameras)
+{
+    std::ifstream file(filename);
+    if (!file)
+        return false;
+
+    cameras.clear();
+    Vec3f position, forward;
+    while (file >> position[0] >> position[1] >> position[2] >> forward[0] >>
+           forward[1] >> forward[2])
+    {
+        cameras.emplace_back(position, normalize(forward), 0.25 * PI);
+    }
+    return !cameras.empty();
+}
+
+int main(int argc, char **c)
+{
+    // NOTE: with PM_ENABLE_MPI every rank runs main, root writes the output
+    Communicator communicator(argc, c);
+
     const int width = atoi(c[1]);
     const int height = atoi(c[2]);
     const int n_samples = atoi(c[3]);
@@ -17,66 +62,400 @@ int main(int, char **c)
     const int final_gathering_depth = atoi(c[8]);
     const int max_depth = atoi(c[9]);
 
-    Image image(width, height);
-    Camera camera(Vec3f(0, 1, 6), Vec3f(0, 0, -1), 0.25 * PI);
+    // optional arguments
+    // NOTE: radius > 0 switches the photon map to fixed radius estimation
+    float global_radius = 0;
+    float caustics_radius = 0;
+    PhotonMapLayout photon_map_layout = PhotonMapLayout::KD_TREE;
+    PhotonFormat photon_format = PhotonFormat::FULL;
+    int irradiance_stride = 0;
+    int tile_size = 16;
+    bool wavefront = false;
+    bool sppm = false;
+    float sppm_radius = 0.05f;
+    PhotonEmission photon_emission = PhotonEmission::UNIFORM;
+    bool scene_cache = true;
+    std::string photon_map_cache;
+    std::string output = "output.ppm";
+    float adaptive_threshold = 0;
+    SamplerType sampler_type = SamplerType::UNIFORM;
+    std::string sample_map;
+    int n_frames = 1;
+    std::string camera_path;
+    std::string move_material;
+    Vec3f move_offset;
+    bool selective_update = true;
+    std::string out_of_core_dir;
+    float out_of_core_memory = 256; // MB
+    for (int i = 10; i < argc; ++i)
+    {
+        const std::string arg = c[i];
+        std::string value;
+        if (parseOption(arg, "global-radius", value))
+        {
+            global_radius = std::stof(value);
+        }
+        else if (parseOption(arg, "caustics-radius", value))
+        {
+            caustics_radius = std::stof(value);
+        }
+        else if (parseOption(arg, "photon-map-layout", value))
+        {
+            if (value == "left-balanced")
+            {
+                photon_map_layout = PhotonMapLayout::LEFT_BALANCED;
+            }
+            else if (value == "bucketed")
+            {
+                photon_map_layout = PhotonMapLayout::BUCKETED;
+            }
+            else if (value == "out-of-core")
+            {
+                photon_map_layout = PhotonMapLayout::OUT_OF_CORE;
+            }
+            else if (value != "kd-tree")
+            {
+                std::cout << "Warning: Unknown photon map layout " << value
+                          << std::endl;
+            }
+        }
+        else if (parseOption(arg, "tile-size", value))
+        {
+            tile_size = std::max(std::stoi(value), 1);
+        }
+        else if (parseOption(arg, "irradiance-stride", value))
+        {
+            irradiance_stride = std::stoi(value);
+        }
+        else if (parseOption(arg, "integrator", value))
+        {
+            if (value == "wavefront")
+            {
+                wavefront = true;
+            }
+            else if (value == "sppm")
+            {
+                sppm = true;
+            }
+            else if (value != "recursive")
+            {
+                std::cout << "Warning: Unknown integrator " << value << std::endl;
+            }
+        }
+        else if (parseOption(arg, "sppm-radius", value))
+        {
+            const float radius = std::stof(value);
+            if (radius > 0)
+            {
+                sppm_radius = radius;
+            }
+            else
+            {
+                std::cout << "Warning: --sppm-radius must be positive, using "
+                          << sppm_radius << std::endl;
+            }
+        }
+        else if (parseOption(arg, "photon-emission", value))
+        {
+            if (value == "importance")
+            {
+                photon_emission = PhotonEmission::IMPORTANCE;
+            }
+            else if (value != "uniform")
+            {
+                std::cout << "Warning: Unknown photon emission " << value
+                          << std::endl;
+            }
+        }
+        else if (parseOption(arg, "scene-cache", value))
+        {
+            if (value == "off")
+            {
+                scene_cache = false;
+            }
+            else if (value != "on")
+            {
+                std::cout << "Warning: Unknown scene cache mode " << value
+                          << std::endl;
+            }
+        }
+        else if (parseOption(arg, "photon-map-cache", value))
+        {
+            photon_map_cache = value;
+        }
+        else if (parseOption(arg, "output", value))
+        {
+            output = value;
+        }
+        else if (parseOption(arg, "adaptive-threshold", value))
+        {
+            adaptive_threshold = std::stof(value);
+        }
+        else if (parseOption(arg, "sampler", value))
+        {
+            if (value == "sobol")
+            {
+                sampler_type = SamplerType::SOBOL;
+            }
+            else if (value == "halton")
+            {
+                sampler_type = SamplerType::HALTON;
+            }
+            else if (value != "uniform")
+            {
+                std::cout << "Warning: Unknown sampler " << value << std::endl;
+            }
+        }
+        else if (parseOption(arg, "sample-map", value))
+        {
+            sample_map = value;
+        }
+        else if (parseOption(arg, "photon-format", value))
+        {
+            if (value == "compact")
+            {
+                photon_format = PhotonFormat::COMPACT;
+            }
+            else if (value != "full")
+            {
+                std::cout << "Warning: Unknown photon format " << value
+                          << std::endl;
+            }
+        }
+        else if (parseOption(arg, "out-of-core-dir", value))
+        {
+            out_of_core_dir = value;
+        }
+        else if (parseOption(arg, "out-of-core-memory", value))
+        {
+            out_of_core_memory = std::stof(value);
+        }
+        else if (parseOption(arg, "frames", value))
+        {
+            n_frames = std::max(std::stoi(value), 1);
+        }
+        else if (parseOption(arg, "camera-path", value))
+        {
+            camera_path = value;
+        }
+        else if (parseOption(arg, "move-material", value))
+        {
+            move_material = value;
+        }
+        else if (parseOption(arg, "move-offset", value))
+        {
+            if (std::sscanf(value.c_str(), "%f,%f,%f", &move_offset[0],
+                            &move_offset[1], &move_offset[2]) != 3)
+            {
+                std::cout << "Warning: Invalid move offset " << value << std::endl;
+            }
+        }
+        else if (parseOption(arg, "photon-update", value))
+        {
+            if (value == "full")
+            {
+                selective_update = false;
+            }
+            else if (value != "selective")
+            {
+                std::cout << "Warning: Unknown photon update " << value
+                          << std::endl;
+            }
+        }
+        else
+        {
+            std::cout << "Warning: Unknown argument " << arg << std::endl;
+        }
+    }
+
+    const ImageFormat output_format = getImageFormat(output);
+    ToneMapping tone_mapping;
+    tone_mapping.gamma = 2.2f;
+
+    // camera of each frame, the last one holds for remaining frames
+    std::vector<Camera> cameras;
+    if (!camera_path.empty())
+    {
+        if (!loadCameraPath(camera_path, cameras))
+        {
+            std::cout << "Error: Failed to load camera path " << camera_path
+                      << std::endl;
+            return 1;
+        }
+    }
+    else
+    {
+        cameras.emplace_back(Vec3f(0, 1, 6), Vec3f(0, 0, -1), 0.25 * PI);
+    }
 
     Scene scene;
-    scene.loadModel("cornellbox-water2.obj");
+    scene.loadModel("cornellbox-water2.obj", scene_cache);
+
+    // faces moved by offset every frame after the first
+    // NOTE: dynamic scene refits its BVH after they moved
+    std::vector<uint32_t> move_faces;
+    if (!move_material.empty())
+    {
+        move_faces = scene.getFacesWithMaterial(move_material);
+        if (move_faces.empty())
+        {
+            std::cout << "Warning: No faces with material " << move_material
+                      << std::endl;
+        }
+    }
+    const bool moving = n_frames > 1 && !move_faces.empty();
+    scene.setDynamic(moving);
     scene.build();
 
-    // photon tracing and build photon map
-    PhotonMapping integrator(n_photons, n_estimation_global,
-                             n_photons_caustics_multiplier, n_estimation_caustics,
-                             final_gathering_depth, max_depth);
-    UniformSampler sampler;
-    integrator.build(scene, sampler);
+    if (sppm)
+    {
+        if (communicator.getSize() > 1)
+        {
+            if (!communicator.isRoot())
+                return 0;
+            std::cout << "Warning: sppm is rendered by root only" << std::endl;
+        }
+
+        // NOTE: SPP is the number of camera/photon passes, number of photons is
+        // traced per pass
+        ProgressivePhotonMapping integrator(n_photons, sppm_radius, max_depth);
+        for (int frame = 0; frame < n_frames; ++frame)
+        {
+            if (frame > 0 && moving)
+            {
+                scene.moveFaces(move_faces, move_offset);
+            }
 
-    std::cout << "Tracing rays from camera..." << std::endl;
-#pragma omp parallel for collapse(2) schedule(dynamic, 1)
-    for (int i = 0; i < height; ++i)
+            const Camera &camera = cameras[std::min<size_t>(frame, cameras.size() - 1)];
+            const std::string frame_output =
+                n_frames > 1 ? getFrameOutput(output, frame) : output;
+            Image image(width, height);
+            integrator.render(scene, camera, n_samples, image);
+            image.write(frame_output, output_format, tone_mapping);
+        }
+    }
+    else
     {
-        for (int j = 0; j < width; ++j)
+        // photon tracing and build photon map
+        std::unique_ptr<PhotonMapping> integrator;
+        if (wavefront)
+        {
+            integrator = std::make_unique<WavefrontPhotonMapping>(
+                n_photons, n_estimation_global, n_photons_caustics_multiplier,
+                n_estimation_caustics, final_gathering_depth, max_depth);
+        }
+        else
+        {
+            integrator = std::make_unique<PhotonMapping>(
+                n_photons, n_estimation_global, n_photons_caustics_multiplier,
+                n_estimation_caustics, final_gathering_depth, max_depth);
+        }
+        integrator->setPhotonMapLayout(photon_map_layout);
+        integrator->setPhotonFormat(photon_format);
+        integrator->setIrradianceStride(irradiance_stride);
+        integrator->setPhotonEmission(photon_emission);
+        // NOTE: visual importance follows the camera of the first frame
+        integrator->setCamera(cameras.front(), static_cast<float>(width) / height);
+        integrator->setPhotonMapCache(photon_map_cache);
+        integrator->setCommunicator(&communicator);
+        integrator->setPathLogging(moving && selective_update);
+        if (photon_map_layout == PhotonMapLayout::OUT_OF_CORE)
+        {
+            integrator->setPhotonMapOutOfCore(
+                out_of_core_dir.empty() ? std::filesystem::temp_directory_path()
+                                        : std::filesystem::path(out_of_core_dir),
+                static_cast<size_t>(out_of_core_memory * (1 << 20)));
+        }
+        if (global_radius > 0)
+        {
+            integrator->setGlobalEstimation(PhotonEstimation::FIXED_RADIUS, global_radius);
+        }
+        if (caustics_radius > 0)
+        {
+            integrator->setCausticsEstimation(PhotonEstimation::FIXED_RADIUS,
+                                              caustics_radius);
+        }
+        std::unique_ptr<Sampler> sampler;
+        if (sampler_type == SamplerType::SOBOL)
         {
-            // init sampler
-            UniformSampler sampler(j + width * i);
+            sampler = std::make_unique<SobolSampler>();
+        }
+        else if (sampler_type == SamplerType::HALTON)
+        {
+            sampler = std::make_unique<HaltonSampler>();
+        }
+        else
+        {
+            sampler = std::make_unique<UniformSampler>();
+        }
+        integrator->build(scene, *sampler);
 
-            for (int k = 0; k < n_samples; ++k)
+        Renderer renderer(tile_size);
+        renderer.setSampler(*sampler);
+        renderer.setAdaptiveSampling(adaptive_threshold);
+        tone_mapping.divisor = n_samples;
+
+        // scene and photon maps are kept between frames, only photons whose
+        // paths touch the moved faces are traced again
+        for (int frame = 0; frame < n_frames; ++frame)
+        {
+            if (frame > 0 && moving)
             {
-                const float u = (2.0f * (j + sampler.getNext1D()) - width) / height;
-                const float v = (2.0f * (i + sampler.getNext1D()) - height) / height;
+                const std::vector<uint32_t> moved_faces =
+                    scene.moveFaces(move_faces, move_offset);
+                integrator->update(scene, *sampler, moved_faces);
+            }
+
+            const Camera &camera = cameras[std::min<size_t>(frame, cameras.size() - 1)];
+            const std::string frame_output =
+                n_frames > 1 ? getFrameOutput(output, frame) : output;
 
-                Ray ray;
-                float pdf;
-                if (camera.sampleRay(Vec2f(u, v), ray, pdf))
+            // ranks render their own tiles into an image, which is summed on
+            // root
+            if (communicator.getSize() > 1)
+            {
+                if (frame == 0 && !sample_map.empty())
                 {
-                    const Vec3f radiance =
-                        integrator.integrate(ray, scene, sampler) / pdf;
-
-                    if (std::isnan(radiance[0]) || std::isnan(radiance[1]) ||
-                        std::isnan(radiance[2]))
-                    {
-                        std::cout << "Error: Radiance of pixel [" << i << "," << j << "] is NaN!" << std::endl;
-                        continue;
-                    }
-                    else if (radiance[0] < 0 || radiance[1] < 0 || radiance[2] < 0)
-                    {
-                        std::cout << "Error: Radiance of pixel [" << i << "," << j << "] is minus!" << std::endl;
-                        continue;
-                    }
-
-                    image.addPixel(i, j, radiance);
+                    std::cout << "Warning: Sample map is not written by several ranks"
+                              << std::endl;
                 }
-                else
+
+                std::cout << "Tracing rays from camera..." << std::endl;
+                renderer.setCommunicator(&communicator);
+                Image image(width, height);
+                renderer.render(*integrator, scene, camera, n_samples, image);
+                if (communicator.isRoot())
                 {
-                    image.setPixel(i, j, Vec3f(0));
+                    image.write(frame_output, output_format, tone_mapping);
                 }
+                continue;
             }
-        }
-    }
 
-    // take average
-    image.divide(n_samples);
+            // tiles are written to the file as they finish, averaged over
+            // samples
+            ImageWriter writer;
+            if (!writer.open(frame_output, width, height, output_format,
+                             tone_mapping))
+                return 1;
 
-    image.gammaCorrection(2.2f);
-    image.writePPM("output.ppm");
-}
\ No newline at end of file
+            // number of samples of each pixel, relative to the maximum
+            ImageWriter sample_map_writer;
+            if (adaptive_threshold > 0 && !sample_map.empty())
+            {
+                const std::string frame_sample_map =
+                    n_frames > 1 ? getFrameOutput(sample_map, frame) : sample_map;
+                ToneMapping sample_mapping;
+                sample_mapping.divisor = Renderer::maxSamplesMultiplier * n_samples;
+                sample_map_writer.open(frame_sample_map, width, height,
+                                       getImageFormat(frame_sample_map),
+                                       sample_mapping);
+            }
+
+            std::cout << "Tracing rays from camera..." << std::endl;
+            renderer.setSampleMap(sample_map_writer.isOpen() ? &sample_map_writer
+                                                             : nullptr);
+            renderer.render(*integrator, scene, camera, n_samples, width, height,
+                            writer);
+        }
+    }
+}